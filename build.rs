@@ -7,6 +7,30 @@ extern crate bindgen;
 #[path = "src/modalias.rs"]
 mod modalias;
 
+#[allow(dead_code)]
+#[path = "src/datafile.rs"]
+mod datafile;
+
+#[allow(dead_code)]
+#[path = "src/rdesc_patch.rs"]
+mod rdesc_patch;
+
+#[allow(dead_code)]
+#[path = "src/event_transform.rs"]
+mod event_transform;
+
+#[allow(dead_code)]
+#[path = "src/rodata.rs"]
+mod rodata;
+
+#[allow(dead_code)]
+#[path = "src/rdesc.rs"]
+mod rdesc;
+
+#[allow(dead_code)]
+#[path = "src/signature.rs"]
+mod signature;
+
 use crate::modalias::Modalias;
 use libbpf_cargo::SkeletonBuilder;
 use libbpf_rs;
@@ -19,33 +43,368 @@ const DIR: &str = "./src/bpf/";
 const ATTACH_PROG: &str = "attach.bpf.c";
 const WRAPPER: &str = "./src/hid_bpf_wrapper.h";
 const TARGET_DIR: &str = "bpf"; // inside $CARGO_TARGET_DIR
+const RDESC_DIR: &str = "rdesc"; // inside $OUT_DIR
+const ISA_VARIANTS: [u32; 2] = [3, 4]; // -mcpu of the objects in vN/, see src/bpf.rs
+const STRUCT_OPS_DIR: &str = "struct_ops"; // objects built for the struct_ops backend, see src/bpf.rs
+const HELPER_LIB: &str = "hid_bpf_lib.bpf.c"; // linked into every object, see link_objects()
+const PARTS_DIR: &str = "parts"; // inside $OUT_DIR, the objects before linking
 
-fn build_bpf_file(
+/// Generate `<name>.rdesc.h` from `<name>.rdesc`: the report descriptor as
+/// a C array and the accessors of its fields, see rdesc::c_header()
+fn generate_rdesc_header(
+    rdesc_file: &std::path::Path,
+    include_dir: &std::path::Path,
+) -> std::io::Result<()> {
+    let fname = rdesc_file.file_name().unwrap().to_str().unwrap();
+    let prefix = fname.trim_end_matches(".rdesc").replace(['-', '.'], "_");
+    let rdesc = rdesc::parse_rdesc_file(&std::fs::read_to_string(rdesc_file)?)?;
+
+    std::fs::write(
+        include_dir.join(format!("{fname}.h")),
+        rdesc::c_header(&prefix, fname, &rdesc)?,
+    )
+}
+
+fn isa_variant_dir(target_dir: &std::path::Path, isa: u32) -> PathBuf {
+    target_dir.join(format!("v{}", isa))
+}
+
+/// The directories of the variants of an object, relative to the target
+/// directory, with the flags they are built with. The struct_ops ones only
+/// exist for the objects using HID_BPF_OPS().
+fn variants() -> Vec<(PathBuf, String)> {
+    let mut variants = Vec::new();
+
+    for (dir, defines) in [
+        (PathBuf::new(), ""),
+        (PathBuf::from(STRUCT_OPS_DIR), "-DHID_BPF_STRUCT_OPS"),
+    ] {
+        for isa in ISA_VARIANTS {
+            variants.push((
+                isa_variant_dir(&dir, isa),
+                format!("-mcpu=v{} {}", isa, defines),
+            ));
+        }
+        variants.push((dir, String::from(defines)));
+    }
+
+    variants
+}
+
+fn object_path(bpf_source: &std::path::Path, dir: &std::path::Path) -> PathBuf {
+    let mut object = dir.join(bpf_source.file_name().unwrap());
+    object.set_extension("o");
+    object
+}
+
+fn compile_object(
     bpf_source: &std::path::Path,
-    target_dir: &std::path::Path,
-    modaliases: &mut std::collections::HashMap<Modalias, Vec<String>>,
-) -> Result<(), libbpf_rs::Error> {
-    let mut target_object = target_dir.join(bpf_source.file_name().unwrap());
+    dir: &std::path::Path,
+    clang_args: &str,
+) -> Result<PathBuf, String> {
+    let object = object_path(bpf_source, dir);
 
-    target_object.set_extension("o");
+    std::fs::create_dir_all(dir).map_err(|e| e.to_string())?;
 
     SkeletonBuilder::new()
         .source(bpf_source)
-        .obj(target_object.clone())
+        .obj(object.clone())
+        .clang_args(clang_args)
         .build()
-        .unwrap();
+        .map_err(|e| e.to_string())?;
+
+    Ok(object)
+}
+
+/// Links `parts` with the helper library compiled in `parts_dir`, see
+/// build_helper_lib(), into `target_object` with libbpf's static linker.
+/// The library is only added once, it has the only `_license`.
+fn link_objects(
+    target_object: &std::path::Path,
+    parts: &[PathBuf],
+    parts_dir: &std::path::Path,
+) -> Result<(), libbpf_rs::Error> {
+    let mut linker = libbpf_rs::Linker::new(target_object)?;
+
+    for part in parts {
+        linker.add_file(part)?;
+    }
+    linker.add_file(object_path(Path::new(HELPER_LIB), parts_dir))?;
+
+    linker.link()
+}
+
+/// Compiles `bpf_source` in `parts_dir`, the objects there are not
+/// complete: they only declare the routines of the helper library, which
+/// is linked in to make the object installed in `target_dir`.
+fn build_object(
+    bpf_source: &std::path::Path,
+    parts_dir: &std::path::Path,
+    target_dir: &std::path::Path,
+    clang_args: &str,
+) -> Result<(), String> {
+    let part = compile_object(bpf_source, parts_dir, clang_args)?;
+    let target_object = object_path(bpf_source, target_dir);
+
+    std::fs::create_dir_all(target_dir).map_err(|e| e.to_string())?;
+
+    link_objects(&target_object, &[part], parts_dir).map_err(|e| e.to_string())
+}
+
+/// The helper library is compiled for every variant, so each object is
+/// linked with a library built with the same flags. A compiler that
+/// doesn't know about v4 fails those here, and the v4 objects later.
+fn build_helper_lib(parts_dir: &std::path::Path, include_dir: &std::path::Path) {
+    let lib_source = PathBuf::from(DIR).join(HELPER_LIB);
+
+    for (dir, flags) in variants() {
+        let clang_args = format!("-I{} {}", include_dir.display(), flags);
+        let result = compile_object(&lib_source, &parts_dir.join(&dir), &clang_args);
+
+        if dir.as_os_str().is_empty() {
+            result.unwrap();
+        }
+    }
+}
+
+/// The default objects work on any kernel, the loader picks the variant
+/// for the newest instruction set the kernel has when there is one.
+/// Older compilers don't know about v4, those objects are then only
+/// built for the older ones.
+fn build_isa_variants(
+    bpf_source: &std::path::Path,
+    parts_dir: &std::path::Path,
+    target_dir: &std::path::Path,
+    include_dir: &std::path::Path,
+    defines: &str,
+) {
+    for isa in ISA_VARIANTS {
+        let dir = isa_variant_dir(target_dir, isa);
+        let result = build_object(
+            bpf_source,
+            &isa_variant_dir(parts_dir, isa),
+            &dir,
+            &format!("-I{} -mcpu=v{} {}", include_dir.display(), isa, defines),
+        );
+
+        if let Err(e) = result {
+            println!(
+                "cargo:warning=No v{} variant of {}: {}",
+                isa,
+                bpf_source.display(),
+                e
+            );
+            std::fs::remove_file(object_path(bpf_source, &dir)).ok();
+        }
+    }
+}
+
+/// Objects declaring their programs through HID_BPF_OPS() are built a
+/// second time with HID_BPF_STRUCT_OPS defined, see hid_bpf_helpers.h, in
+/// their own directory with their own ISA variants. The others only have
+/// fmod_ret programs.
+fn build_struct_ops_variant(
+    bpf_source: &std::path::Path,
+    parts_dir: &std::path::Path,
+    target_dir: &std::path::Path,
+    include_dir: &std::path::Path,
+) -> std::io::Result<()> {
+    if !std::fs::read_to_string(bpf_source)?.contains("HID_BPF_OPS(") {
+        return Ok(());
+    }
+
+    let parts_dir = parts_dir.join(STRUCT_OPS_DIR);
+    let dir = target_dir.join(STRUCT_OPS_DIR);
+
+    build_object(
+        bpf_source,
+        &parts_dir,
+        &dir,
+        &format!("-I{} -DHID_BPF_STRUCT_OPS", include_dir.display()),
+    )
+    .unwrap();
+
+    build_isa_variants(
+        bpf_source,
+        &parts_dir,
+        &dir,
+        include_dir,
+        "-DHID_BPF_STRUCT_OPS",
+    );
+
+    Ok(())
+}
+
+/// Returns whether the object can be linked with the other objects of its
+/// devices, see link_shared_objects()
+fn build_bpf_file(
+    bpf_source: &std::path::Path,
+    parts_dir: &std::path::Path,
+    target_dir: &std::path::Path,
+    include_dir: &std::path::Path,
+    modaliases: &mut std::collections::HashMap<Modalias, Vec<String>>,
+) -> Result<bool, libbpf_rs::Error> {
+    let target_object = object_path(bpf_source, target_dir);
+
+    build_object(
+        bpf_source,
+        parts_dir,
+        target_dir,
+        &format!("-I{}", include_dir.display()),
+    )
+    .unwrap();
+
+    build_isa_variants(bpf_source, parts_dir, target_dir, include_dir, "");
+    build_struct_ops_variant(bpf_source, parts_dir, target_dir, include_dir).unwrap();
 
     let btf = libbpf_rs::btf::Btf::from_path(target_object.clone())?;
+    let fname = String::from(target_object.file_name().unwrap().to_str().unwrap());
+    let mut has_modaliases = false;
 
     if let Some(metadata) = modalias::Metadata::from_btf(&btf) {
-        let fname = String::from(target_object.file_name().unwrap().to_str().unwrap());
         for modalias in metadata.modaliases() {
+            has_modaliases = true;
             modaliases
                 .entry(modalias)
                 .or_insert(Vec::new())
                 .push(fname.clone());
         }
     }
+
+    /*
+     * A linked object has one probe, one .bpf.o.conf and one
+     * hid_bpf_signatures map: a part with a probe would refuse the
+     * device for the others.
+     */
+    let has_probe = btf
+        .type_by_name::<libbpf_rs::btf::types::Func>("probe")
+        .is_some();
+    let has_config = Path::new(DIR).join(format!("{fname}.conf")).exists();
+
+    Ok(has_modaliases && !has_probe && !has_config)
+}
+
+/// The objects of `linkable` that match the same device are linked into a
+/// single `linked-<part>+<part>.bpf.o`, with every variant all of the parts
+/// have. The device then opens, relocates and loads one object for all
+/// of them, and the hwdb lists the linked object instead of the parts. The
+/// parts are still installed on their own, for `udev-hid-bpf add`.
+fn link_shared_objects(
+    parts_dir: &std::path::Path,
+    target_dir: &std::path::Path,
+    linkable: &[String],
+    modaliases: &mut std::collections::HashMap<Modalias, Vec<String>>,
+) {
+    let mut linked: std::collections::HashMap<Vec<String>, Option<String>> =
+        std::collections::HashMap::new();
+
+    for files in modaliases.values_mut() {
+        let mut parts: Vec<String> = files
+            .iter()
+            .filter(|fname| linkable.contains(fname))
+            .cloned()
+            .collect();
+        if parts.len() < 2 {
+            continue;
+        }
+        parts.sort();
+
+        let linked_name = linked
+            .entry(parts.clone())
+            .or_insert_with(|| {
+                let linked_name = format!(
+                    "linked-{}.bpf.o",
+                    parts
+                        .iter()
+                        .map(|part| part.trim_end_matches(".bpf.o"))
+                        .collect::<Vec<&str>>()
+                        .join("+")
+                );
+
+                match link_variants(parts_dir, target_dir, &parts, &linked_name) {
+                    Ok(()) => Some(linked_name),
+                    Err(e) => {
+                        println!("cargo:warning=Not linking {}: {}", parts.join(", "), e);
+                        None
+                    }
+                }
+            })
+            .clone();
+
+        if let Some(linked_name) = linked_name {
+            files.retain(|fname| !parts.contains(fname));
+            files.push(linked_name);
+        }
+    }
+}
+
+fn link_variants(
+    parts_dir: &std::path::Path,
+    target_dir: &std::path::Path,
+    parts: &[String],
+    linked_name: &str,
+) -> Result<(), libbpf_rs::Error> {
+    for (dir, _) in variants() {
+        let part_paths: Vec<PathBuf> = parts
+            .iter()
+            .map(|part| parts_dir.join(&dir).join(part))
+            .collect();
+        let target_object = target_dir.join(&dir).join(linked_name);
+
+        /* only the default variant is mandatory */
+        if !dir.as_os_str().is_empty()
+            && (part_paths.iter().any(|part| !part.exists())
+                || parts
+                    .iter()
+                    .any(|part| !target_dir.join(&dir).join(part).exists()))
+        {
+            continue;
+        }
+
+        if let Err(e) = link_objects(&target_object, &part_paths, &parts_dir.join(&dir)) {
+            if dir.as_os_str().is_empty() {
+                return Err(e);
+            }
+            println!(
+                "cargo:warning=No {} variant of {}: {}",
+                dir.display(),
+                linked_name,
+                e
+            );
+            std::fs::remove_file(&target_object).ok();
+        }
+    }
+
+    Ok(())
+}
+
+fn install_data_file(
+    data_file: &std::path::Path,
+    target_dir: &std::path::Path,
+    modaliases: &mut std::collections::HashMap<Modalias, Vec<String>>,
+) -> std::io::Result<()> {
+    /* fail the build early on invalid data files instead of at device plug */
+    let device_match = if data_file.to_string_lossy().ends_with(".conf") {
+        rodata::resolve_references(&rodata::parse_config(
+            &std::fs::read_to_string(data_file)?,
+            &Modalias::new(),
+        )?)?;
+        datafile::DeviceMatch::default()
+    } else if rdesc_patch::is_patch_table(data_file) {
+        rdesc_patch::PatchTable::from_path(data_file)?.device_match
+    } else {
+        event_transform::RuleList::from_path(data_file)?.device_match
+    };
+    let fname = String::from(data_file.file_name().unwrap().to_str().unwrap());
+
+    std::fs::copy(data_file, target_dir.join(&fname))?;
+
+    for modalias in device_match.modaliases {
+        modaliases
+            .entry(modalias)
+            .or_insert(Vec::new())
+            .push(fname.clone());
+    }
     Ok(())
 }
 
@@ -87,24 +446,75 @@ fn main() -> Result<(), Box<dyn std::error::Error>> {
     std::fs::create_dir_all(target_dir.as_path())
         .expect(format!("Can't create TARGET_DIR '{}'", TARGET_DIR).as_str());
 
+    // The tests check the objects that were just built
+    println!(
+        "cargo:rustc-env=HID_BPF_TARGET_DIR={}",
+        std::fs::canonicalize(&target_dir)?.display()
+    );
+
     let hwdb_file = target_dir.clone().join("99-hid-bpf.hwdb");
     let hwdb_fd = File::create(hwdb_file)?;
 
     let mut modaliases = std::collections::HashMap::new();
 
-    // Then compile all other .bpf.c in a .bpf.o file
+    // First generate the headers of the report descriptors, the
+    // .bpf.c files include them
+    let include_dir = PathBuf::from(env::var_os("OUT_DIR").unwrap()).join(RDESC_DIR);
+    std::fs::create_dir_all(&include_dir)?;
+
+    for elem in Path::new(DIR).read_dir().unwrap() {
+        if let Ok(dir_entry) = elem {
+            let path = dir_entry.path();
+            if path.is_file() && path.to_str().unwrap().ends_with(".rdesc") {
+                generate_rdesc_header(&path, &include_dir)?;
+            }
+        }
+    }
+
+    // Then the helper library, linked into every object
+    let parts_dir = PathBuf::from(env::var_os("OUT_DIR").unwrap()).join(PARTS_DIR);
+    build_helper_lib(&parts_dir, &include_dir);
+
+    // The tests link the objects too
+    println!(
+        "cargo:rustc-env=HID_BPF_PARTS_DIR={}",
+        std::fs::canonicalize(&parts_dir)?.display()
+    );
+
+    // Then compile all other .bpf.c in a .bpf.o file and install the
+    // data files of the generic objects next to them
+    let mut linkable = Vec::new();
     for elem in Path::new(DIR).read_dir().unwrap() {
         if let Ok(dir_entry) = elem {
             let path = dir_entry.path();
             if path.is_file()
                 && path.to_str().unwrap().ends_with(".bpf.c")
                 && path.file_name().unwrap() != ATTACH_PROG
+                && path.file_name().unwrap() != HELPER_LIB
+            {
+                if build_bpf_file(
+                    &path,
+                    &parts_dir,
+                    &target_dir,
+                    &include_dir,
+                    &mut modaliases,
+                )? {
+                    let fname = path.file_name().unwrap().to_str().unwrap();
+                    linkable.push(fname.replace(".bpf.c", ".bpf.o"));
+                }
+            } else if path.is_file()
+                && (rdesc_patch::is_patch_table(&path)
+                    || event_transform::is_rule_list(&path)
+                    || path.to_str().unwrap().ends_with(".bpf.o.conf"))
             {
-                build_bpf_file(&path, &target_dir, &mut modaliases)?;
+                install_data_file(&path, &target_dir, &mut modaliases)?;
             }
         }
     }
 
+    // Objects matching the same device are loaded as one
+    link_shared_objects(&parts_dir, &target_dir, &linkable, &mut modaliases);
+
     let mut idx = 0;
     for (modalias, files) in modaliases {
         idx = write_hwdb_entry(idx, modalias, files, &hwdb_fd)?;
@@ -57,6 +57,13 @@ if [[ -z "$DRY_RUN" ]];
 then
   install -D -t "$PREFIX"/bin/ "$TMP_INSTALL_DIR"/bin/udev-hid-bpf
   install -D -t /usr/local/lib/firmware/hid/bpf "$CARGO_TARGET_DIR"/bpf/*.bpf.o
+  for variant in v3 v4 struct_ops struct_ops/v3 struct_ops/v4; do
+    if [[ -d "$CARGO_TARGET_DIR"/bpf/$variant ]]; then
+      install -D -t /usr/local/lib/firmware/hid/bpf/$variant "$CARGO_TARGET_DIR"/bpf/$variant/*.bpf.o
+    fi
+  done
+  find "$CARGO_TARGET_DIR"/bpf -maxdepth 1 \( -name "*.rdesc-patch" -o -name "*.event-transform" -o -name "*.bpf.o.conf" \) \
+    -exec install -D -m 644 -t /usr/local/lib/firmware/hid/bpf {} +
   install -D -m 644 -t /etc/udev/rules.d "$CARGO_TARGET_DIR"/bpf/99-hid-bpf.rules
   install -D -m 644 -t /etc/udev/hwdb.d "$CARGO_TARGET_DIR"/bpf/99-hid-bpf.hwdb
   udevadm control --reload
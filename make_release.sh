@@ -34,7 +34,7 @@ TMP_INSTALL_DIR="$CARGO_TARGET_DIR/install"
 
 # some cleanup
 rm -rf $TMP_INSTALL_DIR
-rm -rf "$CARGO_TARGET_DIR"/bpf/*.bpf.o
+rm -rf "$CARGO_TARGET_DIR"/bpf/*.bpf.o "$CARGO_TARGET_DIR"/bpf/v*/ "$CARGO_TARGET_DIR"/bpf/struct_ops/
 
 # force rebuild of bpf objects
 touch $SCRIPT_DIR/src/bpf/
@@ -43,6 +43,13 @@ PATH="$PATH:$TMP_INSTALL_DIR/bin" \
  cargo install --force --path "$SCRIPT_DIR" --root "$TMP_INSTALL_DIR" --no-track
 
 install -D -t "$TMP_INSTALL_DIR"/lib/firmware/hid/bpf "$CARGO_TARGET_DIR"/bpf/*.bpf.o
+for variant in v3 v4 struct_ops struct_ops/v3 struct_ops/v4; do
+  if [[ -d "$CARGO_TARGET_DIR"/bpf/$variant ]]; then
+    install -D -t "$TMP_INSTALL_DIR"/lib/firmware/hid/bpf/$variant "$CARGO_TARGET_DIR"/bpf/$variant/*.bpf.o
+  fi
+done
+find "$CARGO_TARGET_DIR"/bpf -maxdepth 1 \( -name "*.rdesc-patch" -o -name "*.event-transform" -o -name "*.bpf.o.conf" \) \
+  -exec install -D -m 644 -t "$TMP_INSTALL_DIR"/lib/firmware/hid/bpf {} +
 install -D -m 644 -t "$TMP_INSTALL_DIR" "$SCRIPT_DIR"/99-hid-bpf.rules LICENSE
 mkdir -p "$TMP_INSTALL_DIR"/etc/udev/rules.d/
 install -D -m 644 -t "$TMP_INSTALL_DIR"/etc/udev/hwdb.d "$CARGO_TARGET_DIR"//bpf/99-hid-bpf.hwdb
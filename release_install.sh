@@ -43,6 +43,13 @@ if [[ -z "$DRY_RUN" ]];
 then
   install -D -t "$PREFIX"/bin/ "$SCRIPT_DIR"/bin/udev-hid-bpf
   install -D -t /lib/firmware/hid/bpf "$SCRIPT_DIR"/lib/firmware/hid/bpf/*.bpf.o
+  for variant in v3 v4 struct_ops struct_ops/v3 struct_ops/v4; do
+    if [[ -d "$SCRIPT_DIR"/lib/firmware/hid/bpf/$variant ]]; then
+      install -D -t /lib/firmware/hid/bpf/$variant "$SCRIPT_DIR"/lib/firmware/hid/bpf/$variant/*.bpf.o
+    fi
+  done
+  find "$SCRIPT_DIR"/lib/firmware/hid/bpf -maxdepth 1 \( -name "*.rdesc-patch" -o -name "*.event-transform" -o -name "*.bpf.o.conf" \) \
+    -exec install -D -m 644 -t /lib/firmware/hid/bpf {} +
   install -D -m 644 -t /etc/udev/rules.d "$SCRIPT_DIR"/etc/udev/rules.d/99-hid-bpf.rules
   install -D -m 644 -t /etc/udev/hwdb.d "$SCRIPT_DIR"/etc/udev/hwdb.d/99-hid-bpf.hwdb
   udevadm control --reload
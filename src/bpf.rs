@@ -11,28 +11,767 @@ use std::fs;
 use std::os::fd::{AsFd, AsRawFd};
 use std::path::PathBuf;
 
+/// How HID-BPF programs get attached to a device, depends on the running kernel
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Backend {
+    /// `fmod_ret` tracing programs attached through the `hid_bpf_attach_prog`
+    /// kfunc called from our own `attach_prog` syscall program
+    FmodRet,
+    /// `struct hid_bpf_ops` maps attached as struct_ops links
+    StructOps,
+}
+
+/*
+ * Parsing the kernel BTF takes longer than most loads, and the answer only
+ * changes with the kernel, so it is cached in a tmpfs keyed by the kernel
+ * build ID.
+ */
+const CAPABILITIES_CACHE: &str = "/run/udev-hid-bpf/capabilities";
+
+/// The GNU build ID of the running kernel, in hex, from its ELF notes
+fn kernel_build_id() -> Option<String> {
+    parse_build_id(&fs::read("/sys/kernel/notes").ok()?)
+}
+
+fn parse_build_id(notes: &[u8]) -> Option<String> {
+    const NT_GNU_BUILD_ID: u32 = 3;
+    let align = |n: usize| (n + 3) & !3;
+    let word = |offset: usize| -> Option<u32> {
+        Some(u32::from_ne_bytes(
+            notes.get(offset..offset + 4)?.try_into().ok()?,
+        ))
+    };
+
+    let mut offset = 0;
+    while offset + 12 <= notes.len() {
+        let namesz = word(offset)? as usize;
+        let descsz = word(offset + 4)? as usize;
+        let note_type = word(offset + 8)?;
+        let name = notes.get(offset + 12..offset + 12 + namesz)?;
+        let desc_offset = offset + 12 + align(namesz);
+        let desc = notes.get(desc_offset..desc_offset + descsz)?;
+
+        if note_type == NT_GNU_BUILD_ID && name == b"GNU\0" {
+            return Some(desc.iter().map(|byte| format!("{:02x}", byte)).collect());
+        }
+
+        offset = desc_offset + align(descsz);
+    }
+
+    None
+}
+
+/// What the kernel BTF says about HID-BPF: `None` if it has no HID core,
+/// in which case the answer may change once the module is loaded
+fn probe_kernel_backend() -> Option<Option<Backend>> {
+    let vmlinux = std::ffi::CString::new("/sys/kernel/btf/vmlinux").unwrap();
+    let hid = std::ffi::CString::new("/sys/kernel/btf/hid").unwrap();
+
+    unsafe {
+        let base = libbpf_sys::btf__parse(vmlinux.as_ptr(), std::ptr::null_mut());
+        if libbpf_sys::libbpf_get_error(base as *const libc::c_void) != 0 {
+            return Some(None);
+        }
+
+        /* with CONFIG_HID=m, HID-BPF comes with the hid module */
+        let module = libbpf_sys::btf__parse_split(hid.as_ptr(), base);
+        let module = match libbpf_sys::libbpf_get_error(module as *const libc::c_void) {
+            0 => module,
+            _ => std::ptr::null_mut(),
+        };
+
+        let has = |name: &str, kind: u32| {
+            let c_name = std::ffi::CString::new(name).unwrap();
+            [module, base].iter().any(|btf| {
+                !btf.is_null()
+                    && libbpf_sys::btf__find_by_name_kind(*btf, c_name.as_ptr(), kind) >= 0
+            })
+        };
+
+        let result = if !has("hid_input_report", libbpf_sys::BTF_KIND_FUNC) {
+            None
+        } else if !has("hid_bpf_get_data", libbpf_sys::BTF_KIND_FUNC) {
+            Some(None)
+        } else if has("hid_bpf_attach_prog", libbpf_sys::BTF_KIND_FUNC) {
+            /* these kernels have a struct hid_bpf_ops too, internal to HID-BPF */
+            Some(Some(Backend::FmodRet))
+        } else if has("hid_bpf_ops", libbpf_sys::BTF_KIND_STRUCT) {
+            Some(Some(Backend::StructOps))
+        } else {
+            Some(None)
+        };
+
+        if !module.is_null() {
+            libbpf_sys::btf__free(module);
+        }
+        libbpf_sys::btf__free(base);
+
+        result
+    }
+}
+
+/// The object variants built for a newer BPF instruction set than the
+/// default objects, each in its own `vN` directory next to them, see
+/// build.rs. v3 has 32-bit jumps, v4 sign extensions and 32-bit offsets
+/// for `goto`.
+pub const ISA_VARIANTS: [u32; 2] = [3, 4];
+
+/// The newest BPF instruction set of [`ISA_VARIANTS`] the verifier accepts.
+/// All the kernels with HID-BPF have v3, so only v4 needs testing, with
+/// a sign extending move that older verifiers reject.
+fn probe_isa_level() -> u32 {
+    /* r0 = 0; r0 = (s8)r0; exit */
+    let insns: [[u8; 8]; 3] = [
+        [0xb7, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00],
+        [0xbf, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00],
+        [0x95, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00],
+    ];
+    let license = std::ffi::CString::new("GPL").unwrap();
+
+    let fd = unsafe {
+        libbpf_sys::bpf_prog_load(
+            libbpf_sys::BPF_PROG_TYPE_SOCKET_FILTER,
+            std::ptr::null(),
+            license.as_ptr(),
+            insns.as_ptr() as *const libbpf_sys::bpf_insn,
+            insns.len() as libbpf_sys::size_t,
+            std::ptr::null_mut(),
+        )
+    };
+
+    if fd < 0 {
+        return 3;
+    }
+
+    unsafe { libc::close(fd) };
+    4
+}
+
+fn encode_capabilities(build_id: &str, backend: Option<Backend>, isa: u32) -> String {
+    let backend = match backend {
+        Some(Backend::FmodRet) => "fmod_ret",
+        Some(Backend::StructOps) => "struct_ops",
+        None => "none",
+    };
+
+    format!("{} {} v{}\n", build_id, backend, isa)
+}
+
+/// The backend and ISA level cached for the kernel `build_id`, `None` if
+/// there are none
+fn decode_capabilities(cache: &str, build_id: &str) -> Option<(Option<Backend>, u32)> {
+    let mut fields = cache.split_whitespace();
+    let (id, backend, isa) = (fields.next()?, fields.next()?, fields.next()?);
+
+    if id != build_id {
+        return None;
+    }
+
+    let isa = isa.strip_prefix('v')?.parse().ok()?;
+
+    match backend {
+        "fmod_ret" => Some((Some(Backend::FmodRet), isa)),
+        "struct_ops" => Some((Some(Backend::StructOps), isa)),
+        "none" => Some((None, isa)),
+        _ => None,
+    }
+}
+
+/// The HID-BPF backend and BPF ISA level of the running kernel, only
+/// looked up once per kernel, see [`CAPABILITIES_CACHE`].
+fn capabilities() -> Option<(Backend, u32)> {
+    static DETECTED: std::sync::OnceLock<Option<(Backend, u32)>> = std::sync::OnceLock::new();
+
+    *DETECTED.get_or_init(|| {
+        let build_id = kernel_build_id();
+
+        if let Some(build_id) = &build_id {
+            if let Some((backend, isa)) = fs::read_to_string(CAPABILITIES_CACHE)
+                .ok()
+                .and_then(|cache| decode_capabilities(&cache, build_id))
+            {
+                return backend.map(|backend| (backend, isa));
+            }
+        }
+
+        let backend = match probe_kernel_backend() {
+            Some(backend) => backend,
+            /* no HID core yet, don't cache that */
+            None => return None,
+        };
+        let isa = backend.map_or(0, |_| probe_isa_level());
+
+        if let Some(build_id) = &build_id {
+            let tmp = format!("{}.tmp{}", CAPABILITIES_CACHE, std::process::id());
+            if let Err(e) = fs::create_dir_all("/run/udev-hid-bpf")
+                .and_then(|_| fs::write(&tmp, encode_capabilities(build_id, backend, isa)))
+                .and_then(|_| fs::rename(&tmp, CAPABILITIES_CACHE))
+            {
+                log::debug!("could not cache the kernel capabilities: {}", e);
+                fs::remove_file(&tmp).ok();
+            }
+        }
+
+        backend.map(|backend| (backend, isa))
+    })
+}
+
+impl Backend {
+    /// Newer kernels export `struct hid_bpf_ops` instead of the
+    /// `hid_bpf_attach_prog` kfunc, older ones don't have HID-BPF at all.
+    pub fn detect() -> Option<Self> {
+        capabilities().map(|(backend, _)| backend)
+    }
+}
+
+/// The objects with struct_ops programs have a second build in this
+/// directory next to them, with its own [`ISA_VARIANTS`], see build.rs.
+pub const STRUCT_OPS_DIR: &str = "struct_ops";
+
+/// The variant of the `.bpf.o` at `path` built for the backend and the
+/// newest instruction set of the kernel, `path` itself if there is none
+fn object_variant(path: &PathBuf) -> PathBuf {
+    let (backend, level) = capabilities().map_or((None, 0), |(backend, isa)| (Some(backend), isa));
+
+    variant_paths(path, backend, level)
+        .into_iter()
+        .find(|variant| variant.exists())
+        .unwrap_or_else(|| path.clone())
+}
+
+/// The builds of the `.bpf.o` at `path` that fit the kernel, best first,
+/// ending with `path` itself
+fn variant_paths(path: &PathBuf, backend: Option<Backend>, level: u32) -> Vec<PathBuf> {
+    let mut bases = vec![path.clone()];
+
+    if backend == Some(Backend::StructOps) {
+        bases.insert(
+            0,
+            path.with_file_name(STRUCT_OPS_DIR)
+                .join(path.file_name().unwrap()),
+        );
+    }
+
+    bases
+        .iter()
+        .flat_map(|base| {
+            ISA_VARIANTS
+                .iter()
+                .rev()
+                .filter(|isa| **isa <= level)
+                .map(|isa| isa_variant_path(base, *isa))
+                .chain(std::iter::once(base.clone()))
+        })
+        .collect()
+}
+
+fn isa_variant_path(path: &PathBuf, isa: u32) -> PathBuf {
+    path.with_file_name(format!("v{}", isa))
+        .join(path.file_name().unwrap())
+}
+
 pub struct HidBPF<'a> {
+    backend: Backend,
     inner: Option<AttachSkel<'a>>,
 }
 
+/// bpffs doesn't accept `:` nor `.` in names
+fn bpffs_name(name: &str) -> String {
+    name.replace(":", "_").replace(".", "_")
+}
+
 pub fn get_bpffs_path(sysname: &str, object: &str) -> String {
     format!(
         "/sys/fs/bpf/hid/{}/{}",
-        sysname.replace(":", "_").replace(".", "_"),
-        object.replace(":", "_").replace(".", "_"),
+        bpffs_name(sysname),
+        bpffs_name(object),
     )
 }
 
+/// FNV-1a 64 bits hash of a blob, used to identify a given version of
+/// a bpf object without having to compare the whole file.
+pub fn content_hash(data: &[u8]) -> u64 {
+    data.iter().fold(0xcbf29ce484222325, |hash, byte| {
+        (hash ^ *byte as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+/*
+ * bpffs only accepts bpf objects, so the state of an attached object is
+ * stored in a one-element array map pinned next to the links.
+ */
+const STATE_PIN_NAME: &str = "hid_bpf_state";
+
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+struct PinnedState {
+    hash: u64,
+    hid: u32,
+    attached: u32,
+}
+
+fn read_pinned_state(dir: &str) -> Option<PinnedState> {
+    let c_str = std::ffi::CString::new(format!("{}/{}", dir, STATE_PIN_NAME)).unwrap();
+    let key: u32 = 0;
+    let mut state = PinnedState::default();
+
+    unsafe {
+        let fd = libbpf_sys::bpf_obj_get(c_str.as_ptr());
+        if fd < 0 {
+            return None;
+        }
+
+        let ret = libbpf_sys::bpf_map_lookup_elem(
+            fd,
+            &key as *const _ as *const libc::c_void,
+            &mut state as *mut _ as *mut libc::c_void,
+        );
+        libc::close(fd);
+
+        match ret {
+            0 => Some(state),
+            _ => None,
+        }
+    }
+}
+
+fn write_pinned_state(dir: &str, state: PinnedState) -> Result<(), libbpf_rs::Error> {
+    let c_name = std::ffi::CString::new(STATE_PIN_NAME).unwrap();
+    let key: u32 = 0;
+
+    unsafe {
+        let fd = libbpf_sys::bpf_map_create(
+            libbpf_sys::BPF_MAP_TYPE_ARRAY,
+            c_name.as_ptr(),
+            std::mem::size_of::<u32>() as u32,
+            std::mem::size_of::<PinnedState>() as u32,
+            1,
+            std::ptr::null(),
+        );
+        if fd < 0 {
+            return Err(libbpf_rs::Error::System(fd));
+        }
+
+        let ret = libbpf_sys::bpf_map_update_elem(
+            fd,
+            &key as *const _ as *const libc::c_void,
+            &state as *const _ as *const libc::c_void,
+            libbpf_sys::BPF_ANY as u64,
+        );
+
+        let ret = match ret {
+            0 => pin_hid_bpf_prog(fd, format!("{}/{}", dir, STATE_PIN_NAME)),
+            e => Err(libbpf_rs::Error::System(e)),
+        };
+        libc::close(fd);
+        ret
+    }
+}
+
+/// Returns true if the exact same version of the bpf object at `path`
+/// is already attached to the device `hid_id` known as `sysname`.
+///
+/// udev emits both `add` and `bind`, and `udevadm trigger` replays `add`
+/// on devices that are already set up, so this lets us skip reloading,
+/// verifying and pinning the same programs again.
+pub fn is_object_attached(device: &hidudev::DeviceSnapshot, object: &ObjectToLoad) -> bool {
+    match read_pinned_state(&get_bpffs_path(device.sysname(), &object.name)) {
+        Some(state) => state.attached != 0 && state.hid == device.id() && state.hash == object.hash,
+        None => false,
+    }
+}
+
+/// The name of the map receiving the offsets of the `HID_SIGNATURE()`
+/// entries of an object, see hid_bpf_helpers.h
+const SIGNATURES_MAP: &str = "hid_bpf_signatures";
+
+/// The offset written in [`SIGNATURES_MAP`] for a signature not found
+const SIGNATURE_NOT_FOUND: u32 = u32::MAX;
+
+/// The `HID_SIGNATURE()` entries of the object at `path`
+fn object_signatures(path: &PathBuf) -> Vec<(u32, Vec<u8>)> {
+    let btf = match libbpf_rs::btf::Btf::from_path(path) {
+        Ok(btf) => btf,
+        Err(_) => return Vec::new(),
+    };
+    let signatures = match crate::modalias::Metadata::from_btf(&btf) {
+        Some(metadata) => metadata.signatures().collect(),
+        None => Vec::new(),
+    };
+    signatures
+}
+
+/// The signatures the objects and data files among `paths` search in a
+/// report descriptor, scanned at once by
+/// [`hidudev::DeviceSnapshot::scan_signatures()`]. The files that can not
+/// be parsed fail later, when they are loaded.
+pub fn scanned_signatures(paths: &[PathBuf]) -> Vec<Vec<u8>> {
+    let mut signatures = Vec::new();
+
+    for path in paths {
+        if crate::rdesc_patch::is_patch_table(path) {
+            if let Ok(table) = crate::rdesc_patch::PatchTable::from_path(path) {
+                signatures.extend(table.signatures().cloned());
+            }
+        } else if crate::event_transform::is_rule_list(path) {
+            if let Ok(list) = crate::event_transform::RuleList::from_path(path) {
+                signatures.extend(list.device_match.signatures);
+            }
+        } else {
+            signatures.extend(
+                object_signatures(path)
+                    .into_iter()
+                    .map(|(_, signature)| signature),
+            );
+        }
+    }
+
+    signatures
+}
+
+/// The name of the bpffs directory of the object at `path`
+fn object_name(path: &PathBuf) -> String {
+    String::from(path.as_path().file_stem().unwrap().to_str().unwrap())
+}
+
+fn as_bytes<T>(data: &T) -> &[u8] {
+    unsafe { std::slice::from_raw_parts(data as *const T as *const u8, std::mem::size_of::<T>()) }
+}
+
+/// A bpf object file along with the data it needs before its programs
+/// can be attached.
+///
+/// `path` given on the command line or by the hwdb is either a `.bpf.o`
+/// file, or a data file (`.rdesc-patch`, `.event-transform`) applied by
+/// the matching generic object installed next to it. It is built once per
+/// device and shared by [`is_object_attached()`] and
+/// [`HidBPF::load_programs()`].
+pub struct ObjectToLoad {
+    /// the path given, the data file of a generic object
+    source: PathBuf,
+    /// the `.bpf.o` file
+    path: PathBuf,
+    /// the name of the bpffs directory for this object
+    name: String,
+    /// identifies this version of the object and its data
+    hash: u64,
+    /// (map name, key, value) written between load and attach
+    map_entries: Vec<(String, Vec<u8>, Vec<u8>)>,
+    /// data driven objects are matched in userspace instead of by a probe
+    device_match: Option<crate::datafile::DeviceMatch>,
+    /// (offset, value) written in `.rodata` before load
+    rodata: Vec<(usize, Vec<u8>)>,
+}
+
+impl ObjectToLoad {
+    /// The report descriptor of `device` locates the `patch any` entries
+    /// of a patch table. `rodata` are `NAME=VALUE` assignments of `const
+    /// volatile` globals, on top of the ones from the config file of the
+    /// object.
+    pub fn from_path(
+        path: &PathBuf,
+        device: &hidudev::DeviceSnapshot,
+        rodata: &[(String, String)],
+    ) -> Result<Self, libbpf_rs::Error> {
+        let name = object_name(path);
+
+        /* the command line overrides the config file */
+        let mut assignments =
+            crate::rodata::load_config(path, device.modalias()).map_err(io_error)?;
+        assignments.extend(rodata.iter().cloned());
+
+        let (object, device_match, map_entries) = if crate::rdesc_patch::is_patch_table(path) {
+            let mut table = crate::rdesc_patch::PatchTable::from_path(path).map_err(io_error)?;
+            table.resolve(device.rdesc(), device.signatures());
+            let map_entries = Self::rdesc_patch_entries(&table);
+            (
+                crate::rdesc_patch::OBJECT,
+                table.into_device_match(),
+                map_entries,
+            )
+        } else if crate::event_transform::is_rule_list(path) {
+            let list = crate::event_transform::RuleList::from_path(path).map_err(io_error)?;
+            let map_entries = Self::event_transform_entries(&list);
+            (
+                crate::event_transform::OBJECT,
+                list.device_match,
+                map_entries,
+            )
+        } else {
+            let object_path = object_variant(path);
+            let rodata = Self::rodata_values(&object_path, &assignments)?;
+            let mut content = fs::read(&object_path).map_err(io_error)?;
+            content.extend(rodata.iter().flat_map(|(_, value)| value.iter()));
+
+            return Ok(Self {
+                source: path.clone(),
+                map_entries: Self::signature_entries(&object_path, device),
+                path: object_path,
+                name,
+                hash: content_hash(&content),
+                device_match: None,
+                rodata,
+            });
+        };
+
+        let object_path = object_variant(&path.with_file_name(object));
+        let rodata = Self::rodata_values(&object_path, &assignments)?;
+        let mut content = fs::read(&object_path).map_err(io_error)?;
+        content.extend(fs::read(path).map_err(io_error)?);
+        content.extend(rodata.iter().flat_map(|(_, value)| value.iter()));
+
+        Ok(Self {
+            source: path.clone(),
+            path: object_path,
+            name,
+            hash: content_hash(&content),
+            map_entries,
+            device_match: Some(device_match),
+            rodata,
+        })
+    }
+
+    /// The `.bpf.o` or data file the object was built from
+    pub fn source(&self) -> &PathBuf {
+        &self.source
+    }
+
+    /// Resolves the `NAME=VALUE` assignments to the offset and encoded
+    /// value of the `const volatile` globals of the object, from its BTF.
+    fn rodata_values(
+        path: &PathBuf,
+        assignments: &[(String, String)],
+    ) -> Result<Vec<(usize, Vec<u8>)>, libbpf_rs::Error> {
+        if assignments.is_empty() {
+            return Ok(Vec::new());
+        }
+
+        let assignments = crate::rodata::resolve_references(assignments).map_err(io_error)?;
+        let btf = libbpf_rs::btf::Btf::from_path(path)?;
+        let datasec = btf
+            .type_by_name::<libbpf_rs::btf::types::DataSec>(".rodata")
+            .ok_or(libbpf_rs::Error::System(-libc::ENOENT))?;
+
+        assignments
+            .iter()
+            .map(|(name, value)| {
+                let var_sec_info = datasec
+                    .iter()
+                    .find(|var_sec_info| {
+                        btf.type_by_id::<libbpf_rs::btf::types::Var>(var_sec_info.ty)
+                            .and_then(|var| var.name())
+                            .map_or(false, |var_name| var_name == name.as_str())
+                    })
+                    .ok_or_else(|| {
+                        log::warn!("{} has no const volatile '{}'", path.display(), name);
+                        libbpf_rs::Error::System(-libc::ENOENT)
+                    })?;
+
+                /* arrays are filled by a generator, see rodata::encode() */
+                let count = btf
+                    .type_by_id::<libbpf_rs::btf::types::Var>(var_sec_info.ty)
+                    .and_then(|var| {
+                        libbpf_rs::btf::types::Array::try_from(
+                            var.referenced_type().skip_mods_and_typedefs(),
+                        )
+                        .ok()
+                    })
+                    .map_or(1, |array| array.capacity());
+
+                let value =
+                    crate::rodata::encode(value, var_sec_info.size, count).map_err(|e| {
+                        io_error(std::io::Error::new(e.kind(), format!("{}: {}", name, e)))
+                    })?;
+
+                Ok((var_sec_info.offset as usize, value))
+            })
+            .collect()
+    }
+
+    /// The offsets in the report descriptor of `device` of the
+    /// `HID_SIGNATURE()` entries of the object, for [`SIGNATURES_MAP`]
+    fn signature_entries(
+        path: &PathBuf,
+        device: &hidudev::DeviceSnapshot,
+    ) -> Vec<(String, Vec<u8>, Vec<u8>)> {
+        object_signatures(path)
+            .into_iter()
+            .map(|(idx, signature)| {
+                let offset = device
+                    .signatures()
+                    .find(&signature, device.rdesc())
+                    .map_or(SIGNATURE_NOT_FOUND, |offset| offset as u32);
+                (
+                    String::from(SIGNATURES_MAP),
+                    idx.to_ne_bytes().to_vec(),
+                    offset.to_ne_bytes().to_vec(),
+                )
+            })
+            .collect()
+    }
+
+    /// Writes the `.rodata` values into the initial value of the map
+    fn apply_rodata(&self, data: &mut [u8]) -> Result<(), libbpf_rs::Error> {
+        for (offset, value) in self.rodata.iter() {
+            data.get_mut(*offset..*offset + value.len())
+                .ok_or(libbpf_rs::Error::System(-libc::EINVAL))?
+                .copy_from_slice(value);
+        }
+
+        Ok(())
+    }
+
+    fn rdesc_patch_entries(
+        table: &crate::rdesc_patch::PatchTable,
+    ) -> Vec<(String, Vec<u8>, Vec<u8>)> {
+        table
+            .patches
+            .iter()
+            .enumerate()
+            .map(|(idx, patch)| {
+                let mut entry = rdesc_patch {
+                    /* an unresolved entry is not attached, see into_device_match() */
+                    offset: patch.offset.unwrap_or(0) as u16,
+                    size: patch.expected.len() as u16,
+                    expected: [0; RDESC_PATCH_MAX_SIZE as usize],
+                    replacement: [0; RDESC_PATCH_MAX_SIZE as usize],
+                };
+
+                entry.expected[..patch.expected.len()].copy_from_slice(&patch.expected);
+                entry.replacement[..patch.replacement.len()].copy_from_slice(&patch.replacement);
+
+                (
+                    String::from("rdesc_patches"),
+                    (idx as u32).to_ne_bytes().to_vec(),
+                    as_bytes(&entry).to_vec(),
+                )
+            })
+            .collect()
+    }
+
+    fn event_transform_entries(
+        list: &crate::event_transform::RuleList,
+    ) -> Vec<(String, Vec<u8>, Vec<u8>)> {
+        list.rules
+            .iter()
+            .enumerate()
+            .map(|(idx, rule)| {
+                let entry = event_transform_rule {
+                    op: rule.op as u8,
+                    size: rule.size,
+                    is_signed: rule.is_signed as u8,
+                    padding: 0,
+                    report_id: rule.report_id,
+                    offset: rule.offset as u16,
+                    arg0: rule.args[0],
+                    arg1: rule.args[1],
+                    arg2: rule.args[2],
+                };
+
+                (
+                    String::from("event_transform_rules"),
+                    (idx as u32).to_ne_bytes().to_vec(),
+                    as_bytes(&entry).to_vec(),
+                )
+            })
+            .collect()
+    }
+}
+
+/*
+ * Probe results are cached in a tmpfs, keyed by the object and the report
+ * descriptor hashes: a replug of a known device doesn't need to open,
+ * relocate and load objects whose probe already refused it.
+ *
+ * Only definitive rejections are cached, a matching probe is always run
+ * again because it may configure the device through hid_bpf_hw_request(),
+ * and a probe failing for a transient reason (-ENOMEM, -EAGAIN, -EBUSY...)
+ * may accept the device next time.
+ */
+const PROBE_CACHE_DIR: &str = "/run/udev-hid-bpf/probe";
+
+fn probe_cache_path(object_hash: u64, rdesc_hash: u64) -> PathBuf {
+    PathBuf::from(PROBE_CACHE_DIR).join(format!("{:016x}-{:016x}", object_hash, rdesc_hash))
+}
+
+fn probe_cache_lookup(object_hash: u64, rdesc_hash: u64) -> Option<i32> {
+    fs::read_to_string(probe_cache_path(object_hash, rdesc_hash))
+        .ok()
+        .and_then(|retval| retval.trim().parse::<i32>().ok())
+}
+
+/// Whether a probe `retval` says the object can never apply to the device
+fn probe_result_is_definitive(retval: i32) -> bool {
+    retval == -libc::EINVAL || retval == -libc::ENODEV
+}
+
+fn probe_cache_store(object_hash: u64, rdesc_hash: u64, retval: i32) {
+    if !probe_result_is_definitive(retval) {
+        return;
+    }
+
+    let path = probe_cache_path(object_hash, rdesc_hash);
+    let tmp = path.with_extension(format!("tmp{}", std::process::id()));
+
+    /* write then rename so concurrent udev workers never read a partial file */
+    if let Err(e) = fs::create_dir_all(PROBE_CACHE_DIR)
+        .and_then(|_| fs::write(&tmp, format!("{}\n", retval)))
+        .and_then(|_| fs::rename(&tmp, &path))
+    {
+        log::debug!("could not cache probe result in {}: {}", path.display(), e);
+        fs::remove_file(&tmp).ok();
+    }
+}
+
+fn io_error(e: std::io::Error) -> libbpf_rs::Error {
+    libbpf_rs::Error::System(-e.raw_os_error().unwrap_or(libc::EINVAL))
+}
+
+/*
+ * Detach every link pinned in the tree before unpinning it: struct_ops
+ * links would otherwise stay attached as long as anybody holds a fd.
+ * Pinned maps and legacy HID-BPF links simply refuse the detach.
+ */
+fn detach_pinned_links(dir: &std::path::Path) {
+    let entries = match fs::read_dir(dir) {
+        Ok(entries) => entries,
+        Err(_) => return,
+    };
+
+    for entry in entries.flatten() {
+        let path = entry.path();
+        if path.is_dir() {
+            detach_pinned_links(&path);
+            continue;
+        }
+
+        let c_str = std::ffi::CString::new(path.to_str().unwrap()).unwrap();
+        unsafe {
+            let fd = libbpf_sys::bpf_obj_get(c_str.as_ptr());
+            if fd >= 0 {
+                if libbpf_sys::bpf_link_detach(fd) == 0 {
+                    log::debug!(target: "libbpf", "detached link {}", path.display());
+                }
+                libc::close(fd);
+            }
+        }
+    }
+}
+
 pub fn remove_bpf_objects(sysname: &str) -> std::io::Result<()> {
     let path = get_bpffs_path(sysname, "");
 
+    detach_pinned_links(std::path::Path::new(&path));
     std::fs::remove_dir_all(path).ok();
 
     Ok(())
 }
 
 fn run_syscall_prog<T>(prog: &libbpf_rs::Program, data: T) -> Result<T, libbpf_rs::Error> {
-    let fd = prog.as_fd().as_raw_fd();
+    run_syscall_prog_fd(prog.as_fd().as_raw_fd(), data)
+}
+
+fn run_syscall_prog_fd<T>(fd: i32, data: T) -> Result<T, libbpf_rs::Error> {
     let data_ptr: *const libc::c_void = &data as *const _ as *const libc::c_void;
     let mut run_opts = libbpf_sys::bpf_test_run_opts::default();
 
@@ -63,120 +802,380 @@ fn pin_hid_bpf_prog(link: i32, path: String) -> Result<(), libbpf_rs::Error> {
     }
 }
 
-impl hid_bpf_probe_args {
-    fn from(device: &hidudev::HidUdev) -> Self {
-        let syspath = device.syspath();
-        let rdesc = syspath + "/report_descriptor";
-
-        let mut buffer = fs::read(&rdesc).unwrap();
-        let length = buffer.len();
+/*
+ * libbpf-rs doesn't give access to the struct_ops data before load, and we
+ * need to set `hid_id` there, so the struct_ops backend uses libbpf directly.
+ * `match` also uses it to load objects of either backend without attaching.
+ */
+struct StructOpsObject {
+    ptr: *mut libbpf_sys::bpf_object,
+}
 
-        buffer.resize(4096, 0);
+impl StructOpsObject {
+    fn open(path: &PathBuf) -> Result<Self, libbpf_rs::Error> {
+        let c_path = std::ffi::CString::new(path.to_str().unwrap()).unwrap();
 
-        hid_bpf_probe_args {
-            hid: device.id(),
-            rdesc_size: length as u32,
-            rdesc: buffer.try_into().unwrap(),
-            retval: -1,
+        unsafe {
+            let ptr = libbpf_sys::bpf_object__open_file(c_path.as_ptr(), std::ptr::null());
+            match libbpf_sys::libbpf_get_error(ptr as *const libc::c_void) {
+                0 => Ok(Self { ptr }),
+                e => Err(libbpf_rs::Error::System(e as i32)),
+            }
         }
     }
-}
 
-impl<'a> HidBPF<'a> {
-    pub fn new() -> Result<Self, libbpf_rs::Error> {
-        let skel_builder = AttachSkelBuilder::default();
-        let open_skel = skel_builder.open()?;
-        let inner = Some(open_skel.load()?);
-        Ok(Self { inner })
+    fn load(&self) -> Result<(), libbpf_rs::Error> {
+        match unsafe { libbpf_sys::bpf_object__load(self.ptr) } {
+            0 => Ok(()),
+            e => Err(libbpf_rs::Error::System(e)),
+        }
     }
 
-    pub fn load_programs(
-        &self,
-        path: &PathBuf,
-        device: &hidudev::HidUdev,
-    ) -> Result<bool, libbpf_rs::Error> {
-        log::debug!(target: "libbpf", "loading BPF object at {:?}", path.display());
+    fn maps(&self) -> Vec<*mut libbpf_sys::bpf_map> {
+        let mut maps = Vec::new();
+        let mut map = std::ptr::null_mut();
 
-        let mut obj_builder = libbpf_rs::ObjectBuilder::default();
-        let mut object = obj_builder.open_file(path.clone())?.load()?;
-        let object_name = path.as_path().file_stem().unwrap().to_str().unwrap();
+        loop {
+            map = unsafe { libbpf_sys::bpf_object__next_map(self.ptr, map) };
+            if map.is_null() {
+                break;
+            }
+            maps.push(map);
+        }
 
-        let hid_id = device.id();
+        maps
+    }
 
-        /*
-         * if there is a "probe" syscall, execute it and
-         * check for the return value: if not 0, then ignore
-         * this bpf.o file
-         */
-        if let Some(probe) = object.prog("probe") {
-            let args = hid_bpf_probe_args::from(device);
+    fn struct_ops_maps(&self) -> Vec<*mut libbpf_sys::bpf_map> {
+        self.maps()
+            .into_iter()
+            .filter(|map| Self::is_struct_ops(*map))
+            .collect()
+    }
 
-            let args = run_syscall_prog(probe, args)?;
+    fn is_struct_ops(map: *mut libbpf_sys::bpf_map) -> bool {
+        unsafe { libbpf_sys::bpf_map__type(map) == libbpf_sys::BPF_MAP_TYPE_STRUCT_OPS }
+    }
 
-            if args.retval != 0 {
-                return Ok(false);
-            }
-        };
+    fn map_name(map: *mut libbpf_sys::bpf_map) -> String {
+        unsafe { std::ffi::CStr::from_ptr(libbpf_sys::bpf_map__name(map)) }
+            .to_string_lossy()
+            .into_owned()
+    }
 
-        let inner = self.inner.as_ref().expect("open_and_load() never called!");
-        let mut attached = false;
+    fn update_map(&self, name: &str, key: &[u8], value: &[u8]) -> Result<(), libbpf_rs::Error> {
+        let c_name = std::ffi::CString::new(name).unwrap();
 
-        for prog in object.progs_iter() {
-            let tracing_prog = match prog.prog_type() {
-                libbpf_rs::ProgramType::Tracing => prog,
-                _ => continue,
-            };
+        unsafe {
+            let map = libbpf_sys::bpf_object__find_map_by_name(self.ptr, c_name.as_ptr());
+            if map.is_null() {
+                return Err(libbpf_rs::Error::System(-libc::ENOENT));
+            }
 
-            let attach_args = AttachProgArgs {
-                prog_fd: tracing_prog.as_fd().as_raw_fd(),
-                hid: hid_id,
-                retval: -1,
-            };
+            match libbpf_sys::bpf_map__update_elem(
+                map,
+                key.as_ptr() as *const libc::c_void,
+                key.len() as libbpf_sys::size_t,
+                value.as_ptr() as *const libc::c_void,
+                value.len() as libbpf_sys::size_t,
+                libbpf_sys::BPF_ANY as u64,
+            ) {
+                0 => Ok(()),
+                e => Err(libbpf_rs::Error::System(e)),
+            }
+        }
+    }
 
-            let ret_syscall = run_syscall_prog(inner.progs().attach_prog(), attach_args);
+    /// The instructions after the verifier rewrites and the bytes of
+    /// native code of all the programs of a loaded object
+    fn programs_size(&self) -> (u64, u64) {
+        let mut prog = std::ptr::null_mut();
+        let (mut insns, mut jited) = (0, 0);
 
-            if let Err(e) = ret_syscall {
-                log::warn!(
-                    "could not call attach {} to device id {}, error {}",
-                    &tracing_prog.name(),
-                    hid_id,
-                    e.to_string(),
-                );
-                continue;
+        loop {
+            prog = unsafe { libbpf_sys::bpf_object__next_program(self.ptr, prog) };
+            if prog.is_null() {
+                break;
             }
 
-            let args = ret_syscall.unwrap();
-
-            if args.retval <= 0 {
-                log::warn!(
-                    "could not attach {} to device id {}, error {}",
-                    &tracing_prog.name(),
-                    hid_id,
-                    libbpf_rs::Error::System(args.retval).to_string(),
-                );
-                continue;
+            let mut info = libbpf_sys::bpf_prog_info::default();
+            let mut len = std::mem::size_of::<libbpf_sys::bpf_prog_info>() as u32;
+            let fd = unsafe { libbpf_sys::bpf_program__fd(prog) };
+            if fd >= 0
+                && unsafe { libbpf_sys::bpf_prog_get_info_by_fd(fd, &mut info, &mut len) } == 0
+            {
+                insns += info.xlated_prog_len as u64 / 8;
+                jited += info.jited_prog_len as u64;
             }
+        }
 
-            let link = args.retval;
+        (insns, jited)
+    }
 
-            log::debug!(
-                target: "libbpf",
-                "successfully attached {} to device id {}",
-                &tracing_prog.name(),
-                hid_id,
-            );
+    /// The name and initial value of the `.rodata` map, the map name is
+    /// prefixed by libbpf with (part of) the object name.
+    fn rodata(&mut self) -> Option<(String, &mut [u8])> {
+        let map = self
+            .maps()
+            .into_iter()
+            .find(|map| Self::map_name(*map).ends_with(".rodata"))?;
+        let mut size: libbpf_sys::size_t = 0;
+        let data = unsafe { libbpf_sys::bpf_map__initial_value(map, &mut size) };
 
-            let path = format!(
-                "{}/{}",
-                get_bpffs_path(&device.sysname(), object_name),
-                tracing_prog.name(),
-            );
+        if data.is_null() {
+            return None;
+        }
 
-            fs::create_dir_all(get_bpffs_path(&device.sysname(), object_name)).unwrap_or_else(
-                |why| {
-                    log::warn!("! {:?}", why.kind());
-                },
+        Some((Self::map_name(map), unsafe {
+            std::slice::from_raw_parts_mut(data as *mut u8, size as usize)
+        }))
+    }
+
+    fn prog_fd(&self, name: &str) -> Option<i32> {
+        let c_name = std::ffi::CString::new(name).unwrap();
+
+        unsafe {
+            let prog = libbpf_sys::bpf_object__find_program_by_name(self.ptr, c_name.as_ptr());
+            if prog.is_null() {
+                return None;
+            }
+            match libbpf_sys::bpf_program__fd(prog) {
+                fd if fd >= 0 => Some(fd),
+                _ => None,
+            }
+        }
+    }
+}
+
+impl Drop for StructOpsObject {
+    fn drop(&mut self) {
+        unsafe { libbpf_sys::bpf_object__close(self.ptr) };
+    }
+}
+
+impl hid_bpf_probe_args {
+    pub fn from(device: &hidudev::DeviceSnapshot) -> Self {
+        let rdesc = device.rdesc();
+        let mut args = hid_bpf_probe_args {
+            hid: device.id(),
+            rdesc_size: 0,
+            rdesc: [0; 4096],
+            retval: -1,
+        };
+        let length = rdesc.len().min(args.rdesc.len());
+
+        args.rdesc[..length].copy_from_slice(&rdesc[..length]);
+        args.rdesc_size = length as u32;
+        args
+    }
+}
+
+impl<'a> HidBPF<'a> {
+    pub fn new() -> Result<Self, libbpf_rs::Error> {
+        let backend = Backend::detect().ok_or(libbpf_rs::Error::System(-libc::EOPNOTSUPP))?;
+        log::debug!(target: "libbpf", "using the {:?} HID-BPF backend", backend);
+
+        /* struct_ops objects are attached by the kernel, no helper needed */
+        let inner = match backend {
+            Backend::FmodRet => {
+                let skel_builder = AttachSkelBuilder::default();
+                let open_skel = skel_builder.open()?;
+                Some(open_skel.load()?)
+            }
+            Backend::StructOps => None,
+        };
+
+        Ok(Self { backend, inner })
+    }
+
+    /// `object` comes from [`ObjectToLoad::from_path()`] for the same
+    /// `device`.
+    pub fn load_programs(
+        &self,
+        object: &ObjectToLoad,
+        device: &hidudev::DeviceSnapshot,
+    ) -> Result<bool, libbpf_rs::Error> {
+        let path = object.source();
+        log::debug!(target: "libbpf", "loading BPF object at {:?}", path.display());
+        let file_name = path.file_name().unwrap_or_default().to_string_lossy();
+
+        if let Some(device_match) = &object.device_match {
+            if !device_match.matches(device.rdesc(), device.rdesc_hash(), device.signatures()) {
+                log::debug!(target: "libbpf", "skipping {:?}, no match", path.display());
+                crate::metrics::record_skip(&file_name, crate::metrics::LoadResult::NoDeviceMatch);
+                return Ok(false);
+            }
+        }
+
+        if let Some(retval) = probe_cache_lookup(object.hash, device.rdesc_hash()) {
+            log::debug!(
+                target: "libbpf",
+                "skipping {:?}, probe previously returned {}",
+                path.display(),
+                retval,
+            );
+            crate::metrics::record_skip(&file_name, crate::metrics::LoadResult::ProbeCached);
+            return Ok(false);
+        }
+
+        let start = std::time::Instant::now();
+        let result = match self.backend {
+            Backend::FmodRet => self.load_fmod_ret_programs(object, device),
+            Backend::StructOps => self.load_struct_ops_programs(object, device),
+        };
+
+        crate::metrics::record_load(
+            &file_name,
+            match result {
+                Ok(true) => crate::metrics::LoadResult::Attached,
+                Ok(false) => crate::metrics::LoadResult::NotMatched,
+                Err(_) => crate::metrics::LoadResult::Failed,
+            },
+            start.elapsed(),
+        );
+
+        result
+    }
+
+    fn load_fmod_ret_programs(
+        &self,
+        object_to_load: &ObjectToLoad,
+        device: &hidudev::DeviceSnapshot,
+    ) -> Result<bool, libbpf_rs::Error> {
+        let hash = object_to_load.hash;
+        let object_name = object_to_load.name.as_str();
+        let mut obj_builder = libbpf_rs::ObjectBuilder::default();
+        let mut open_object = obj_builder.open_file(&object_to_load.path)?;
+
+        /*
+         * libbpf-rs doesn't expose the initial value of the maps before
+         * load, so get the current .rodata from libbpf and set it back
+         */
+        if !object_to_load.rodata.is_empty() {
+            let mut raw_object = StructOpsObject::open(&object_to_load.path)?;
+            let (map_name, data) = raw_object
+                .rodata()
+                .ok_or(libbpf_rs::Error::System(-libc::ENOENT))?;
+            object_to_load.apply_rodata(data)?;
+
+            open_object
+                .map_mut(&map_name)
+                .ok_or(libbpf_rs::Error::System(-libc::ENOENT))?
+                .set_initial_value(data)?;
+        }
+
+        let start = std::time::Instant::now();
+        let loaded = open_object.load();
+        crate::metrics::record_verify(start.elapsed());
+        let mut object = loaded?;
+
+        let hid_id = device.id();
+
+        /* before probe, which reads the signature offsets */
+        for (map_name, key, value) in object_to_load.map_entries.iter() {
+            let map = object
+                .map_mut(map_name)
+                .ok_or(libbpf_rs::Error::System(-libc::ENOENT))?;
+            map.update(key, value, libbpf_rs::MapFlags::ANY)?;
+        }
+
+        /*
+         * if there is a "probe" syscall, execute it and
+         * check for the return value: if not 0, then ignore
+         * this bpf.o file
+         */
+        if let Some(probe) = object.prog("probe") {
+            let args = hid_bpf_probe_args::from(device);
+
+            let args = run_syscall_prog(probe, args)?;
+
+            if args.retval != 0 {
+                probe_cache_store(hash, device.rdesc_hash(), args.retval);
+                return Ok(false);
+            }
+        };
+
+        let inner = self.inner.as_ref().expect("open_and_load() never called!");
+        let mut attached = false;
+        let mut links = 0;
+
+        let object_path = get_bpffs_path(device.sysname(), object_name);
+
+        /* compiler internal maps contain the name of the object and a dot */
+        for map in object.maps_iter().filter(|map| !map.name().contains(".")) {
+            carry_over_map(
+                &object_path,
+                map.name(),
+                map.as_fd().as_raw_fd(),
+                &object_to_load.map_entries,
             );
+        }
+
+        let staging_path = prepare_staging(&object_path);
+
+        let tracing_progs: Vec<&libbpf_rs::Program> = object
+            .progs_iter()
+            .filter(|prog| matches!(prog.prog_type(), libbpf_rs::ProgramType::Tracing))
+            .collect();
+
+        /*
+         * attach all the programs of the object in one BPF_PROG_TEST_RUN
+         * syscall, the attach program reports one return value per program
+         */
+        let mut attached_progs = Vec::new();
+
+        for batch in tracing_progs.chunks(HID_BPF_MAX_PROGS_PER_DEV as usize) {
+            let mut attach_args = AttachProgArgs {
+                prog_fds: [0; HID_BPF_MAX_PROGS_PER_DEV as usize],
+                hid: hid_id,
+                count: batch.len() as u32,
+                retvals: [-1; HID_BPF_MAX_PROGS_PER_DEV as usize],
+            };
+
+            for (idx, tracing_prog) in batch.iter().enumerate() {
+                attach_args.prog_fds[idx] = tracing_prog.as_fd().as_raw_fd();
+            }
+
+            match run_syscall_prog(inner.progs().attach_prog(), attach_args) {
+                Ok(args) => attached_progs.extend(batch.iter().zip(args.retvals)),
+                Err(e) => {
+                    for tracing_prog in batch {
+                        log::warn!(
+                            "could not call attach {} to device id {}, error {}",
+                            &tracing_prog.name(),
+                            hid_id,
+                            e.to_string(),
+                        );
+                    }
+                }
+            }
+        }
+
+        for (tracing_prog, retval) in attached_progs {
+            if retval <= 0 {
+                log::warn!(
+                    "could not attach {} to device id {}, error {}",
+                    &tracing_prog.name(),
+                    hid_id,
+                    libbpf_rs::Error::System(retval).to_string(),
+                );
+                continue;
+            }
+
+            let link = retval;
+
+            log::debug!(
+                target: "libbpf",
+                "successfully attached {} to device id {}",
+                &tracing_prog.name(),
+                hid_id,
+            );
+
+            let path = format!("{}/{}", staging_path, tracing_prog.name());
+
+            fs::create_dir_all(&staging_path).unwrap_or_else(|why| {
+                log::warn!("! {:?}", why.kind());
+            });
 
             match pin_hid_bpf_prog(link, path.clone()) {
                 Err(e) => {
@@ -193,30 +1192,1221 @@ impl<'a> HidBPF<'a> {
                 }
                 Ok(_) => {
                     attached = true;
+                    links += 1;
                     log::debug!(target: "libbpf", "Successfully pinned prog at {}", path);
                 }
             }
         }
 
         if attached {
-            /* compiler internal maps contain the name of the object and a dot */
             for map in object
                 .maps_iter_mut()
                 .filter(|map| !map.name().contains("."))
             {
-                let path = format!(
-                    "{}/{}",
-                    get_bpffs_path(&device.sysname(), object_name),
-                    map.name(),
-                );
+                let path = format!("{}/{}", staging_path, map.name());
 
                 if let Ok(_) = map.pin(&path) {
                     attached = true;
                     log::debug!(target: "libbpf", "Successfully pinned map at {}", path);
                 }
             }
+
+            commit_staging(&staging_path, &object_path);
+            record_pinned_state(&object_path, object_name, hash, hid_id, links);
+        } else {
+            discard_staging(&staging_path);
         }
 
         Ok(attached)
     }
+
+    fn load_struct_ops_programs(
+        &self,
+        object_to_load: &ObjectToLoad,
+        device: &hidudev::DeviceSnapshot,
+    ) -> Result<bool, libbpf_rs::Error> {
+        let hash = object_to_load.hash;
+        let object_name = object_to_load.name.as_str();
+        let mut object = StructOpsObject::open(&object_to_load.path)?;
+
+        /* an fmod_ret only object has nothing to attach with this backend */
+        if object.struct_ops_maps().is_empty() {
+            log::warn!(
+                "{} has no struct hid_bpf_ops, it can not be attached on this kernel",
+                object_to_load.path.display(),
+            );
+            return Err(libbpf_rs::Error::System(-libc::EOPNOTSUPP));
+        }
+
+        let hid_id = device.id();
+
+        /* hid_id is the first field of struct hid_bpf_ops and must be set before load */
+        for map in object.struct_ops_maps() {
+            let mut size: libbpf_sys::size_t = 0;
+            let data = unsafe { libbpf_sys::bpf_map__initial_value(map, &mut size) };
+
+            if data.is_null() || (size as usize) < std::mem::size_of::<i32>() {
+                return Err(libbpf_rs::Error::System(-libc::EINVAL));
+            }
+
+            unsafe { *(data as *mut i32) = hid_id as i32 };
+        }
+
+        if !object_to_load.rodata.is_empty() {
+            let (_, data) = object
+                .rodata()
+                .ok_or(libbpf_rs::Error::System(-libc::ENOENT))?;
+            object_to_load.apply_rodata(data)?;
+        }
+
+        let start = std::time::Instant::now();
+        let loaded = object.load();
+        crate::metrics::record_verify(start.elapsed());
+        loaded?;
+
+        /* before probe, which reads the signature offsets */
+        for (map_name, key, value) in object_to_load.map_entries.iter() {
+            object.update_map(map_name, key, value)?;
+        }
+
+        if let Some(probe) = object.prog_fd("probe") {
+            let args = hid_bpf_probe_args::from(device);
+
+            let args = run_syscall_prog_fd(probe, args)?;
+
+            if args.retval != 0 {
+                probe_cache_store(hash, device.rdesc_hash(), args.retval);
+                return Ok(false);
+            }
+        };
+
+        let object_path = get_bpffs_path(device.sysname(), object_name);
+
+        /* compiler internal maps contain the name of the object and a dot */
+        let maps: Vec<*mut libbpf_sys::bpf_map> = object
+            .maps()
+            .into_iter()
+            .filter(|map| {
+                !StructOpsObject::is_struct_ops(*map)
+                    && !StructOpsObject::map_name(*map).contains(".")
+            })
+            .collect();
+
+        for map in maps.iter() {
+            carry_over_map(
+                &object_path,
+                &StructOpsObject::map_name(*map),
+                unsafe { libbpf_sys::bpf_map__fd(*map) },
+                &object_to_load.map_entries,
+            );
+        }
+
+        let staging_path = prepare_staging(&object_path);
+        let mut links = 0;
+
+        for map in object.struct_ops_maps() {
+            let map_name = StructOpsObject::map_name(map);
+            let mut link = unsafe { libbpf_sys::bpf_map__attach_struct_ops(map) };
+
+            /*
+             * the kernel only takes one rdesc_fixup per device, so a new
+             * version of such an object can't be attached next to the old one
+             */
+            if link.is_null() && std::path::Path::new(&object_path).exists() {
+                log::debug!(target: "libbpf", "detaching {} first", object_path);
+                detach_pinned_links(std::path::Path::new(&object_path));
+                fs::remove_dir_all(&object_path).ok();
+                link = unsafe { libbpf_sys::bpf_map__attach_struct_ops(map) };
+            }
+
+            if link.is_null() {
+                log::warn!(
+                    "could not attach {} to device id {}, error {}",
+                    map_name,
+                    hid_id,
+                    errno::errno().to_string(),
+                );
+                continue;
+            }
+
+            fs::create_dir_all(&staging_path).unwrap_or_else(|why| {
+                log::warn!("! {:?}", why.kind());
+            });
+
+            let path = format!("{}/{}", staging_path, map_name);
+            let c_path = std::ffi::CString::new(path.clone()).unwrap();
+
+            /* the pin keeps the link alive once we close our fd */
+            match unsafe { libbpf_sys::bpf_link__pin(link, c_path.as_ptr()) } {
+                0 => {
+                    links += 1;
+                    log::debug!(target: "libbpf", "Successfully pinned link at {}", path);
+                }
+                e => log::warn!(
+                    "could not pin {} to device id {}, error {}",
+                    map_name,
+                    hid_id,
+                    errno::Errno(-e).to_string(),
+                ),
+            }
+
+            unsafe { libbpf_sys::bpf_link__destroy(link) };
+        }
+
+        if links > 0 {
+            for map in maps {
+                let path = format!("{}/{}", staging_path, StructOpsObject::map_name(map));
+                let c_path = std::ffi::CString::new(path.clone()).unwrap();
+
+                if unsafe { libbpf_sys::bpf_map__pin(map, c_path.as_ptr()) } == 0 {
+                    log::debug!(target: "libbpf", "Successfully pinned map at {}", path);
+                }
+            }
+
+            commit_staging(&staging_path, &object_path);
+            record_pinned_state(&object_path, object_name, hash, hid_id, links);
+        } else {
+            discard_staging(&staging_path);
+        }
+
+        Ok(links > 0)
+    }
+}
+
+/// What `match` found for one object and one device
+#[derive(Debug, Clone, PartialEq)]
+pub enum MatchResult {
+    /// no modalias of the object covers the device
+    NoModalias,
+    /// the report descriptor is not the one the data file expects
+    NoDeviceMatch,
+    /// `probe()` refused the device with this value
+    Probe(i32),
+    /// the object would be attached
+    Match,
+    /// the object could not be loaded or probed
+    Error(String),
+}
+
+#[derive(Debug, Clone)]
+pub struct MatchCell {
+    pub result: MatchResult,
+    /// time spent on this device, without loading the object
+    pub duration: std::time::Duration,
+}
+
+#[derive(Debug)]
+pub struct MatchRow {
+    pub path: PathBuf,
+    /// time spent loading the object, once per distinct `.rodata`
+    pub load_duration: std::time::Duration,
+    /// one per device, in order
+    pub cells: Vec<MatchCell>,
+}
+
+/// Runs the matching of one installed object against every device without
+/// attaching anything: the object is only loaded once per `.rodata`
+/// content and its probe is then run for each device.
+struct ObjectMatcher<'a> {
+    path: &'a PathBuf,
+    rodata: &'a [(String, String)],
+    /// the `HID_BPF_CONFIG` of a `.bpf.o`, data files have their own
+    btf_modaliases: Option<Vec<crate::modalias::Modalias>>,
+    loaded: std::collections::HashMap<Vec<(usize, Vec<u8>)>, Result<StructOpsObject, String>>,
+    load_duration: std::time::Duration,
+}
+
+impl<'a> ObjectMatcher<'a> {
+    fn new(path: &'a PathBuf, rodata: &'a [(String, String)]) -> Self {
+        ObjectMatcher {
+            path,
+            rodata,
+            btf_modaliases: None,
+            loaded: std::collections::HashMap::new(),
+            load_duration: std::time::Duration::ZERO,
+        }
+    }
+
+    fn btf_modaliases(&mut self, path: &PathBuf) -> &[crate::modalias::Modalias] {
+        self.btf_modaliases.get_or_insert_with(|| {
+            libbpf_rs::btf::Btf::from_path(path)
+                .ok()
+                .and_then(|btf| {
+                    crate::modalias::Metadata::from_btf(&btf)
+                        .map(|metadata| metadata.modaliases().collect())
+                })
+                .unwrap_or_default()
+        })
+    }
+
+    fn load(object: &ObjectToLoad) -> Result<StructOpsObject, libbpf_rs::Error> {
+        let mut raw_object = StructOpsObject::open(&object.path)?;
+
+        if !object.rodata.is_empty() {
+            let (_, data) = raw_object
+                .rodata()
+                .ok_or(libbpf_rs::Error::System(-libc::ENOENT))?;
+            object.apply_rodata(data)?;
+        }
+
+        raw_object.load()?;
+
+        for (map_name, key, value) in object.map_entries.iter() {
+            raw_object.update_map(map_name, key, value)?;
+        }
+
+        Ok(raw_object)
+    }
+
+    fn match_device(
+        &mut self,
+        device: &hidudev::DeviceSnapshot,
+    ) -> Result<MatchResult, libbpf_rs::Error> {
+        let object = ObjectToLoad::from_path(self.path, device, self.rodata)?;
+
+        let covered = match &object.device_match {
+            Some(device_match) => device_match
+                .modaliases
+                .iter()
+                .any(|modalias| modalias.matches(device.modalias())),
+            None => self
+                .btf_modaliases(&object.path)
+                .iter()
+                .any(|modalias| modalias.matches(device.modalias())),
+        };
+        if !covered {
+            return Ok(MatchResult::NoModalias);
+        }
+
+        if let Some(device_match) = &object.device_match {
+            if !device_match.matches(device.rdesc(), device.rdesc_hash(), device.signatures()) {
+                return Ok(MatchResult::NoDeviceMatch);
+            }
+        }
+
+        /* hid_id is left to 0 in struct_ops maps, only attaching checks it */
+        if !self.loaded.contains_key(&object.rodata) {
+            let start = std::time::Instant::now();
+            let loaded = Self::load(&object).map_err(|e| e.to_string());
+            self.load_duration += start.elapsed();
+            self.loaded.insert(object.rodata.clone(), loaded);
+        }
+
+        let probe = match &self.loaded[&object.rodata] {
+            Ok(loaded) => loaded.prog_fd("probe"),
+            Err(e) => return Ok(MatchResult::Error(e.clone())),
+        };
+
+        /* the probe cache is bypassed, this is what we want to check */
+        match probe {
+            Some(fd) => {
+                let args = run_syscall_prog_fd(fd, hid_bpf_probe_args::from(device))?;
+                match args.retval {
+                    0 => Ok(MatchResult::Match),
+                    retval => Ok(MatchResult::Probe(retval)),
+                }
+            }
+            None => Ok(MatchResult::Match),
+        }
+    }
+
+    fn run(mut self, devices: &[hidudev::DeviceSnapshot]) -> MatchRow {
+        let cells = devices
+            .iter()
+            .map(|device| {
+                let start = std::time::Instant::now();
+                let load_duration = self.load_duration;
+                let result = self
+                    .match_device(device)
+                    .unwrap_or_else(|e| MatchResult::Error(e.to_string()));
+
+                MatchCell {
+                    result,
+                    duration: start.elapsed() - (self.load_duration - load_duration),
+                }
+            })
+            .collect();
+
+        MatchRow {
+            path: self.path.clone(),
+            load_duration: self.load_duration,
+            cells,
+        }
+    }
+}
+
+/// Evaluates every object of `paths` against every device the way `add`
+/// would, without attaching anything. The objects are spread over a few
+/// threads, each of them loading an object once for all the devices.
+pub fn match_objects(
+    paths: &[PathBuf],
+    devices: &[hidudev::DeviceSnapshot],
+    rodata: &[(String, String)],
+) -> Vec<MatchRow> {
+    let next = std::sync::atomic::AtomicUsize::new(0);
+    let threads = std::thread::available_parallelism()
+        .map_or(1, |n| n.get())
+        .min(paths.len())
+        .max(1);
+
+    std::thread::scope(|scope| {
+        let next = &next;
+        let workers: Vec<_> = (0..threads)
+            .map(|_| {
+                scope.spawn(move || {
+                    let mut rows = Vec::new();
+                    loop {
+                        let idx = next.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+                        match paths.get(idx) {
+                            Some(path) => {
+                                rows.push((idx, ObjectMatcher::new(path, rodata).run(devices)))
+                            }
+                            None => break,
+                        }
+                    }
+                    rows
+                })
+            })
+            .collect();
+
+        let mut rows: Vec<(usize, MatchRow)> = workers
+            .into_iter()
+            .flat_map(|worker| worker.join().unwrap_or_default())
+            .collect();
+        rows.sort_by_key(|(idx, _)| *idx);
+        rows.into_iter().map(|(_, row)| row).collect()
+    })
+}
+
+/// The code the kernel runs for one build of an object
+pub struct VariantSize {
+    /// instructions after the verifier rewrites
+    pub insns: u64,
+    /// bytes of native code, 0 without JIT
+    pub jited: u64,
+}
+
+/// Loads the object at `path` and each of its [`ISA_VARIANTS`], without
+/// attaching them. The ISA is `None` for the default build, the variants
+/// that aren't installed are skipped.
+pub fn isa_variant_sizes(path: &PathBuf) -> Vec<(Option<u32>, Result<VariantSize, String>)> {
+    std::iter::once((None, path.clone()))
+        .chain(
+            ISA_VARIANTS
+                .iter()
+                .map(|isa| (Some(*isa), isa_variant_path(path, *isa))),
+        )
+        .filter(|(_, path)| path.exists())
+        .map(|(isa, path)| {
+            let size = StructOpsObject::open(&path)
+                .and_then(|object| object.load().map(|_| object.programs_size()))
+                .map(|(insns, jited)| VariantSize { insns, jited })
+                .map_err(|e| e.to_string());
+            (isa, size)
+        })
+        .collect()
+}
+
+/*
+ * A new version of an object is attached and pinned in a staging directory
+ * next to the old one, which is only detached once the new links are in
+ * place: the device never sees its reports unfiltered during an upgrade,
+ * and a new version that fails to attach leaves the old one alone.
+ *
+ * get_bpffs_path() replaces the dots, so the staging name can't collide
+ * with an object.
+ */
+fn staging_path(object_path: &str) -> String {
+    format!("{}.staging", object_path)
+}
+
+fn discard_staging(staging_path: &str) {
+    if std::path::Path::new(staging_path).exists() {
+        detach_pinned_links(std::path::Path::new(staging_path));
+        fs::remove_dir_all(staging_path).ok();
+    }
+}
+
+/// Drops the leftovers of an interrupted upgrade
+fn prepare_staging(object_path: &str) -> String {
+    let staging_path = staging_path(object_path);
+
+    discard_staging(&staging_path);
+
+    staging_path
+}
+
+fn commit_staging(staging_path: &str, object_path: &str) {
+    if std::path::Path::new(object_path).exists() {
+        log::debug!(target: "libbpf", "replacing outdated pins at {}", object_path);
+        detach_pinned_links(std::path::Path::new(object_path));
+        fs::remove_dir_all(object_path).ok();
+    }
+
+    /* the links stay attached where they are if this fails */
+    if let Err(e) = fs::rename(staging_path, object_path) {
+        log::warn!("could not move {} to {}: {}", staging_path, object_path, e);
+    }
+}
+
+/*
+ * The maps of the replaced version are copied in the new one when their
+ * layout didn't change, so counters and device states survive an upgrade.
+ * Maps filled from the data file are left alone, they carry the new data.
+ */
+#[derive(Debug, PartialEq)]
+struct MapLayout {
+    map_type: u32,
+    key_size: u32,
+    value_size: u32,
+    /// the name of the BTF type of the values, empty without BTF
+    value_type: String,
+}
+
+fn map_layout(fd: i32) -> Option<MapLayout> {
+    let mut info = libbpf_sys::bpf_map_info::default();
+    let mut len = std::mem::size_of::<libbpf_sys::bpf_map_info>() as u32;
+
+    if unsafe { libbpf_sys::bpf_map_get_info_by_fd(fd, &mut info, &mut len) } != 0 {
+        return None;
+    }
+
+    let mut value_type = String::new();
+    if info.btf_id != 0 && info.btf_value_type_id != 0 {
+        unsafe {
+            let btf = libbpf_sys::btf__load_from_kernel_by_id(info.btf_id);
+            if libbpf_sys::libbpf_get_error(btf as *const libc::c_void) == 0 {
+                let ty = libbpf_sys::btf__type_by_id(btf, info.btf_value_type_id);
+                if !ty.is_null() {
+                    let name = libbpf_sys::btf__name_by_offset(btf, (*ty).name_off);
+                    if !name.is_null() {
+                        value_type = std::ffi::CStr::from_ptr(name)
+                            .to_string_lossy()
+                            .into_owned();
+                    }
+                }
+                libbpf_sys::btf__free(btf);
+            }
+        }
+    }
+
+    Some(MapLayout {
+        map_type: info.type_,
+        key_size: info.key_size,
+        value_size: info.value_size,
+        value_type,
+    })
+}
+
+fn carry_over_map(
+    object_path: &str,
+    map_name: &str,
+    fd: i32,
+    map_entries: &[(String, Vec<u8>, Vec<u8>)],
+) {
+    if fd < 0 || map_entries.iter().any(|(name, _, _)| name == map_name) {
+        return;
+    }
+
+    let c_path = std::ffi::CString::new(format!("{}/{}", object_path, map_name)).unwrap();
+    let old_fd = unsafe { libbpf_sys::bpf_obj_get(c_path.as_ptr()) };
+    if old_fd < 0 {
+        return;
+    }
+
+    /* per-CPU values are not the value_size seen from userspace */
+    let layout = map_layout(fd).filter(|layout| {
+        matches!(
+            layout.map_type,
+            libbpf_sys::BPF_MAP_TYPE_HASH
+                | libbpf_sys::BPF_MAP_TYPE_ARRAY
+                | libbpf_sys::BPF_MAP_TYPE_LRU_HASH
+        )
+    });
+
+    match (map_layout(old_fd), layout) {
+        (Some(old), Some(new)) if old == new => {
+            let mut key = vec![0u8; new.key_size as usize];
+            let mut next_key = vec![0u8; new.key_size as usize];
+            let mut value = vec![0u8; new.value_size as usize];
+            let mut prev: *const libc::c_void = std::ptr::null();
+            let mut count = 0;
+
+            unsafe {
+                while libbpf_sys::bpf_map_get_next_key(
+                    old_fd,
+                    prev,
+                    next_key.as_mut_ptr() as *mut libc::c_void,
+                ) == 0
+                {
+                    if libbpf_sys::bpf_map_lookup_elem(
+                        old_fd,
+                        next_key.as_ptr() as *const libc::c_void,
+                        value.as_mut_ptr() as *mut libc::c_void,
+                    ) == 0
+                        && libbpf_sys::bpf_map_update_elem(
+                            fd,
+                            next_key.as_ptr() as *const libc::c_void,
+                            value.as_ptr() as *const libc::c_void,
+                            libbpf_sys::BPF_ANY as u64,
+                        ) == 0
+                    {
+                        count += 1;
+                    }
+                    key.copy_from_slice(&next_key);
+                    prev = key.as_ptr() as *const libc::c_void;
+                }
+            }
+
+            log::debug!(target: "libbpf", "carried over {} entries of {}", count, map_name);
+        }
+        (Some(_), _) => {
+            log::debug!(target: "libbpf", "not carrying over {}, layout changed", map_name)
+        }
+        _ => {}
+    }
+
+    unsafe { libc::close(old_fd) };
+}
+
+/// Detaches and unpins the objects of the device that are not in `keep`,
+/// `.bpf.o` or data files as given to [`ObjectToLoad::from_path()`]
+pub fn remove_bpf_objects_except(
+    device: &hidudev::DeviceSnapshot,
+    keep: &[PathBuf],
+) -> std::io::Result<()> {
+    let kept: Vec<String> = keep
+        .iter()
+        .map(|path| get_bpffs_path(device.sysname(), &object_name(path)))
+        .collect();
+
+    let entries = match fs::read_dir(device.bpffs_path()) {
+        Ok(entries) => entries,
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(()),
+        Err(e) => return Err(e),
+    };
+
+    for entry in entries.flatten() {
+        let path = entry.path();
+        if kept.iter().any(|kept| std::path::Path::new(kept) == path) {
+            continue;
+        }
+
+        log::debug!(target: "libbpf", "removing {}", path.display());
+        detach_pinned_links(&path);
+        fs::remove_dir_all(&path).ok();
+    }
+
+    Ok(())
+}
+
+/// An object attached to a device, as recorded in its bpffs directory
+#[derive(Debug)]
+pub struct AttachedObject {
+    /// the bpffs name of the device, e.g. `0003_045E_07A5_0001`
+    pub device: String,
+    pub object: String,
+    pub hash: u64,
+    pub hid: u32,
+    pub links: u32,
+    /// the bpffs directory of the object
+    pub path: PathBuf,
+}
+
+/// Every object attached by udev-hid-bpf to any device
+pub fn attached_objects() -> Vec<AttachedObject> {
+    let mut objects = Vec::new();
+    let devices = match fs::read_dir(get_bpffs_path("", "")) {
+        Ok(devices) => devices,
+        Err(_) => return objects,
+    };
+
+    for device in devices.flatten() {
+        for object in fs::read_dir(device.path()).into_iter().flatten().flatten() {
+            let name = object.file_name().to_string_lossy().into_owned();
+
+            /* an interrupted reload */
+            if name.ends_with(".staging") {
+                continue;
+            }
+
+            if let Some(state) = read_pinned_state(&object.path().to_string_lossy()) {
+                objects.push(AttachedObject {
+                    device: device.file_name().to_string_lossy().into_owned(),
+                    object: name,
+                    hash: state.hash,
+                    hid: state.hid,
+                    links: state.attached,
+                    path: object.path(),
+                });
+            }
+        }
+    }
+
+    objects.sort_by(|a, b| (&a.device, &a.object).cmp(&(&b.device, &b.object)));
+    objects
+}
+
+const STAGING_GRACE_PERIOD: std::time::Duration = std::time::Duration::from_secs(60);
+
+/// What [`collect_garbage()`] removed
+#[derive(Debug, Default)]
+pub struct GarbageReport {
+    /// device directories of devices that are gone
+    pub devices: usize,
+    /// staging directories of interrupted reloads
+    pub staging: usize,
+    pub pins: usize,
+    /// estimated from the map sizes and the program lengths
+    pub bytes: u64,
+}
+
+/// An estimate of the kernel memory held by the map or link pinned at `path`
+fn pinned_object_size(path: &std::path::Path, progs: &mut Vec<u32>) -> u64 {
+    let c_str = std::ffi::CString::new(path.to_string_lossy().as_bytes()).unwrap();
+    let fd = unsafe { libbpf_sys::bpf_obj_get(c_str.as_ptr()) };
+    if fd < 0 {
+        return 0;
+    }
+
+    let mut size = 0;
+    let mut map_info = libbpf_sys::bpf_map_info::default();
+    let mut len = std::mem::size_of::<libbpf_sys::bpf_map_info>() as u32;
+
+    if unsafe { libbpf_sys::bpf_map_get_info_by_fd(fd, &mut map_info, &mut len) } == 0 {
+        size =
+            map_info.max_entries as u64 * (map_info.key_size as u64 + map_info.value_size as u64);
+    } else if let Some(prog_info) = link_prog_info(fd, progs) {
+        size = prog_info.jited_prog_len as u64 + prog_info.xlated_prog_len as u64;
+    }
+
+    unsafe { libc::close(fd) };
+    size
+}
+
+/// The program of the link `fd`, unless it is already in `progs`: several
+/// links of an object may share a program
+fn link_prog_info(fd: i32, progs: &mut Vec<u32>) -> Option<libbpf_sys::bpf_prog_info> {
+    let mut link_info = libbpf_sys::bpf_link_info::default();
+    let mut link_len = std::mem::size_of::<libbpf_sys::bpf_link_info>() as u32;
+
+    if unsafe { libbpf_sys::bpf_link_get_info_by_fd(fd, &mut link_info, &mut link_len) } != 0
+        || link_info.prog_id == 0
+        || progs.contains(&link_info.prog_id)
+    {
+        return None;
+    }
+    progs.push(link_info.prog_id);
+
+    let prog_fd = unsafe { libbpf_sys::bpf_prog_get_fd_by_id(link_info.prog_id) };
+    if prog_fd < 0 {
+        return None;
+    }
+
+    let mut prog_info = libbpf_sys::bpf_prog_info::default();
+    let mut prog_len = std::mem::size_of::<libbpf_sys::bpf_prog_info>() as u32;
+    let result =
+        unsafe { libbpf_sys::bpf_prog_get_info_by_fd(prog_fd, &mut prog_info, &mut prog_len) };
+    unsafe { libc::close(prog_fd) };
+
+    match result {
+        0 => Some(prog_info),
+        _ => None,
+    }
+}
+
+/// Whether the kernel counts the runs of the programs: the run counters
+/// of [`program_samples()`] stay at 0 without the sysctl.
+pub fn bpf_stats_enabled() -> bool {
+    fs::read_to_string("/proc/sys/kernel/bpf_stats_enabled")
+        .map_or(false, |value| value.trim() != "0")
+}
+
+/// The run counters of the programs attached to every device. The links
+/// of the struct_ops backend don't point to their programs, only the
+/// fmod_ret programs are found.
+pub fn program_samples() -> Vec<crate::metrics::ProgramSample> {
+    let mut samples = Vec::new();
+
+    for object in attached_objects() {
+        let mut progs = Vec::new();
+
+        for pin in fs::read_dir(&object.path).into_iter().flatten().flatten() {
+            let c_path = std::ffi::CString::new(pin.path().to_string_lossy().as_bytes()).unwrap();
+            let fd = unsafe { libbpf_sys::bpf_obj_get(c_path.as_ptr()) };
+            if fd < 0 {
+                continue;
+            }
+
+            if let Some(info) = link_prog_info(fd, &mut progs) {
+                let name = unsafe { std::ffi::CStr::from_ptr(info.name.as_ptr()) };
+                samples.push(crate::metrics::ProgramSample {
+                    device: object.device.clone(),
+                    object: object.object.clone(),
+                    program: name.to_string_lossy().into_owned(),
+                    run_count: info.run_cnt,
+                    run_time_ns: info.run_time_ns,
+                });
+            }
+            unsafe { libc::close(fd) };
+        }
+    }
+
+    samples
+}
+
+/// The name and offset of the `u64` fields of the values of the map
+/// described by `info`, from its BTF
+fn counter_fields(info: &libbpf_sys::bpf_map_info) -> Vec<(String, usize)> {
+    let mut fields = Vec::new();
+
+    if info.btf_id == 0 || info.btf_value_type_id == 0 {
+        return fields;
+    }
+
+    unsafe {
+        let btf = libbpf_sys::btf__load_from_kernel_by_id(info.btf_id);
+        if libbpf_sys::libbpf_get_error(btf as *const libc::c_void) != 0 {
+            return fields;
+        }
+
+        let ty = libbpf_sys::btf__type_by_id(btf, info.btf_value_type_id);
+        if !ty.is_null() && ((*ty).info >> 24) & 0x1f == libbpf_sys::BTF_KIND_STRUCT {
+            let vlen = ((*ty).info & 0xffff) as usize;
+            let kind_flag = (*ty).info >> 31 == 1;
+            /* the members follow the type */
+            let members = ty.add(1) as *const libbpf_sys::btf_member;
+
+            for idx in 0..vlen {
+                let member = &*members.add(idx);
+                let bit_offset = if kind_flag {
+                    member.offset & 0xffffff
+                } else {
+                    member.offset
+                };
+                let name = libbpf_sys::btf__name_by_offset(btf, member.name_off);
+
+                if bit_offset % 8 == 0
+                    && libbpf_sys::btf__resolve_size(btf, member.type_) == 8
+                    && !name.is_null()
+                {
+                    fields.push((
+                        std::ffi::CStr::from_ptr(name)
+                            .to_string_lossy()
+                            .into_owned(),
+                        bit_offset as usize / 8,
+                    ));
+                }
+            }
+        }
+
+        libbpf_sys::btf__free(btf);
+    }
+
+    fields
+}
+
+/// Each `u64` field of the values of the map `fd`, summed over its entries
+fn map_counters(fd: i32) -> Vec<(String, u64)> {
+    let mut info = libbpf_sys::bpf_map_info::default();
+    let mut len = std::mem::size_of::<libbpf_sys::bpf_map_info>() as u32;
+
+    /* per-CPU values are not the value_size seen from userspace */
+    if unsafe { libbpf_sys::bpf_map_get_info_by_fd(fd, &mut info, &mut len) } != 0
+        || !matches!(
+            info.type_,
+            libbpf_sys::BPF_MAP_TYPE_HASH
+                | libbpf_sys::BPF_MAP_TYPE_ARRAY
+                | libbpf_sys::BPF_MAP_TYPE_LRU_HASH
+        )
+    {
+        return Vec::new();
+    }
+
+    let fields = counter_fields(&info);
+    let mut sums = vec![0u64; fields.len()];
+    let mut key = vec![0u8; info.key_size as usize];
+    let mut next_key = vec![0u8; info.key_size as usize];
+    let mut value = vec![0u8; info.value_size as usize];
+    let mut prev: *const libc::c_void = std::ptr::null();
+
+    unsafe {
+        while !fields.is_empty()
+            && libbpf_sys::bpf_map_get_next_key(
+                fd,
+                prev,
+                next_key.as_mut_ptr() as *mut libc::c_void,
+            ) == 0
+        {
+            if libbpf_sys::bpf_map_lookup_elem(
+                fd,
+                next_key.as_ptr() as *const libc::c_void,
+                value.as_mut_ptr() as *mut libc::c_void,
+            ) == 0
+            {
+                for ((_, offset), sum) in fields.iter().zip(sums.iter_mut()) {
+                    if let Some(bytes) = value.get(*offset..*offset + 8) {
+                        *sum += u64::from_ne_bytes(bytes.try_into().unwrap());
+                    }
+                }
+            }
+            key.copy_from_slice(&next_key);
+            prev = key.as_ptr() as *const libc::c_void;
+        }
+    }
+
+    fields.into_iter().map(|(name, _)| name).zip(sums).collect()
+}
+
+/// The fields of the `*_counters` maps pinned for every device, e.g. the
+/// delivered and suppressed reports of `generic-report-dedup.bpf.o`
+pub fn counter_samples() -> Vec<crate::metrics::CounterSample> {
+    let mut samples = Vec::new();
+
+    for object in attached_objects() {
+        for pin in fs::read_dir(&object.path).into_iter().flatten().flatten() {
+            let map = pin.file_name().to_string_lossy().into_owned();
+            if !map.ends_with("_counters") {
+                continue;
+            }
+
+            let c_path = std::ffi::CString::new(pin.path().to_string_lossy().as_bytes()).unwrap();
+            let fd = unsafe { libbpf_sys::bpf_obj_get(c_path.as_ptr()) };
+            if fd < 0 {
+                continue;
+            }
+
+            for (field, value) in map_counters(fd) {
+                samples.push(crate::metrics::CounterSample {
+                    device: object.device.clone(),
+                    object: object.object.clone(),
+                    map: map.clone(),
+                    field,
+                    value,
+                });
+            }
+            unsafe { libc::close(fd) };
+        }
+    }
+
+    samples
+}
+
+/// Detaches and unpins everything below `dir`, returns the number of pins
+/// and the estimated memory they were holding
+fn remove_pinned_tree(dir: &std::path::Path) -> (usize, u64) {
+    fn walk(dir: &std::path::Path, pins: &mut usize, bytes: &mut u64, progs: &mut Vec<u32>) {
+        for entry in fs::read_dir(dir).into_iter().flatten().flatten() {
+            let path = entry.path();
+            if path.is_dir() {
+                walk(&path, pins, bytes, progs);
+            } else {
+                *pins += 1;
+                *bytes += pinned_object_size(&path, progs);
+            }
+        }
+    }
+
+    let (mut pins, mut bytes, mut progs) = (0, 0, Vec::new());
+    walk(dir, &mut pins, &mut bytes, &mut progs);
+
+    log::debug!(target: "libbpf", "removing stale {}", dir.display());
+    detach_pinned_links(dir);
+    fs::remove_dir_all(dir).ok();
+
+    (pins, bytes)
+}
+
+/// Removes in one pass the pins of the devices that are gone and the
+/// leftovers of interrupted reloads: a missed `remove` uevent or a crash
+/// would otherwise keep them in the kernel until reboot.
+pub fn collect_garbage() -> std::io::Result<GarbageReport> {
+    let mut report = GarbageReport::default();
+
+    /* list the pins first, a device added in between would look stale */
+    let devices: Vec<fs::DirEntry> = match fs::read_dir(get_bpffs_path("", "")) {
+        Ok(devices) => devices.flatten().collect(),
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(report),
+        Err(e) => return Err(e),
+    };
+
+    let live: std::collections::HashSet<String> = fs::read_dir("/sys/bus/hid/devices")?
+        .flatten()
+        .map(|entry| bpffs_name(&entry.file_name().to_string_lossy()))
+        .collect();
+
+    let mut stale = Vec::new();
+    for device in devices {
+        if !live.contains(device.file_name().to_string_lossy().as_ref()) {
+            report.devices += 1;
+            stale.push(device.path());
+            continue;
+        }
+
+        for object in fs::read_dir(device.path()).into_iter().flatten().flatten() {
+            /* a reload may be in progress */
+            let recent = object
+                .metadata()
+                .and_then(|metadata| metadata.modified())
+                .map_or(true, |modified| {
+                    modified.elapsed().unwrap_or_default() < STAGING_GRACE_PERIOD
+                });
+
+            if object.file_name().to_string_lossy().ends_with(".staging") && !recent {
+                report.staging += 1;
+                stale.push(object.path());
+            }
+        }
+    }
+
+    let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+    let chunk_size = ((stale.len() + threads - 1) / threads).max(1);
+
+    let removed: Vec<(usize, u64)> = std::thread::scope(|scope| {
+        let workers: Vec<_> = stale
+            .chunks(chunk_size)
+            .map(|chunk| {
+                scope.spawn(move || {
+                    chunk
+                        .iter()
+                        .map(|dir| remove_pinned_tree(dir))
+                        .collect::<Vec<(usize, u64)>>()
+                })
+            })
+            .collect();
+
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().unwrap_or_default())
+            .collect()
+    });
+
+    for (pins, bytes) in removed {
+        report.pins += pins;
+        report.bytes += bytes;
+    }
+
+    Ok(report)
+}
+
+fn record_pinned_state(object_path: &str, object_name: &str, hash: u64, hid_id: u32, links: u32) {
+    let state = PinnedState {
+        hash,
+        hid: hid_id,
+        attached: links,
+    };
+
+    if let Err(e) = write_pinned_state(object_path, state) {
+        log::warn!(
+            "could not record the state of {} for device id {}, error {}",
+            object_name,
+            hid_id,
+            e.to_string(),
+        );
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_capabilities() {
+        let mut notes = Vec::new();
+        for (name, note_type, desc) in [
+            (&b"Xen\0"[..], 3u32, &[0x01u8, 0x02][..]),
+            (&b"GNU\0"[..], 1, &[0xff][..]),
+            (&b"GNU\0"[..], 3, &[0xde, 0xad, 0xbe, 0xef, 0x01][..]),
+        ] {
+            notes.extend((name.len() as u32).to_ne_bytes());
+            notes.extend((desc.len() as u32).to_ne_bytes());
+            notes.extend(note_type.to_ne_bytes());
+            notes.extend(name);
+            notes.extend(desc);
+            notes.resize((notes.len() + 3) & !3, 0);
+        }
+        assert!(parse_build_id(&notes).as_deref() == Some("deadbeef01"));
+        assert!(parse_build_id(&notes[..notes.len() - 8]).is_none());
+        assert!(parse_build_id(&[]).is_none());
+
+        for backend in [Some(Backend::FmodRet), Some(Backend::StructOps), None] {
+            let cache = encode_capabilities("deadbeef01", backend, 4);
+            assert!(decode_capabilities(&cache, "deadbeef01") == Some((backend, 4)));
+            assert!(decode_capabilities(&cache, "deadbeef02").is_none());
+        }
+        assert!(decode_capabilities("deadbeef01 bpf_iter v3\n", "deadbeef01").is_none());
+        /* written before the ISA level was cached */
+        assert!(decode_capabilities("deadbeef01 struct_ops\n", "deadbeef01").is_none());
+        assert!(decode_capabilities("", "deadbeef01").is_none());
+
+        let path = PathBuf::from("/lib/firmware/hid/bpf/10-mouse.bpf.o");
+        assert!(
+            isa_variant_path(&path, 4) == PathBuf::from("/lib/firmware/hid/bpf/v4/10-mouse.bpf.o")
+        );
+    }
+
+    #[test]
+    fn test_struct_ops_objects() {
+        let path = PathBuf::from("/lib/firmware/hid/bpf/10-mouse.bpf.o");
+        let paths: Vec<String> = variant_paths(&path, Some(Backend::StructOps), 4)
+            .iter()
+            .map(|path| path.to_string_lossy().into_owned())
+            .collect();
+        assert!(
+            paths
+                == [
+                    "/lib/firmware/hid/bpf/struct_ops/v4/10-mouse.bpf.o",
+                    "/lib/firmware/hid/bpf/struct_ops/v3/10-mouse.bpf.o",
+                    "/lib/firmware/hid/bpf/struct_ops/10-mouse.bpf.o",
+                    "/lib/firmware/hid/bpf/v4/10-mouse.bpf.o",
+                    "/lib/firmware/hid/bpf/v3/10-mouse.bpf.o",
+                    "/lib/firmware/hid/bpf/10-mouse.bpf.o",
+                ]
+        );
+        assert!(variant_paths(&path, Some(Backend::FmodRet), 3)[0] == isa_variant_path(&path, 3));
+        assert!(variant_paths(&path, None, 0) == [path]);
+
+        /* the objects built by build.rs */
+        let target_dir = PathBuf::from(env!("HID_BPF_TARGET_DIR"));
+        let struct_ops_names = |path: PathBuf| -> Vec<String> {
+            StructOpsObject::open(&path)
+                .unwrap()
+                .struct_ops_maps()
+                .into_iter()
+                .map(StructOpsObject::map_name)
+                .collect()
+        };
+
+        let object = PathBuf::from("xppen-Artist24.bpf.o");
+        assert!(struct_ops_names(target_dir.join(&object)).is_empty());
+        assert!(
+            struct_ops_names(target_dir.join(STRUCT_OPS_DIR).join(&object)) == ["xppen_artist_24"]
+        );
+
+        /* only the struct_ops build defers the releases, see hid_bpf_defer_report() */
+        let has_map = |path: PathBuf, name: &str| -> bool {
+            StructOpsObject::open(&path)
+                .unwrap()
+                .maps()
+                .into_iter()
+                .any(|map| StructOpsObject::map_name(map) == name)
+        };
+        assert!(!has_map(target_dir.join(&object), "deferred_releases"));
+        assert!(has_map(
+            target_dir.join(STRUCT_OPS_DIR).join(&object),
+            "deferred_releases"
+        ));
+
+        for entry in fs::read_dir(target_dir.join(STRUCT_OPS_DIR)).unwrap() {
+            let path = entry.unwrap().path();
+            if path.is_file() {
+                assert!(!struct_ops_names(path).is_empty());
+            }
+        }
+
+        /* the in-tree objects work with both backends */
+        for entry in fs::read_dir(&target_dir).unwrap() {
+            let path = entry.unwrap().path();
+            if path.to_string_lossy().ends_with(".bpf.o") {
+                let struct_ops = target_dir
+                    .join(STRUCT_OPS_DIR)
+                    .join(path.file_name().unwrap());
+                assert!(struct_ops.is_file(), "{}", struct_ops.display());
+            }
+        }
+    }
+
+    #[test]
+    fn test_object_signatures() {
+        let target_dir = PathBuf::from(env!("HID_BPF_TARGET_DIR"));
+        let object = PathBuf::from("xppen-ArtistPro16Gen2.bpf.o");
+        let eraser = vec![0x09, 0x42, 0x09, 0x44, 0x09, 0x45, 0x09, 0x3c];
+
+        for path in [
+            target_dir.join(&object),
+            target_dir.join(STRUCT_OPS_DIR).join(&object),
+        ] {
+            assert!(object_signatures(&path) == [(0, eraser.clone())]);
+            assert!(scanned_signatures(&[path]) == [eraser.clone()]);
+        }
+
+        /* the signature entries are not devices */
+        let btf = libbpf_rs::btf::Btf::from_path(target_dir.join(&object)).unwrap();
+        let metadata = crate::modalias::Metadata::from_btf(&btf).unwrap();
+        assert!(metadata.modaliases().count() == 2);
+    }
+
+    #[test]
+    fn test_linked_objects() {
+        /* a real pair, linked the way build.rs links the objects of a device */
+        let parts_dir = PathBuf::from(env!("HID_BPF_PARTS_DIR"));
+        let parts = [
+            "G10-Mechanical-Gaming-Mouse.bpf.o",
+            "trace_hid_events.bpf.o",
+        ];
+        let linked = std::env::temp_dir().join(format!("linked-{}.bpf.o", std::process::id()));
+
+        for dir in [parts_dir.clone(), parts_dir.join(STRUCT_OPS_DIR)] {
+            let mut linker = libbpf_rs::Linker::new(&linked).unwrap();
+            for part in parts {
+                linker.add_file(dir.join(part)).unwrap();
+            }
+            linker.add_file(dir.join("hid_bpf_lib.bpf.o")).unwrap();
+            linker.link().unwrap();
+
+            /* each part keeps its own HID_BPF_CONFIG */
+            let btf = libbpf_rs::btf::Btf::from_path(&linked).unwrap();
+            let metadata = crate::modalias::Metadata::from_btf(&btf).unwrap();
+            let modaliases: Vec<String> = metadata.modaliases().map(String::from).collect();
+            assert!(modaliases == ["b0003g0001v000004D9p0000A09F"]);
+
+            let mut obj_builder = libbpf_rs::ObjectBuilder::default();
+            let open_object = obj_builder.open_file(&linked).unwrap();
+            let mut progs: Vec<String> = open_object
+                .progs_iter()
+                .map(|prog| String::from(prog.name()))
+                .collect();
+            progs.sort();
+            assert!(progs == ["hid_y_event", "probe", "trace_hid_events"]);
+
+            let mut struct_ops: Vec<String> = StructOpsObject::open(&linked)
+                .unwrap()
+                .struct_ops_maps()
+                .into_iter()
+                .map(StructOpsObject::map_name)
+                .collect();
+            struct_ops.sort();
+            if dir == parts_dir {
+                assert!(struct_ops.is_empty());
+            } else {
+                assert!(struct_ops == ["g10_mechanical_gaming_mouse", "trace_hid_events_ops"]);
+            }
+        }
+
+        fs::remove_file(&linked).unwrap();
+    }
+
+    #[test]
+    fn test_probe_cache() {
+        assert!(probe_result_is_definitive(-libc::EINVAL));
+        assert!(probe_result_is_definitive(-libc::ENODEV));
+        for retval in [-libc::ENOMEM, -libc::EAGAIN, -libc::EBUSY, -libc::EPERM, 1] {
+            assert!(!probe_result_is_definitive(retval));
+        }
+
+        /* a transient failure doesn't even touch the cache */
+        let (object_hash, rdesc_hash) =
+            (content_hash(b"test_probe_cache"), std::process::id() as u64);
+        probe_cache_store(object_hash, rdesc_hash, -libc::EAGAIN);
+        assert!(!probe_cache_path(object_hash, rdesc_hash).exists());
+        assert!(probe_cache_lookup(object_hash, rdesc_hash).is_none());
+    }
+
+    #[test]
+    fn test_content_hash() {
+        assert!(content_hash(b"") == 0xcbf29ce484222325);
+        assert!(content_hash(b"a") == 0xaf63dc4c8601ec8c);
+        assert!(content_hash(b"foobar") == 0x85944171f73967e8);
+        assert!(content_hash(b"foobar") != content_hash(b"foobaz"));
+    }
 }
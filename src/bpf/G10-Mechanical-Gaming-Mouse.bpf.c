@@ -2,7 +2,6 @@
 /* Copyright (c) 2022 Benjamin Tissoires
  */
 
-#include "vmlinux.h"
 #include "hid_bpf.h"
 #include "hid_bpf_helpers.h"
 #include <bpf/bpf_tracing.h>
@@ -14,7 +13,14 @@ HID_BPF_CONFIG(
 	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, VID_HOLTEK, PID_G10_MECHANICAL_GAMING_MOUSE)
 );
 
-SEC("fmod_ret/hid_bpf_device_event")
+/*
+ * Set at load time, e.g. with `udev-hid-bpf add --set enable=true`,
+ * see doc/device-matches.rst
+ */
+const volatile bool enable = false;
+const volatile __u32 mouse_rdesc_size = 71;
+
+SEC(HID_BPF_DEVICE_EVENT)
 int BPF_PROG(hid_y_event, struct hid_bpf_ctx *hctx)
 {
 	s16 y;
@@ -33,6 +39,10 @@ int BPF_PROG(hid_y_event, struct hid_bpf_ctx *hctx)
 	return 0;
 }
 
+HID_BPF_OPS(g10_mechanical_gaming_mouse) = {
+	.hid_device_event = (void *)hid_y_event,
+};
+
 SEC("syscall")
 int probe(struct hid_bpf_probe_args *ctx)
 {
@@ -41,14 +51,13 @@ int probe(struct hid_bpf_probe_args *ctx)
 	 * The mouse interface has a report descriptor of length 71.
 	 * So if report descriptor size is not 71, mark as -EINVAL
 	 */
-	ctx->retval = ctx->rdesc_size != 71;
+	ctx->retval = ctx->rdesc_size != mouse_rdesc_size;
 	if (ctx->retval)
 		ctx->retval = -EINVAL;
 
-	/* comment the following line to actually bind the program */
-	ctx->retval = -EINVAL;
+	/* not bound unless explicitly enabled */
+	if (!enable)
+		ctx->retval = -EINVAL;
 
 	return 0;
 }
-
-char _license[] SEC("license") = "GPL";
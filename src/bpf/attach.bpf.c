@@ -12,9 +12,20 @@ extern int hid_bpf_attach_prog(unsigned int hid_id, int prog_fd, u32 flags) __ks
 SEC("syscall")
 int attach_prog(struct attach_prog_args *ctx)
 {
-	ctx->retval = hid_bpf_attach_prog(ctx->hid,
-					  ctx->prog_fd,
-					  0);
+	/*
+	 * The verifier doesn't allow variable offsets in the context,
+	 * so the loop must be unrolled to only have constant accesses.
+	 */
+#pragma unroll
+	for (int i = 0; i < HID_BPF_MAX_PROGS_PER_DEV; i++) {
+		if (i >= ctx->count)
+			break;
+
+		ctx->retvals[i] = hid_bpf_attach_prog(ctx->hid,
+						      ctx->prog_fds[i],
+						      0);
+	}
+
 	return 0;
 }
 
@@ -5,13 +5,19 @@
 #ifndef __ATTACH_H
 #define __ATTACH_H
 
+#define HID_BPF_MAX_PROGS_PER_DEV 64
+
 /**
  * <div rustbindgen replaces="AttachProgArgs"></div>
+ *
+ * prog_fds[0..count] are attached to the device hid in one syscall,
+ * retvals[i] is the link fd (or negative error) for prog_fds[i].
  */
 struct attach_prog_args {
-	int prog_fd;
+	int prog_fds[HID_BPF_MAX_PROGS_PER_DEV];
 	unsigned int hid;
-	int retval;
+	unsigned int count;
+	int retvals[HID_BPF_MAX_PROGS_PER_DEV];
 };
 
 #endif /* __ATTACH_H */
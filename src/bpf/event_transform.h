@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#ifndef __EVENT_TRANSFORM_H
+#define __EVENT_TRANSFORM_H
+
+#define EVENT_TRANSFORM_MAX_RULES	16
+
+/* operations, a rule with op NONE ends the list */
+#define EVENT_TRANSFORM_NONE		0
+#define EVENT_TRANSFORM_NEGATE		1	/* field = -field */
+#define EVENT_TRANSFORM_SCALE		2	/* field = field * arg0 / arg1 */
+#define EVENT_TRANSFORM_CLAMP		3	/* field = clamp(field, arg0, arg1) */
+#define EVENT_TRANSFORM_XOR		4	/* field ^= arg0 if (field & arg1) == arg2 */
+#define EVENT_TRANSFORM_SWAP		5	/* swap field with the one at offset arg0 */
+#define EVENT_TRANSFORM_DROP_IF		6	/* drop the report if (field & arg1) == arg2 */
+
+#define EVENT_TRANSFORM_ANY_REPORT	-1
+
+/*
+ * One rule of the list used by generic-event-transform.bpf.c. A field is
+ * `size` bytes (1, 2 or 4) in little endian at `offset` bytes from the
+ * start of the report, including the report ID if any.
+ */
+struct event_transform_rule {
+	unsigned char op;
+	unsigned char size;
+	unsigned char is_signed;
+	unsigned char padding;
+	short report_id;
+	unsigned short offset;
+	int arg0;
+	int arg1;
+	int arg2;
+};
+
+#endif /* __EVENT_TRANSFORM_H */
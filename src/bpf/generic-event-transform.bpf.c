@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include "event_transform.h"
+#include "report_field.h"
+#include <bpf/bpf_tracing.h>
+
+/*
+ * Generic event transform: there is no HID_BPF_CONFIG here, this object is
+ * loaded by udev-hid-bpf for each matching .event-transform data file, and
+ * the rules of that file are written in the event_transform_rules map
+ * before the program is attached.
+ *
+ * Rules are applied in order on every report, a drop-if rule that matches
+ * stops the processing.
+ */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, EVENT_TRANSFORM_MAX_RULES);
+	__type(key, __u32);
+	__type(value, struct event_transform_rule);
+} event_transform_rules SEC(".maps");
+
+/* signed division is only available from BPF ISA v4, num and den are positive */
+static __always_inline __s64 scale(__s64 value, __s32 num, __s32 den)
+{
+	bool negative = value < 0;
+	__u64 abs = negative ? -value : value;
+
+	abs = abs * (__u64)num / (__u64)den;
+
+	return negative ? -(__s64)abs : (__s64)abs;
+}
+
+SEC(HID_BPF_DEVICE_EVENT)
+int BPF_PROG(hid_event_transform, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, 1 /* size */);
+	struct event_transform_rule *rule;
+	__s64 value, other;
+	__u8 report_id;
+	__u32 idx;
+
+	if (!data)
+		return 0; /* EPERM check */
+
+	report_id = data[0];
+
+	for (idx = 0; idx < EVENT_TRANSFORM_MAX_RULES; idx++) {
+		rule = bpf_map_lookup_elem(&event_transform_rules, &idx);
+		if (!rule || rule->op == EVENT_TRANSFORM_NONE)
+			break;
+
+		if (rule->report_id != EVENT_TRANSFORM_ANY_REPORT &&
+		    rule->report_id != report_id)
+			continue;
+
+		if (rule->offset + rule->size > hctx->size ||
+		    read_field(hctx, rule->offset, rule->size, rule->is_signed, &value))
+			continue;
+
+		switch (rule->op) {
+		case EVENT_TRANSFORM_NEGATE:
+			value = -value;
+			break;
+		case EVENT_TRANSFORM_SCALE:
+			value = scale(value, rule->arg0, rule->arg1);
+			break;
+		case EVENT_TRANSFORM_CLAMP:
+			if (value < rule->arg0)
+				value = rule->arg0;
+			else if (value > rule->arg1)
+				value = rule->arg1;
+			break;
+		case EVENT_TRANSFORM_XOR:
+			if ((value & rule->arg1) != rule->arg2)
+				continue;
+			value ^= rule->arg0;
+			break;
+		case EVENT_TRANSFORM_SWAP:
+			if (rule->arg0 + rule->size > hctx->size ||
+			    read_field(hctx, rule->arg0, rule->size, rule->is_signed, &other))
+				continue;
+			write_field(hctx, rule->arg0, rule->size, value);
+			value = other;
+			break;
+		case EVENT_TRANSFORM_DROP_IF:
+			if ((value & rule->arg1) == rule->arg2)
+				return HID_IGNORE_EVENT;
+			continue;
+		default:
+			continue;
+		}
+
+		write_field(hctx, rule->offset, rule->size, value);
+	}
+
+	return 0;
+}
+
+HID_BPF_OPS(generic_event_transform) = {
+	.hid_device_event = (void *)hid_event_transform,
+};
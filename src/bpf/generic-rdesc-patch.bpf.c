@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include "rdesc_patch.h"
+#include <bpf/bpf_tracing.h>
+
+/*
+ * Generic report descriptor fixup: there is no HID_BPF_CONFIG here, this
+ * object is loaded by udev-hid-bpf for each matching .rdesc-patch data
+ * file, and the content of that file is written in the rdesc_patches map
+ * before the program is attached.
+ *
+ * The loader already checked that every expected sequence is present
+ * before attaching, but we check them again here to not corrupt a
+ * report descriptor that changed in between.
+ */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, RDESC_PATCH_MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, struct rdesc_patch);
+} rdesc_patches SEC(".maps");
+
+#define RDESC_MAX_OFFSET (4096 - RDESC_PATCH_MAX_SIZE)
+
+SEC(HID_BPF_RDESC_FIXUP)
+int BPF_PROG(hid_fix_rdesc_from_table, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, 4096 /* size */);
+	struct rdesc_patch *patch;
+	__u32 idx, offset, size, i;
+
+	if (!data)
+		return 0; /* EPERM check */
+
+	for (idx = 0; idx < RDESC_PATCH_MAX_ENTRIES; idx++) {
+		patch = bpf_map_lookup_elem(&rdesc_patches, &idx);
+		if (!patch || !patch->size)
+			break;
+
+		offset = patch->offset;
+		size = patch->size;
+		if (offset > RDESC_MAX_OFFSET || size > RDESC_PATCH_MAX_SIZE)
+			continue;
+
+		for (i = 0; i < RDESC_PATCH_MAX_SIZE && i < size; i++) {
+			if (data[offset + i] != patch->expected[i])
+				break;
+		}
+
+		if (i != size)
+			continue;
+
+		for (i = 0; i < RDESC_PATCH_MAX_SIZE && i < size; i++)
+			data[offset + i] = patch->replacement[i];
+	}
+
+	return 0;
+}
+
+HID_BPF_OPS(generic_rdesc_patch) = {
+	.hid_rdesc_fixup = (void *)hid_fix_rdesc_from_table,
+};
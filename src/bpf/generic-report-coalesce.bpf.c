@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include "report_field.h"
+#include <bpf/bpf_tracing.h>
+
+/*
+ * Generic report coalescing for high polling rate devices: there is no
+ * HID_BPF_CONFIG here, the object is configured for a device through its
+ * const volatile globals below, see doc/device-matches.rst.
+ *
+ * A report arriving less than min_interval_ns after the last delivered
+ * one is dropped, and its relative axes are accumulated in the state of
+ * the device, to be added to the next delivered report. A change of the
+ * buttons is always delivered right away.
+ */
+
+#define COALESCE_MAX_AXES	4
+
+/* at most 1000 reports per second */
+const volatile __u64 min_interval_ns = 1000000;
+
+/* -1 to coalesce every report, offsets include the report ID if any */
+const volatile __s16 coalesced_report_id = -1;
+
+/* a buttons_size of 0 means the report has no buttons */
+const volatile __u16 buttons_offset = 0;
+const volatile __u8 buttons_size = 0;
+
+/* signed relative axes, an axis_size of 0 means the entry is unused */
+const volatile __u16 axis_offsets[COALESCE_MAX_AXES] = {};
+const volatile __u8 axis_sizes[COALESCE_MAX_AXES] = {};
+
+struct coalesce_state {
+	__u64 last_delivery_ns;
+	__s64 buttons;
+	__s64 pending[COALESCE_MAX_AXES];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 16);
+	__type(key, __u32);
+	__type(value, struct coalesce_state);
+} coalesce_states SEC(".maps");
+
+static __always_inline struct coalesce_state *get_state(__u32 hid)
+{
+	struct coalesce_state *state = bpf_map_lookup_elem(&coalesce_states, &hid);
+	struct coalesce_state init = {};
+
+	if (state)
+		return state;
+
+	bpf_map_update_elem(&coalesce_states, &hid, &init, BPF_NOEXIST);
+
+	return bpf_map_lookup_elem(&coalesce_states, &hid);
+}
+
+SEC(HID_BPF_DEVICE_EVENT)
+int BPF_PROG(hid_coalesce_reports, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, 1 /* size */);
+	struct coalesce_state *state;
+	__s64 buttons = 0, value, max;
+	bool drop;
+	__u64 now;
+	int i;
+
+	if (!data)
+		return 0; /* EPERM check */
+
+	if (coalesced_report_id >= 0 && data[0] != coalesced_report_id)
+		return 0;
+
+	state = get_state(hctx->hid->id);
+	if (!state)
+		return 0;
+
+	if (buttons_size &&
+	    (buttons_offset + buttons_size > hctx->size ||
+	     read_field(hctx, buttons_offset, buttons_size, false, &buttons)))
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	drop = buttons == state->buttons && now - state->last_delivery_ns < min_interval_ns;
+
+#pragma unroll
+	for (i = 0; i < COALESCE_MAX_AXES; i++) {
+		if (!axis_sizes[i] ||
+		    axis_offsets[i] + axis_sizes[i] > hctx->size ||
+		    read_field(hctx, axis_offsets[i], axis_sizes[i], true, &value))
+			continue;
+
+		if (drop) {
+			state->pending[i] += value;
+			continue;
+		}
+
+		/* anything that doesn't fit in the field waits for the next report */
+		value += state->pending[i];
+		max = (1LL << (axis_sizes[i] * 8 - 1)) - 1;
+		state->pending[i] = value > max ? value - max :
+				    value < -max - 1 ? value + max + 1 : 0;
+		value -= state->pending[i];
+
+		write_field(hctx, axis_offsets[i], axis_sizes[i], value);
+	}
+
+	if (drop)
+		return HID_IGNORE_EVENT;
+
+	state->buttons = buttons;
+	state->last_delivery_ns = now;
+
+	return 0;
+}
+
+HID_BPF_OPS(generic_report_coalesce) = {
+	.hid_device_event = (void *)hid_coalesce_reports,
+};
+
+SEC("syscall")
+int probe(struct hid_bpf_probe_args *ctx)
+{
+	/* only bind when configured */
+	ctx->retval = axis_sizes[0] ? 0 : -EINVAL;
+
+	return 0;
+}
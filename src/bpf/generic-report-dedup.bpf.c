@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+/*
+ * Generic duplicate report suppression: there is no HID_BPF_CONFIG here,
+ * the object is loaded on the devices that keep resending the same report
+ * at the polling rate, see doc/device-matches.rst.
+ *
+ * A report identical to the previous one is ignored. This must not be used
+ * on devices with relative axes, where two identical reports are two
+ * separate motions.
+ *
+ * The number of delivered and suppressed reports of each device is kept in
+ * the dedup_counters map, pinned under /sys/fs/bpf/hid/<device>/.
+ */
+
+#define DEDUP_MAX_REPORT_SIZE	64
+
+/*
+ * Set to true when the reports of the device start with a report ID, so the
+ * reports are compared to the previous one with the same ID.
+ */
+const volatile bool numbered_reports = false;
+
+struct dedup_key {
+	__u32 hid;
+	__u32 report_id;
+};
+
+struct dedup_last_report {
+	__u32 size;
+	__u8 data[DEDUP_MAX_REPORT_SIZE];
+};
+
+struct dedup_counters {
+	__u64 delivered;
+	__u64 suppressed;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 256);
+	__type(key, struct dedup_key);
+	__type(value, struct dedup_last_report);
+} dedup_last_reports SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 16);
+	__type(key, __u32);
+	__type(value, struct dedup_counters);
+} dedup_counters SEC(".maps");
+
+static __always_inline void *lookup_or_init(void *map, void *key, void *init)
+{
+	void *value = bpf_map_lookup_elem(map, key);
+
+	if (value)
+		return value;
+
+	bpf_map_update_elem(map, key, init, BPF_NOEXIST);
+
+	return bpf_map_lookup_elem(map, key);
+}
+
+/*
+ * Compares the report with the last one, and stores it. `buf_size` is the
+ * constant size given to hid_bpf_get_data(), at least `size`.
+ */
+static __always_inline int dedup(__u8 *data, const __u32 buf_size, __u32 size,
+				 struct dedup_last_report *last,
+				 struct dedup_counters *counters)
+{
+	bool duplicate = last->size == size;
+	__u32 i;
+
+	for (i = 0; i < buf_size && i < size; i++) {
+		if (last->data[i] != data[i]) {
+			duplicate = false;
+			last->data[i] = data[i];
+		}
+	}
+
+	last->size = size;
+
+	if (duplicate) {
+		__sync_fetch_and_add(&counters->suppressed, 1);
+		return HID_IGNORE_EVENT;
+	}
+
+	__sync_fetch_and_add(&counters->delivered, 1);
+	return 0;
+}
+
+/*
+ * hid_bpf_get_data() fails past the buffer allocated for the device, so
+ * request the smallest constant size that covers the report.
+ */
+#define DEDUP_WITH_BUFFER_SIZE(_sz)						\
+	if (size <= (_sz)) {							\
+		data = hid_bpf_get_data(hctx, 0 /* offset */, (_sz));		\
+		if (!data)							\
+			return 0; /* EPERM check */				\
+		return dedup(data, (_sz), size, last, counters);		\
+	}
+
+SEC(HID_BPF_DEVICE_EVENT)
+int BPF_PROG(hid_dedup_reports, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, 1 /* size */);
+	struct dedup_counters *counters, counters_init = {};
+	struct dedup_last_report *last, last_init = {};
+	struct dedup_key key = {
+		.hid = hctx->hid->id,
+	};
+	__u32 size = hctx->size;
+
+	if (!data)
+		return 0; /* EPERM check */
+
+	if (numbered_reports)
+		key.report_id = data[0];
+
+	counters = lookup_or_init(&dedup_counters, &key.hid, &counters_init);
+	last = lookup_or_init(&dedup_last_reports, &key, &last_init);
+	if (!counters || !last)
+		return 0;
+
+	DEDUP_WITH_BUFFER_SIZE(8);
+	DEDUP_WITH_BUFFER_SIZE(16);
+	DEDUP_WITH_BUFFER_SIZE(32);
+	DEDUP_WITH_BUFFER_SIZE(DEDUP_MAX_REPORT_SIZE);
+
+	/* too big to be compared */
+	__sync_fetch_and_add(&counters->delivered, 1);
+
+	return 0;
+}
+
+HID_BPF_OPS(generic_report_dedup) = {
+	.hid_device_event = (void *)hid_dedup_reports,
+};
@@ -5,7 +5,19 @@
 #ifndef __HID_BPF_HELPERS_H
 #define __HID_BPF_HELPERS_H
 
+/*
+ * vmlinux.h comes from a kernel with the fmod_ret API, where struct
+ * hid_bpf_ops is internal to HID-BPF: it is renamed out of the way of the
+ * struct_ops one declared below, so vmlinux.h must only be included here.
+ */
+#ifdef __VMLINUX_H__
+#error "include hid_bpf_helpers.h instead of vmlinux.h"
+#endif
+
+#define hid_bpf_ops hid_bpf_ops___fmod_ret
 #include "vmlinux.h"
+#undef hid_bpf_ops
+
 #include <bpf/bpf_helpers.h>
 #include <linux/errno.h>
 
@@ -22,6 +34,220 @@ extern int hid_bpf_hw_request(struct hid_bpf_ctx *ctx,
 
 #define HID_IGNORE_EVENT	-1
 
+/* from include/linux/hid_bpf.h, v6.11 */
+struct hid_bpf_ops {
+	int hid_id;
+	u32 flags;
+	struct list_head list;
+	int (*hid_device_event)(struct hid_bpf_ctx *ctx, enum hid_report_type report_type,
+				__u64 source);
+	int (*hid_rdesc_fixup)(struct hid_bpf_ctx *ctx);
+	int (*hid_hw_request)(struct hid_bpf_ctx *ctx, unsigned char reportnum,
+			      enum hid_report_type rtype, enum hid_class_request reqtype,
+			      __u64 source);
+	int (*hid_hw_output_report)(struct hid_bpf_ctx *ctx, __u64 source);
+	struct hid_device *hdev;
+} __attribute__((preserve_access_index));
+
+/*
+ * An object is built twice: as is for the fmod_ret backend, and with
+ * HID_BPF_STRUCT_OPS defined for the struct_ops one, see build.rs. Objects
+ * using the macros below work with both:
+ *
+ *   SEC(HID_BPF_DEVICE_EVENT)
+ *   int BPF_PROG(foo_fix_event, struct hid_bpf_ctx *hctx)
+ *   { ... }
+ *
+ *   HID_BPF_OPS(foo) = {
+ *       .hid_device_event = (void *)foo_fix_event,
+ *   };
+ *
+ * fmod_ret programs are attached one by one, the fmod_ret build drops the
+ * struct.
+ */
+#ifdef HID_BPF_STRUCT_OPS
+#define HID_BPF_DEVICE_EVENT	"struct_ops/hid_device_event"
+#define HID_BPF_RDESC_FIXUP	"struct_ops/hid_rdesc_fixup"
+#define HID_BPF_OPS(_name)	SEC(".struct_ops.link") struct hid_bpf_ops _name
+#else
+#define HID_BPF_DEVICE_EVENT	"fmod_ret/hid_bpf_device_event"
+#define HID_BPF_RDESC_FIXUP	"fmod_ret/hid_bpf_rdesc_fixup"
+#define HID_BPF_OPS(_name)	static const struct hid_bpf_ops _name __attribute__((unused))
+#endif
+
+/* only available since v6.11, see hid_bpf_defer_report() */
+extern int hid_bpf_input_report(struct hid_bpf_ctx *ctx,
+				enum hid_report_type type,
+				__u8 *data,
+				const size_t buf__sz) __ksym __weak;
+
+/* from include/uapi/linux/bpf.h, v6.10 */
+struct bpf_wq {
+	__u64 __opaque[2];
+} __attribute__((aligned(8)));
+
+extern int bpf_wq_init(struct bpf_wq *wq, void *p__map, unsigned int flags) __ksym __weak;
+extern int bpf_wq_start(struct bpf_wq *wq, unsigned int flags) __ksym __weak;
+extern int bpf_wq_set_callback_impl(struct bpf_wq *wq,
+				    int (callback_fn)(void *map, int *key, void *value),
+				    unsigned int flags__k, void *aux__ign) __ksym __weak;
+
+#define bpf_wq_set_callback(wq, cb, flags)	\
+	bpf_wq_set_callback_impl(wq, cb, flags, NULL)
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC		1
+#endif
+
+/*
+ * Deferred report delivery
+ *
+ * hid_bpf_defer_report() keeps a copy of the current report and starts a
+ * timer: once the window elapses the report is injected again in the HID
+ * stack, unless hid_bpf_cancel_deferred_report() is called first, e.g.
+ * because a superseding report arrived in the meantime. Deferring a report
+ * while another one is pending replaces it.
+ *
+ * The caller returns HID_IGNORE_EVENT for the original report. The injected
+ * copy goes through the device_event programs again, where
+ * hid_bpf_is_reinjected_report() tells it apart.
+ *
+ * The window trades latency for accuracy, so it is best exposed as a
+ * const volatile global set at load time.
+ *
+ * The timer callback runs in softirq context, where injecting a report is
+ * not allowed: it only queues a bpf_wq, whose callback injects the report
+ * from a sleepable context.
+ *
+ * Only the struct_ops build of an object can use this: the verifier refuses
+ * bpf_timer in tracing (fmod_ret) programs, and hid_bpf_input_report()
+ * comes along with struct hid_bpf_ops in v6.11.
+ */
+#define HID_BPF_DEFERRED_REPORT_SIZE	64
+
+struct hid_bpf_deferred_report {
+	struct bpf_timer timer;
+	struct bpf_wq work;
+	__u32 hid;
+	__u32 size;
+	bool pending;
+	bool reinjecting;
+	__u8 data[HID_BPF_DEFERRED_REPORT_SIZE];
+};
+
+/* declares the map holding the deferred report of each device */
+#define HID_BPF_DEFERRED_REPORTS(_name)					\
+	struct {							\
+		__uint(type, BPF_MAP_TYPE_HASH);			\
+		__uint(max_entries, 16);				\
+		__type(key, __u32);					\
+		__type(value, struct hid_bpf_deferred_report);		\
+	} _name SEC(".maps")
+
+static int __hid_bpf_deferred_report_work(void *map, int *key, void *value)
+{
+	struct hid_bpf_deferred_report *deferred = value;
+	struct hid_bpf_ctx *ctx;
+	__u32 size = deferred->size;
+
+	if (!deferred->pending)
+		return 0;
+
+	deferred->pending = false;
+
+	if (size == 0 || size > HID_BPF_DEFERRED_REPORT_SIZE)
+		return 0;
+
+	ctx = hid_bpf_allocate_context(deferred->hid);
+	if (!ctx)
+		return 0;
+
+	deferred->reinjecting = true;
+	hid_bpf_input_report(ctx, HID_INPUT_REPORT, deferred->data, size);
+	deferred->reinjecting = false;
+
+	hid_bpf_release_context(ctx);
+
+	return 0;
+}
+
+static int __hid_bpf_deferred_report_cb(void *map, __u32 *key,
+					struct hid_bpf_deferred_report *deferred)
+{
+	if (deferred->pending)
+		bpf_wq_start(&deferred->work, 0);
+
+	return 0;
+}
+
+/*
+ * Holds the first `size` bytes of the report in `data` for `window_ns`.
+ * `size` must be a constant. Returns 0 or a negative error, in which case
+ * nothing is deferred.
+ */
+static __always_inline int hid_bpf_defer_report(void *map, struct hid_bpf_ctx *hctx,
+						__u8 *data, const size_t size,
+						__u64 window_ns)
+{
+	struct hid_bpf_deferred_report *deferred;
+	__u32 hid = hctx->hid->id;
+
+	if (!bpf_ksym_exists(hid_bpf_input_report) || !bpf_ksym_exists(bpf_wq_start))
+		return -EOPNOTSUPP;
+
+	if (size > HID_BPF_DEFERRED_REPORT_SIZE)
+		return -E2BIG;
+
+	deferred = bpf_map_lookup_elem(map, &hid);
+	if (!deferred) {
+		struct hid_bpf_deferred_report init = {
+			.hid = hid,
+		};
+
+		bpf_map_update_elem(map, &hid, &init, BPF_NOEXIST);
+		deferred = bpf_map_lookup_elem(map, &hid);
+		if (!deferred)
+			return -ENOMEM;
+
+		bpf_timer_init(&deferred->timer, map, CLOCK_MONOTONIC);
+		bpf_timer_set_callback(&deferred->timer, __hid_bpf_deferred_report_cb);
+		bpf_wq_init(&deferred->work, map, 0);
+		bpf_wq_set_callback(&deferred->work, __hid_bpf_deferred_report_work, 0);
+	}
+
+	__builtin_memcpy(deferred->data, data, size);
+	deferred->size = size;
+	deferred->pending = true;
+
+	return bpf_timer_start(&deferred->timer, window_ns, 0);
+}
+
+/* Returns true if a pending report got dropped */
+static __always_inline bool hid_bpf_cancel_deferred_report(void *map, struct hid_bpf_ctx *hctx)
+{
+	struct hid_bpf_deferred_report *deferred;
+	__u32 hid = hctx->hid->id;
+
+	deferred = bpf_map_lookup_elem(map, &hid);
+	if (!deferred || !deferred->pending)
+		return false;
+
+	deferred->pending = false;
+	bpf_timer_cancel(&deferred->timer);
+
+	return true;
+}
+
+static __always_inline bool hid_bpf_is_reinjected_report(void *map, struct hid_bpf_ctx *hctx)
+{
+	struct hid_bpf_deferred_report *deferred;
+	__u32 hid = hctx->hid->id;
+
+	deferred = bpf_map_lookup_elem(map, &hid);
+
+	return deferred && deferred->reinjecting;
+}
+
 /* extracted from <linux/input.h> */
 #define BUS_ANY			0x00
 #define BUS_PCI			0x01
@@ -101,12 +327,78 @@ extern int hid_bpf_hw_request(struct hid_bpf_ctx *ctx,
 		__uint(pid, (prod));	\
 	} COMBINE(_entry, __LINE__)
 
+/* HID_SIGNATURE(idx, bytes...) declares a sequence of up to 15 bytes searched
+ * anywhere in the report descriptor, in the same pass as the signatures of
+ * all the other objects considered for the device. Before probe() runs, the
+ * loader writes the offset of its first occurrence, or
+ * HID_SIGNATURE_NOT_FOUND, at index idx of the hid_bpf_signatures map that
+ * HID_BPF_SIGNATURES() declares:
+ *
+ * HID_BPF_CONFIG(
+ *	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, VID, PID),
+ *	HID_SIGNATURE(0, 0x09, 0x42, 0x09, 0x45)
+ * );
+ * HID_BPF_SIGNATURES(1);
+ *
+ * Each byte is the size of one more array, b0 for the first one, see
+ * HID_DEVICE() above.
+ */
+#define HID_SIGNATURE(idx, ...)				\
+	struct {					\
+		__uint(signature, (idx));		\
+		_EXPAND(_SIGBYTE, __VA_ARGS__)		\
+	} COMBINE(_entry, __LINE__)
+
+#define _SIGBYTE1(_1)	__uint(b0, (_1));
+#define _SIGBYTE2(_1, _2)	_SIGBYTE1(_1) __uint(b1, (_2));
+#define _SIGBYTE3(_1, _2, _3)	_SIGBYTE2(_1, _2) __uint(b2, (_3));
+#define _SIGBYTE4(_1, _2, _3, _4)	_SIGBYTE3(_1, _2, _3) __uint(b3, (_4));
+#define _SIGBYTE5(_1, _2, _3, _4, _5)	_SIGBYTE4(_1, _2, _3, _4) __uint(b4, (_5));
+#define _SIGBYTE6(_1, _2, _3, _4, _5, _6)	\
+	_SIGBYTE5(_1, _2, _3, _4, _5) __uint(b5, (_6));
+#define _SIGBYTE7(_1, _2, _3, _4, _5, _6, _7)	\
+	_SIGBYTE6(_1, _2, _3, _4, _5, _6) __uint(b6, (_7));
+#define _SIGBYTE8(_1, _2, _3, _4, _5, _6, _7, _8)	\
+	_SIGBYTE7(_1, _2, _3, _4, _5, _6, _7) __uint(b7, (_8));
+#define _SIGBYTE9(_1, _2, _3, _4, _5, _6, _7, _8, _9)	\
+	_SIGBYTE8(_1, _2, _3, _4, _5, _6, _7, _8) __uint(b8, (_9));
+#define _SIGBYTE10(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a)	\
+	_SIGBYTE9(_1, _2, _3, _4, _5, _6, _7, _8, _9) __uint(b9, (_a));
+#define _SIGBYTE11(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b)	\
+	_SIGBYTE10(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a) __uint(b10, (_b));
+#define _SIGBYTE12(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c)	\
+	_SIGBYTE11(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b) __uint(b11, (_c));
+#define _SIGBYTE13(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c, _d)	\
+	_SIGBYTE12(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c) __uint(b12, (_d));
+#define _SIGBYTE14(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c, _d, _e)	\
+	_SIGBYTE13(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c, _d) __uint(b13, (_e));
+#define _SIGBYTE15(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c, _d, _e, _f)	\
+	_SIGBYTE14(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c, _d, _e) __uint(b14, (_f));
+
+#define HID_SIGNATURE_NOT_FOUND	((__u32)-1)
+
+/* the offsets of the HID_SIGNATURE() entries, see src/bpf.rs */
+#define HID_BPF_SIGNATURES(_count)			\
+	struct {					\
+		__uint(type, BPF_MAP_TYPE_ARRAY);	\
+		__uint(max_entries, (_count));		\
+		__type(key, __u32);			\
+		__type(value, __u32);			\
+	} hid_bpf_signatures SEC(".maps")
+
+static inline __u32 hid_bpf_signature_offset(void *signatures, __u32 idx)
+{
+	__u32 *offset = bpf_map_lookup_elem(signatures, &idx);
+
+	return offset ? *offset : HID_SIGNATURE_NOT_FOUND;
+}
+
 /* Macro magic below is to make HID_BPF_CONFIG() look like a function call that
  * we can pass multiple HID_DEVICE() invocations in.
  *
  * For up to 16 arguments, HID_BPF_CONFIG(one, two) resolves to
  *
- * union {
+ * static union {
  *    HID_DEVICE(...);
  *    HID_DEVICE(...);
  * } _device_ids SEC(".hid_bpf_config")
@@ -156,8 +448,11 @@ extern int hid_bpf_hw_request(struct hid_bpf_ctx *ctx,
 #define _ARG15(_1, _2, _3, _4, _5, _6, _7, _8, _9, _a, _b, _c, _d, _e, _f) _1; _2; _3; _4; _5; _6; _7; _8; _9; _a; _b; _c; _d; _e; _f;
 
 
-#define HID_BPF_CONFIG(...)  union { \
+/* static so that the objects build.rs links together each keep their own,
+ * used so that clang doesn't drop it
+ */
+#define HID_BPF_CONFIG(...)  static union { \
 	_EXPAND(_ARG, __VA_ARGS__) \
-} _device_ids SEC(".hid_bpf_config")
+} _device_ids SEC(".hid_bpf_config") __attribute__((used))
 
 #endif /* __HID_BPF_HELPERS_H */
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include "report_field.h"
+
+/*
+ * The routines shared by the objects of src/bpf/. This is not an object on
+ * its own: build.rs links it into every object, and into the objects it
+ * links together, so it also carries the only _license of the object.
+ *
+ * The routines are __hidden, libbpf then verifies them in the context of
+ * each caller like static functions.
+ */
+
+__hidden int read_field(struct hid_bpf_ctx *hctx, __u32 offset, __u8 size,
+			bool is_signed, __s64 *value)
+{
+	__u8 *data;
+
+	switch (size) {
+	case 1:
+		data = hid_bpf_get_data(hctx, offset, 1);
+		if (!data)
+			return -EINVAL;
+		*value = is_signed ? (__s8)data[0] : data[0];
+		return 0;
+	case 2:
+		data = hid_bpf_get_data(hctx, offset, 2);
+		if (!data)
+			return -EINVAL;
+		*value = is_signed ? (__s16)(data[0] | (data[1] << 8)) :
+				     (__u16)(data[0] | (data[1] << 8));
+		return 0;
+	case 4:
+		data = hid_bpf_get_data(hctx, offset, 4);
+		if (!data)
+			return -EINVAL;
+		*value = data[0] | (data[1] << 8) | (data[2] << 16) | ((__u32)data[3] << 24);
+		if (is_signed)
+			*value = (__s32)*value;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+__hidden void write_field(struct hid_bpf_ctx *hctx, __u32 offset, __u8 size,
+			  __s64 value)
+{
+	__u8 *data;
+
+	switch (size) {
+	case 1:
+		data = hid_bpf_get_data(hctx, offset, 1);
+		if (data)
+			data[0] = value & 0xff;
+		break;
+	case 2:
+		data = hid_bpf_get_data(hctx, offset, 2);
+		if (data) {
+			data[0] = value & 0xff;
+			data[1] = (value >> 8) & 0xff;
+		}
+		break;
+	case 4:
+		data = hid_bpf_get_data(hctx, offset, 4);
+		if (data) {
+			data[0] = value & 0xff;
+			data[1] = (value >> 8) & 0xff;
+			data[2] = (value >> 16) & 0xff;
+			data[3] = (value >> 24) & 0xff;
+		}
+		break;
+	}
+}
+
+char _license[] SEC("license") = "GPL";
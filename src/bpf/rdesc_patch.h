@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#ifndef __RDESC_PATCH_H
+#define __RDESC_PATCH_H
+
+#define RDESC_PATCH_MAX_ENTRIES 16
+#define RDESC_PATCH_MAX_SIZE 64
+
+/*
+ * One entry of the table used by generic-rdesc-patch.bpf.c: if the report
+ * descriptor contains `expected` at `offset`, it is overwritten with
+ * `replacement`. Both are `size` bytes long, a size of 0 ends the table.
+ */
+struct rdesc_patch {
+	unsigned short offset;
+	unsigned short size;
+	unsigned char expected[RDESC_PATCH_MAX_SIZE];
+	unsigned char replacement[RDESC_PATCH_MAX_SIZE];
+};
+
+#endif /* __RDESC_PATCH_H */
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright (c) 2024 Benjamin Tissoires
+ */
+
+#ifndef __REPORT_FIELD_H
+#define __REPORT_FIELD_H
+
+#include "hid_bpf_helpers.h"
+
+/*
+ * Access to a field of `size` bytes (1, 2 or 4) in little endian at
+ * `offset` bytes from the start of the report, for the generic objects.
+ *
+ * The verifier needs a constant size for hid_bpf_get_data(), so each field
+ * size gets its own call, and the accesses stay in the same branch.
+ *
+ * Both are defined in hid_bpf_lib.bpf.c, which build.rs links into every
+ * object.
+ */
+__hidden int read_field(struct hid_bpf_ctx *hctx, __u32 offset, __u8 size,
+			bool is_signed, __s64 *value);
+
+__hidden void write_field(struct hid_bpf_ctx *hctx, __u32 offset, __u8 size,
+			  __s64 value);
+
+#endif /* __REPORT_FIELD_H */
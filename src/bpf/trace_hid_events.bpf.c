@@ -2,14 +2,13 @@
 /* Copyright (c) 2022 Benjamin Tissoires
  */
 
-#include "vmlinux.h"
 #include "hid_bpf.h"
 #include "hid_bpf_helpers.h"
 #include <bpf/bpf_tracing.h>
 
 char str[64];
 
-SEC("fmod_ret/hid_bpf_device_event")
+SEC(HID_BPF_DEVICE_EVENT)
 int BPF_PROG(trace_hid_events, struct hid_bpf_ctx *hid_ctx)
 {
 	int i, j;
@@ -43,4 +42,6 @@ int BPF_PROG(trace_hid_events, struct hid_bpf_ctx *hid_ctx)
 	return 0;
 }
 
-char _license[] SEC("license") = "GPL";
+HID_BPF_OPS(trace_hid_events_ops) = {
+	.hid_device_event = (void *)trace_hid_events,
+};
@@ -2,7 +2,6 @@
 /* Copyright (c) 2023 Benjamin Tissoires
  */
 
-#include "vmlinux.h"
 #include "hid_bpf.h"
 #include "hid_bpf_helpers.h"
 #include <bpf/bpf_tracing.h>
@@ -91,7 +90,7 @@ static const __u8 fixed_rdesc[] = {
 
 #define U16(index) (data[index] | (data[index + 1] << 8))
 
-SEC("fmod_ret/hid_bpf_rdesc_fixup")
+SEC(HID_BPF_RDESC_FIXUP)
 int BPF_PROG(hid_fix_rdesc_xppen_artist24, struct hid_bpf_ctx *hctx)
 {
 	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, 4096 /* size */);
@@ -106,6 +105,13 @@ int BPF_PROG(hid_fix_rdesc_xppen_artist24, struct hid_bpf_ctx *hctx)
 
 static __u8 prev_state = 0;
 
+#ifdef HID_BPF_STRUCT_OPS
+/* how long a release waits for the pen to come back in range, in ns */
+const volatile __u64 release_window_ns = 20 * 1000 * 1000;
+
+HID_BPF_DEFERRED_REPORTS(deferred_releases);
+#endif
+
 /*
  * There are a few cases where the device is sending wrong event
  * sequences, all related to the second button (the pen doesn't
@@ -152,7 +158,7 @@ static __u8 prev_state = 0;
  *     E: TipSwitch                     InRange
  *
  */
-SEC("fmod_ret/hid_bpf_device_event")
+SEC(HID_BPF_DEVICE_EVENT)
 int BPF_PROG(xppen_24_fix_eraser, struct hid_bpf_ctx *hctx)
 {
 	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, 10 /* size */);
@@ -171,22 +177,40 @@ int BPF_PROG(xppen_24_fix_eraser, struct hid_bpf_ctx *hctx)
 
 	prev_tip = !!(prev_state & TIP_SWITCH);
 
+#ifdef HID_BPF_STRUCT_OPS
+	/* the pen didn't come back in range, the release was a real one */
+	if (hid_bpf_is_reinjected_report(&deferred_releases, hctx)) {
+		prev_state = current_state;
+		return 0;
+	}
+#endif
+
 	/*
 	 * Illegal transition: pen is in range with the tip pressed, and
 	 * it goes into out of proximity.
 	 *
-	 * Ideally we should hold the event, start a timer and deliver it
-	 * only if the timer ends, but we are not capable of that now.
-	 *
-	 * And it doesn't matter because when we are in such cases, this
-	 * means we are detecting a false release.
+	 * The struct_ops build holds the event and only delivers it if the
+	 * pen doesn't come back in range within release_window_ns. The
+	 * fmod_ret one can't use bpf_timer and drops it, which doesn't
+	 * matter much because in such cases we are most likely detecting
+	 * a false release.
 	*/
 	if ((current_state & IN_RANGE) == 0) {
-		if (prev_tip)
+		if (prev_tip) {
+#ifdef HID_BPF_STRUCT_OPS
+			hid_bpf_defer_report(&deferred_releases, hctx, data, 10,
+					     release_window_ns);
+#endif
 			return HID_IGNORE_EVENT;
+		}
 		return 0;
 	}
 
+#ifdef HID_BPF_STRUCT_OPS
+	/* false release, the pen is back in range */
+	hid_bpf_cancel_deferred_report(&deferred_releases, hctx);
+#endif
+
 	/*
 	 * XOR to only set the bits that have changed between
 	 * previous and current state
@@ -209,6 +233,11 @@ int BPF_PROG(xppen_24_fix_eraser, struct hid_bpf_ctx *hctx)
 	return 0;
 }
 
+HID_BPF_OPS(xppen_artist_24) = {
+	.hid_rdesc_fixup = (void *)hid_fix_rdesc_xppen_artist24,
+	.hid_device_event = (void *)xppen_24_fix_eraser,
+};
+
 SEC("syscall")
 int probe(struct hid_bpf_probe_args *ctx)
 {
@@ -225,5 +254,3 @@ int probe(struct hid_bpf_probe_args *ctx)
 
 	return 0;
 }
-
-char _license[] SEC("license") = "GPL";
@@ -0,0 +1,735 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! The control socket of `udev-hid-bpf daemon`.
+//!
+//! A long running daemon keeps libbpf and the attach program loaded, so
+//! `add` and `remove` only forward their request through the socket when
+//! the daemon runs instead of setting everything up on each uevent.
+//!
+//! Each message is a frame: a little-endian `u32` length then the body.
+//! A request body is an opcode byte followed by NUL terminated strings, a
+//! reply body is a little-endian `i32` status (0 or a negative errno) then
+//! a UTF-8 payload: an error message, JSON for `status` and events, or
+//! OpenMetrics text for `metrics`.
+
+use crate::json;
+use std::io::{Read, Write};
+use std::os::fd::AsRawFd;
+use std::os::unix::fs::PermissionsExt;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+
+pub const SOCKET_PATH: &str = "/run/udev-hid-bpf/control.sock";
+
+/* no legitimate request comes anywhere close */
+const MAX_FRAME_SIZE: usize = 1 << 20;
+
+/* a client stuck in the middle of a request must not block the daemon */
+const CLIENT_TIMEOUT: std::time::Duration = std::time::Duration::from_secs(1);
+
+const OP_ADD: u8 = 1;
+const OP_REMOVE: u8 = 2;
+const OP_STATUS: u8 = 3;
+const OP_EVENTS: u8 = 4;
+const OP_METRICS: u8 = 5;
+
+fn invalid(msg: &str) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, msg)
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Request {
+    /// Attach the programs of a device, see `udev-hid-bpf add`
+    Add {
+        devpath: PathBuf,
+        prog: Option<String>,
+        bpfdir: PathBuf,
+        rodata: Vec<(String, String)>,
+    },
+    /// Detach all the programs of a device
+    Remove { devpath: PathBuf },
+    /// The objects currently attached, as JSON
+    Status,
+    /// Keep the connection open and receive one frame per add or remove
+    Events,
+    /// The metrics of the daemon, see [`crate::metrics`]
+    Metrics { format: crate::metrics::Format },
+}
+
+impl Request {
+    pub fn encode(&self) -> Vec<u8> {
+        let mut body = Vec::new();
+        let push = |body: &mut Vec<u8>, field: &str| {
+            body.extend_from_slice(field.as_bytes());
+            body.push(0);
+        };
+
+        match self {
+            Request::Add {
+                devpath,
+                prog,
+                bpfdir,
+                rodata,
+            } => {
+                body.push(OP_ADD);
+                push(&mut body, &devpath.to_string_lossy());
+                push(&mut body, prog.as_deref().unwrap_or(""));
+                push(&mut body, &bpfdir.to_string_lossy());
+                for (name, value) in rodata {
+                    push(&mut body, &format!("{}={}", name, value));
+                }
+            }
+            Request::Remove { devpath } => {
+                body.push(OP_REMOVE);
+                push(&mut body, &devpath.to_string_lossy());
+            }
+            Request::Status => body.push(OP_STATUS),
+            Request::Events => body.push(OP_EVENTS),
+            Request::Metrics { format } => {
+                body.push(OP_METRICS);
+                push(&mut body, format.name());
+            }
+        }
+
+        body
+    }
+
+    pub fn decode(body: &[u8]) -> std::io::Result<Self> {
+        let (op, fields) = body.split_first().ok_or_else(|| invalid("empty request"))?;
+        let fields: Vec<&str> = match fields.split_last() {
+            None => Vec::new(),
+            Some((0, fields)) => fields
+                .split(|byte| *byte == 0)
+                .map(|field| std::str::from_utf8(field).map_err(|_| invalid("invalid UTF-8")))
+                .collect::<std::io::Result<_>>()?,
+            Some(_) => return Err(invalid("unterminated field")),
+        };
+
+        match (*op, fields.as_slice()) {
+            (OP_ADD, [devpath, prog, bpfdir, rodata @ ..]) => Ok(Request::Add {
+                devpath: PathBuf::from(devpath),
+                prog: match *prog {
+                    "" => None,
+                    prog => Some(String::from(prog)),
+                },
+                bpfdir: PathBuf::from(bpfdir),
+                rodata: rodata
+                    .iter()
+                    .map(|assignment| {
+                        assignment
+                            .split_once('=')
+                            .map(|(name, value)| (String::from(name), String::from(value)))
+                            .ok_or_else(|| invalid("expected NAME=VALUE"))
+                    })
+                    .collect::<std::io::Result<_>>()?,
+            }),
+            (OP_REMOVE, [devpath]) => Ok(Request::Remove {
+                devpath: PathBuf::from(devpath),
+            }),
+            (OP_STATUS, []) => Ok(Request::Status),
+            (OP_EVENTS, []) => Ok(Request::Events),
+            (OP_METRICS, [format]) => Ok(Request::Metrics {
+                format: crate::metrics::Format::from_name(format)
+                    .ok_or_else(|| invalid("unknown metrics format"))?,
+            }),
+            _ => Err(invalid("unknown request")),
+        }
+    }
+
+    /// The JSON event sent to the subscribers once `self` was handled
+    fn event(&self, reply: &Reply) -> Option<String> {
+        let (action, devpath) = match self {
+            Request::Add { devpath, .. } => ("add", devpath),
+            Request::Remove { devpath } => ("remove", devpath),
+            _ => return None,
+        };
+
+        Some(json::object(&[
+            ("action", json::string(action)),
+            ("devpath", json::string(&devpath.to_string_lossy())),
+            ("status", reply.status.to_string()),
+        ]))
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Reply {
+    /// 0 or a negative errno
+    pub status: i32,
+    pub payload: String,
+}
+
+impl Reply {
+    pub fn ok(payload: &str) -> Self {
+        Reply {
+            status: 0,
+            payload: String::from(payload),
+        }
+    }
+
+    pub fn encode(&self) -> Vec<u8> {
+        let mut body = self.status.to_le_bytes().to_vec();
+        body.extend_from_slice(self.payload.as_bytes());
+        body
+    }
+
+    pub fn decode(body: &[u8]) -> std::io::Result<Self> {
+        let status = body
+            .get(..4)
+            .ok_or_else(|| invalid("short reply"))?
+            .try_into()
+            .map(i32::from_le_bytes)
+            .unwrap();
+
+        Ok(Reply {
+            status,
+            payload: String::from_utf8_lossy(&body[4..]).into_owned(),
+        })
+    }
+
+    pub fn into_result(self) -> std::io::Result<String> {
+        match self.status {
+            0 => Ok(self.payload),
+            status => Err(std::io::Error::new(
+                std::io::Error::from_raw_os_error(-status).kind(),
+                self.payload,
+            )),
+        }
+    }
+}
+
+impl From<std::io::Result<String>> for Reply {
+    fn from(result: std::io::Result<String>) -> Self {
+        match result {
+            Ok(payload) => Reply::ok(&payload),
+            Err(e) => Reply {
+                status: -e.raw_os_error().unwrap_or(libc::EIO),
+                payload: e.to_string(),
+            },
+        }
+    }
+}
+
+pub fn write_frame<W: Write>(writer: &mut W, body: &[u8]) -> std::io::Result<()> {
+    let mut frame = (body.len() as u32).to_le_bytes().to_vec();
+    frame.extend_from_slice(body);
+    writer.write_all(&frame)
+}
+
+pub fn read_frame<R: Read>(reader: &mut R) -> std::io::Result<Vec<u8>> {
+    let mut length = [0u8; 4];
+    reader.read_exact(&mut length)?;
+
+    let length = u32::from_le_bytes(length) as usize;
+    if length > MAX_FRAME_SIZE {
+        return Err(invalid("frame too large"));
+    }
+
+    let mut body = vec![0; length];
+    reader.read_exact(&mut body)?;
+    Ok(body)
+}
+
+/// Sends `request` to the daemon listening on `socket` and waits for its
+/// reply. Returns `None` when no daemon is running.
+pub fn forward(socket: &Path, request: &Request) -> Option<std::io::Result<String>> {
+    let mut stream = UnixStream::connect(socket).ok()?;
+
+    log::debug!("forwarding {:?} to {}", request, socket.display());
+
+    Some(
+        write_frame(&mut stream, &request.encode())
+            .and_then(|_| read_frame(&mut stream))
+            .and_then(|body| Reply::decode(&body))
+            .and_then(|reply| reply.into_result()),
+    )
+}
+
+/// Calls `callback` with each event of the daemon listening on `socket`,
+/// until the daemon goes away.
+pub fn monitor<F: FnMut(&str)>(socket: &Path, mut callback: F) -> std::io::Result<()> {
+    let mut stream = UnixStream::connect(socket)?;
+
+    write_frame(&mut stream, &Request::Events.encode())?;
+    Reply::decode(&read_frame(&mut stream)?)?.into_result()?;
+
+    loop {
+        match read_frame(&mut stream) {
+            Ok(body) => callback(&Reply::decode(&body)?.payload),
+            Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => return Ok(()),
+            Err(e) => return Err(e),
+        }
+    }
+}
+
+/*
+ * Unplugging a hub or a flaky cable produces bursts of add and remove for
+ * the same devices. The daemon keeps accepting requests until none came for
+ * COALESCE_WINDOW, then only carries out the net change of each device.
+ */
+const COALESCE_WINDOW: std::time::Duration = std::time::Duration::from_millis(20);
+
+/* udev waits for the add and remove to return, don't hold them for long */
+const MAX_BATCH_DELAY: std::time::Duration = std::time::Duration::from_millis(250);
+const MAX_BATCH_SIZE: usize = 256;
+
+/// What to do with a request of a batch, see [`coalesce()`]
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Step {
+    Run,
+    /// skip it and answer with the reply of the request at this index
+    ReplyAs(usize),
+}
+
+impl Request {
+    /// The sysname of the device an add or a remove is about
+    fn device(&self) -> Option<&std::ffi::OsStr> {
+        match self {
+            Request::Add { devpath, .. } | Request::Remove { devpath } => devpath.file_name(),
+            _ => None,
+        }
+    }
+}
+
+/// Reduces a burst of requests to the net change of each device: an add
+/// followed by a remove of the same device is dropped, and only the last
+/// one of duplicated adds or removes is carried out.
+pub fn coalesce(requests: &[Request]) -> Vec<Step> {
+    requests
+        .iter()
+        .enumerate()
+        .map(|(idx, request)| {
+            let device = match request.device() {
+                Some(device) => device,
+                None => return Step::Run,
+            };
+            let later = || {
+                requests
+                    .iter()
+                    .enumerate()
+                    .skip(idx + 1)
+                    .filter(move |(_, later)| later.device() == Some(device))
+            };
+
+            let last_remove = later()
+                .filter(|(_, later)| matches!(later, Request::Remove { .. }))
+                .last();
+            let last_duplicate = later().filter(|(_, later)| *later == request).last();
+
+            match last_remove.or(last_duplicate) {
+                Some((target, _)) => Step::ReplyAs(target),
+                None => Step::Run,
+            }
+        })
+        .collect()
+}
+
+/// Reads one request from `stream`. Event subscribers are kept in
+/// `subscribers` and invalid requests are answered right away.
+fn read_request(
+    mut stream: UnixStream,
+    subscribers: &mut Vec<UnixStream>,
+) -> std::io::Result<Option<(UnixStream, Request)>> {
+    stream.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+    stream.set_write_timeout(Some(CLIENT_TIMEOUT))?;
+
+    let request = match read_frame(&mut stream).and_then(|body| Request::decode(&body)) {
+        Ok(request) => request,
+        Err(e) => {
+            let reply = Reply {
+                status: -libc::EINVAL,
+                payload: e.to_string(),
+            };
+            write_frame(&mut stream, &reply.encode())?;
+            return Ok(None);
+        }
+    };
+
+    if request == Request::Events {
+        write_frame(&mut stream, &Reply::ok("").encode())?;
+        subscribers.push(stream);
+        return Ok(None);
+    }
+
+    Ok(Some((stream, request)))
+}
+
+/// Answers a batch of requests with `handler`, once coalesced, and tells
+/// the subscribers about the adds and removes actually carried out.
+pub fn run_batch<F>(
+    batch: Vec<(UnixStream, Request)>,
+    handler: &mut F,
+    subscribers: &mut Vec<UnixStream>,
+) where
+    F: FnMut(&Request) -> Reply,
+{
+    let requests: Vec<Request> = batch.iter().map(|(_, request)| request.clone()).collect();
+    let steps = coalesce(&requests);
+    let mut replies: Vec<Option<Reply>> = vec![None; requests.len()];
+
+    if requests.len() > 1 {
+        log::debug!(
+            "coalesced {} requests into {}",
+            requests.len(),
+            steps.iter().filter(|step| **step == Step::Run).count(),
+        );
+    }
+
+    for (idx, request) in requests.iter().enumerate() {
+        if steps[idx] != Step::Run {
+            continue;
+        }
+
+        let reply = handler(request);
+        if let Some(event) = request.event(&reply) {
+            let frame = Reply::ok(&event).encode();
+            subscribers.retain_mut(|subscriber| write_frame(subscriber, &frame).is_ok());
+        }
+        replies[idx] = Some(reply);
+    }
+
+    for (idx, (mut stream, _)) in batch.into_iter().enumerate() {
+        let reply = match steps[idx] {
+            Step::Run => replies[idx].as_ref(),
+            Step::ReplyAs(target) => replies[target].as_ref(),
+        };
+
+        if let Err(e) = write_frame(&mut stream, &reply.unwrap().encode()) {
+            log::debug!("client went away: {}", e);
+        }
+    }
+}
+
+/// Whether a client connects to `listener` within `timeout`
+fn wait_for_client(listener: &UnixListener, timeout: std::time::Duration) -> bool {
+    let mut pollfd = libc::pollfd {
+        fd: listener.as_raw_fd(),
+        events: libc::POLLIN,
+        revents: 0,
+    };
+
+    unsafe { libc::poll(&mut pollfd, 1, timeout.as_millis() as libc::c_int) > 0 }
+}
+
+/// Listens on `socket` forever. The requests are handled one batch at a
+/// time, the loads are serialized, which the kernel would mostly do anyway.
+pub fn serve<F>(socket: &Path, mut handler: F) -> std::io::Result<()>
+where
+    F: FnMut(&Request) -> Reply,
+{
+    if let Some(dir) = socket.parent() {
+        std::fs::create_dir_all(dir)?;
+    }
+
+    /* a previous daemon doesn't remove its socket when killed */
+    if UnixStream::connect(socket).is_ok() {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::AddrInUse,
+            format!("a daemon is already listening on {}", socket.display()),
+        ));
+    }
+    std::fs::remove_file(socket).ok();
+
+    let listener = UnixListener::bind(socket)?;
+    std::fs::set_permissions(socket, std::fs::Permissions::from_mode(0o600))?;
+
+    log::info!("listening on {}", socket.display());
+
+    let mut subscribers = Vec::new();
+    let accept = |subscribers: &mut Vec<UnixStream>| match listener.accept() {
+        Ok((stream, _)) => read_request(stream, subscribers).unwrap_or_else(|e| {
+            log::debug!("client error: {}", e);
+            None
+        }),
+        Err(e) => {
+            log::warn!("could not accept a client: {}", e);
+            None
+        }
+    };
+
+    loop {
+        let mut batch = Vec::new();
+        match accept(&mut subscribers) {
+            Some(client) => batch.push(client),
+            None => continue,
+        }
+
+        let start = std::time::Instant::now();
+        while batch
+            .last()
+            .map_or(false, |(_, request)| request.device().is_some())
+            && batch.len() < MAX_BATCH_SIZE
+            && start.elapsed() < MAX_BATCH_DELAY
+            && wait_for_client(&listener, COALESCE_WINDOW)
+        {
+            if let Some(client) = accept(&mut subscribers) {
+                batch.push(client);
+            }
+        }
+
+        run_batch(batch, &mut handler, &mut subscribers);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_request_encoding() {
+        for request in [
+            Request::Add {
+                devpath: PathBuf::from("/sys/bus/hid/devices/0003:045E:07A5.0001"),
+                prog: None,
+                bpfdir: PathBuf::from("/usr/local/lib/firmware/hid/bpf"),
+                rodata: Vec::new(),
+            },
+            Request::Add {
+                devpath: PathBuf::from("/sys/bus/hid/devices/0003:045E:07A5.0001"),
+                prog: Some(String::from("10-mouse.bpf.o")),
+                bpfdir: PathBuf::from("/tmp"),
+                rodata: vec![(String::from("max"), String::from("a=b"))],
+            },
+            Request::Remove {
+                devpath: PathBuf::from("/sys/bus/hid/devices/0003:045E:07A5.0001"),
+            },
+            Request::Status,
+            Request::Events,
+            Request::Metrics {
+                format: crate::metrics::Format::Text,
+            },
+        ] {
+            assert!(Request::decode(&request.encode()).unwrap() == request);
+        }
+
+        assert!(Request::decode(&[]).is_err());
+        assert!(Request::decode(&[OP_REMOVE]).is_err());
+        assert!(Request::decode(&[OP_REMOVE, b'a']).is_err());
+        assert!(Request::decode(&[OP_STATUS, b'a', 0]).is_err());
+        assert!(Request::decode(&[42]).is_err());
+        assert!(Request::decode(&[OP_METRICS, b'x', 0]).is_err());
+
+        let reply = Reply::from(Err(std::io::Error::from_raw_os_error(libc::ENODEV)));
+        assert!(reply.status == -libc::ENODEV);
+        let reply = Reply::decode(&reply.encode()).unwrap();
+        assert!(reply.into_result().is_err());
+        assert!(
+            Reply::decode(&Reply::ok("[]").encode())
+                .unwrap()
+                .into_result()
+                .unwrap()
+                == "[]"
+        );
+        assert!(Reply::decode(&[0, 0]).is_err());
+    }
+
+    fn connect(
+        request: &[u8],
+        subscribers: &mut Vec<UnixStream>,
+    ) -> (UnixStream, Option<(UnixStream, Request)>) {
+        let (mut client, server) = UnixStream::pair().unwrap();
+        write_frame(&mut client, request).unwrap();
+        (client, read_request(server, subscribers).unwrap())
+    }
+
+    fn reply(client: &mut UnixStream) -> Reply {
+        Reply::decode(&read_frame(client).unwrap()).unwrap()
+    }
+
+    fn exchange<F>(
+        request: &[u8],
+        handler: &mut F,
+        subscribers: &mut Vec<UnixStream>,
+    ) -> (UnixStream, Reply)
+    where
+        F: FnMut(&Request) -> Reply,
+    {
+        let (mut client, server) = connect(request, subscribers);
+        if let Some(server) = server {
+            run_batch(vec![server], handler, subscribers);
+        }
+        let reply = reply(&mut client);
+        (client, reply)
+    }
+
+    #[test]
+    fn test_handle_client() {
+        let mut handled = Vec::new();
+        let mut handler = |request: &Request| {
+            handled.push(request.clone());
+            match request {
+                Request::Status => Reply::ok("[]"),
+                _ => Reply::from(Err(std::io::Error::from_raw_os_error(libc::ENODEV))),
+            }
+        };
+        let mut subscribers = Vec::new();
+
+        let (_, reply) = exchange(&Request::Status.encode(), &mut handler, &mut subscribers);
+        assert!(reply == Reply::ok("[]"));
+
+        let (_, reply) = exchange(&[42], &mut handler, &mut subscribers);
+        assert!(reply.status == -libc::EINVAL);
+
+        let (mut monitor, reply) =
+            exchange(&Request::Events.encode(), &mut handler, &mut subscribers);
+        assert!(reply == Reply::ok(""));
+        assert!(subscribers.len() == 1);
+
+        let remove = Request::Remove {
+            devpath: PathBuf::from("/sys/bus/hid/devices/0003:045E:07A5.0001"),
+        };
+        let (_, reply) = exchange(&remove.encode(), &mut handler, &mut subscribers);
+        assert!(reply.status == -libc::ENODEV);
+
+        let event = Reply::decode(&read_frame(&mut monitor).unwrap()).unwrap();
+        assert!(
+            event.payload
+                == "{\"action\": \"remove\", \
+                    \"devpath\": \"/sys/bus/hid/devices/0003:045E:07A5.0001\", \
+                    \"status\": -19}"
+        );
+
+        /* a subscriber that went away is dropped on the next event */
+        drop(monitor);
+        exchange(&remove.encode(), &mut handler, &mut subscribers);
+        assert!(subscribers.is_empty());
+
+        assert!(handled == vec![Request::Status, remove.clone(), remove]);
+    }
+
+    fn add(device: &str) -> Request {
+        Request::Add {
+            devpath: PathBuf::from(format!("/sys/bus/hid/devices/{}", device)),
+            prog: None,
+            bpfdir: PathBuf::from("/usr/local/lib/firmware/hid/bpf"),
+            rodata: Vec::new(),
+        }
+    }
+
+    fn remove(device: &str) -> Request {
+        Request::Remove {
+            devpath: PathBuf::from(format!("/sys/bus/hid/devices/{}", device)),
+        }
+    }
+
+    #[test]
+    fn test_coalesce() {
+        let mut add_prog = add("0003:045E:07A5.0002");
+        if let Request::Add { prog, .. } = &mut add_prog {
+            *prog = Some(String::from("10-mouse.bpf.o"));
+        }
+
+        let requests = [
+            /* plugged and unplugged within the window */
+            add("0003:045E:07A5.0001"),
+            add("0003:045E:07A5.0002"),
+            remove("0003:045E:07A5.0001"),
+            Request::Status,
+            /* udevadm trigger on top of the add */
+            add("0003:045E:07A5.0002"),
+            add_prog.clone(),
+            remove("0003:045E:07A5.0003"),
+            remove("0003:045E:07A5.0003"),
+            /* driver rebind */
+            remove("0003:045E:07A5.0004"),
+            add("0003:045E:07A5.0004"),
+        ];
+
+        assert!(
+            coalesce(&requests)
+                == vec![
+                    Step::ReplyAs(2),
+                    Step::ReplyAs(4),
+                    Step::Run,
+                    Step::Run,
+                    Step::Run,
+                    Step::Run,
+                    Step::ReplyAs(7),
+                    Step::Run,
+                    Step::Run,
+                    Step::Run,
+                ]
+        );
+
+        /* every client gets an answer, the handler only sees the net changes */
+        let mut handled = Vec::new();
+        let mut handler = |request: &Request| {
+            handled.push(request.clone());
+            Reply::ok("")
+        };
+        let mut subscribers = Vec::new();
+        let (mut clients, batch): (Vec<UnixStream>, Vec<_>) = requests
+            .iter()
+            .map(|request| connect(&request.encode(), &mut subscribers))
+            .map(|(client, server)| (client, server.unwrap()))
+            .unzip();
+
+        run_batch(batch, &mut handler, &mut subscribers);
+        for client in clients.iter_mut() {
+            assert!(reply(client) == Reply::ok(""));
+        }
+        assert!(handled.len() == 7);
+    }
+
+    /*
+     * A hub with 16 devices flapping 8 times within the window, with a
+     * udevadm trigger on top: cargo test --release -- --ignored --nocapture
+     * The handler takes the time of a typical load (2ms) or unload (0.2ms).
+     */
+    #[test]
+    #[ignore]
+    fn bench_uevent_storm() {
+        let mut requests = Vec::new();
+        for round in 0..8 {
+            for device in 0..16 {
+                let sysname = format!("0003:045E:07A5.{:04X}", round * 16 + device);
+                requests.push(add(&sysname));
+                requests.push(add(&sysname));
+                if round < 7 {
+                    requests.push(remove(&sysname));
+                }
+            }
+        }
+
+        let mut handler = |request: &Request| {
+            std::thread::sleep(match request {
+                Request::Add { .. } => std::time::Duration::from_micros(2000),
+                _ => std::time::Duration::from_micros(200),
+            });
+            Reply::ok("")
+        };
+
+        let start = std::time::Instant::now();
+        for request in requests.iter() {
+            handler(request);
+        }
+        let one_by_one = start.elapsed();
+
+        let mut subscribers = Vec::new();
+        let (mut clients, batch): (Vec<UnixStream>, Vec<_>) = requests
+            .iter()
+            .map(|request| connect(&request.encode(), &mut subscribers))
+            .map(|(client, server)| (client, server.unwrap()))
+            .unzip();
+
+        let start = std::time::Instant::now();
+        run_batch(batch, &mut handler, &mut subscribers);
+        let coalesced = start.elapsed();
+
+        for client in clients.iter_mut() {
+            assert!(reply(client).status == 0);
+        }
+
+        println!(
+            "{} requests: {:?} one by one, {:?} coalesced into {} steps",
+            requests.len(),
+            one_by_one,
+            coalesced,
+            coalesce(&requests)
+                .iter()
+                .filter(|step| **step == Step::Run)
+                .count(),
+        );
+        assert!(coalesced < one_by_one);
+    }
+}
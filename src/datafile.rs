@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! Common parsing of the data files loaded by the generic objects
+//! (`.rdesc-patch`, `.event-transform`).
+//!
+//! Data files are line based: `#` starts a comment, a trailing `\`
+//! continues the line, and each line starts with a keyword.
+
+use crate::modalias::Modalias;
+use crate::rdesc::{self, ReportDescriptor, ReportType};
+use crate::signature::SignatureScan;
+
+pub fn invalid(lineno: usize, msg: &str) -> std::io::Error {
+    std::io::Error::new(
+        std::io::ErrorKind::InvalidData,
+        format!("line {}: {}", lineno, msg),
+    )
+}
+
+/// Returns (line number, tokens) for every non empty logical line
+pub fn logical_lines(data: &str) -> Vec<(usize, Vec<String>)> {
+    let mut lines = Vec::new();
+    let mut logical_line = String::new();
+    let mut first_lineno = 0;
+
+    for (idx, line) in data.lines().enumerate() {
+        let line = line.split('#').next().unwrap().trim();
+
+        if logical_line.is_empty() {
+            first_lineno = idx + 1;
+        }
+
+        if let Some(line) = line.strip_suffix('\\') {
+            logical_line.push_str(line);
+            logical_line.push(' ');
+            continue;
+        }
+        logical_line.push_str(line);
+
+        let tokens: Vec<String> = logical_line
+            .split_whitespace()
+            .map(|t| String::from(t))
+            .collect();
+        if !tokens.is_empty() {
+            lines.push((first_lineno, tokens));
+        }
+
+        logical_line.clear();
+    }
+
+    lines
+}
+
+pub fn parse_bytes(lineno: usize, tokens: &[String]) -> std::io::Result<Vec<u8>> {
+    tokens
+        .iter()
+        .map(|t| {
+            u8::from_str_radix(t.trim_start_matches("0x"), 16)
+                .map_err(|_| invalid(lineno, &format!("invalid byte '{}'", t)))
+        })
+        .collect()
+}
+
+/// Parses a decimal or `0x` prefixed hexadecimal, possibly negative, number
+pub fn parse_number(lineno: usize, token: Option<&String>) -> std::io::Result<i64> {
+    let token = token.ok_or(invalid(lineno, "missing value"))?;
+    let (negative, digits) = match token.strip_prefix('-') {
+        Some(digits) => (true, digits),
+        None => (false, token.as_str()),
+    };
+
+    let value = match digits.strip_prefix("0x") {
+        Some(hex) => i64::from_str_radix(hex, 16),
+        None => digits.parse::<i64>(),
+    }
+    .map_err(|_| invalid(lineno, &format!("invalid number '{}'", token)))?;
+
+    Ok(if negative { -value } else { value })
+}
+
+pub fn parse_offset(lineno: usize, token: Option<&String>) -> std::io::Result<usize> {
+    match parse_number(lineno, token)? {
+        offset if offset >= 0 => Ok(offset as usize),
+        _ => Err(invalid(lineno, "negative offset")),
+    }
+}
+
+/// The devices a data file applies to:
+///
+/// ```text
+/// device hid:b0003g0001v0000258Ap00000027
+/// rdesc_size 213
+/// expect 3 06
+/// application mouse
+/// has_usage input 1 wheel
+/// ```
+///
+/// `device` can be given several times and is used to generate the hwdb,
+/// `rdesc_size` and `expect OFFSET BYTES...` play the role of the `probe`
+/// of a regular object. `expect any BYTES...` matches the bytes wherever
+/// they are in the report descriptor.
+///
+/// `application USAGE` and `has_usage input|output|feature ID|any USAGE`
+/// match the parsed report descriptor instead of its bytes, so they keep
+/// matching when a firmware update moves things around. `USAGE` is a name
+/// from [`rdesc::usage_name()`] or a `0x` prefixed usage, usage page in the
+/// high 16 bits.
+#[derive(Debug, Default)]
+pub struct DeviceMatch {
+    pub modaliases: Vec<Modalias>,
+    pub rdesc_size: Option<usize>,
+    pub expects: Vec<(usize, Vec<u8>)>,
+    /// the `expect any` sequences
+    pub signatures: Vec<Vec<u8>>,
+    pub applications: Vec<u32>,
+    pub usages: Vec<(ReportType, Option<u8>, u32)>,
+}
+
+fn parse_usage(lineno: usize, token: Option<&String>) -> std::io::Result<u32> {
+    let token = token.ok_or(invalid(lineno, "missing usage"))?;
+    rdesc::parse_usage(token).ok_or(invalid(lineno, &format!("unknown usage '{}'", token)))
+}
+
+impl DeviceMatch {
+    /// Returns false if the line is not about matching a device
+    pub fn parse_line(&mut self, lineno: usize, tokens: &[String]) -> std::io::Result<bool> {
+        match tokens[0].as_str() {
+            "device" => {
+                let modalias = tokens.get(1).ok_or(invalid(lineno, "missing modalias"))?;
+                self.modaliases.push(Modalias::from_str(modalias)?);
+            }
+            "rdesc_size" => {
+                self.rdesc_size = Some(parse_offset(lineno, tokens.get(1))?);
+            }
+            "expect" => {
+                let expected = parse_bytes(lineno, &tokens[2.min(tokens.len())..])?;
+                if expected.is_empty() {
+                    return Err(invalid(lineno, "missing expected bytes"));
+                }
+                match tokens.get(1).map(|t| t.as_str()) {
+                    Some("any") => self.signatures.push(expected),
+                    _ => self
+                        .expects
+                        .push((parse_offset(lineno, tokens.get(1))?, expected)),
+                }
+            }
+            "application" => {
+                self.applications.push(parse_usage(lineno, tokens.get(1))?);
+            }
+            "has_usage" => {
+                let report_type = match tokens.get(1).map(|t| t.as_str()) {
+                    Some("input") => ReportType::Input,
+                    Some("output") => ReportType::Output,
+                    Some("feature") => ReportType::Feature,
+                    _ => return Err(invalid(lineno, "expected input, output or feature")),
+                };
+                let report_id = match tokens.get(2).map(|t| t.as_str()) {
+                    Some("any") => None,
+                    _ => match parse_number(lineno, tokens.get(2))? {
+                        id @ 0..=255 => Some(id as u8),
+                        _ => return Err(invalid(lineno, "invalid report ID")),
+                    },
+                };
+                let usage = parse_usage(lineno, tokens.get(3))?;
+                self.usages.push((report_type, report_id, usage));
+            }
+            _ => return Ok(false),
+        }
+
+        Ok(true)
+    }
+
+    /// `rdesc_hash` identifies `rdesc` in the cache of the parsed layouts,
+    /// `scan` has the `expect any` signatures of the data files loaded on
+    /// the device, see [`SignatureScan`].
+    pub fn matches(&self, rdesc: &[u8], rdesc_hash: u64, scan: &SignatureScan) -> bool {
+        if let Some(size) = self.rdesc_size {
+            if size != rdesc.len() {
+                return false;
+            }
+        }
+
+        if !self.expects.iter().all(|(offset, expected)| {
+            rdesc.get(*offset..*offset + expected.len()) == Some(expected.as_slice())
+        }) {
+            return false;
+        }
+
+        if !self
+            .signatures
+            .iter()
+            .all(|signature| scan.find(signature, rdesc).is_some())
+        {
+            return false;
+        }
+
+        if self.applications.is_empty() && self.usages.is_empty() {
+            return true;
+        }
+
+        let descriptor = match ReportDescriptor::cached(rdesc_hash, rdesc) {
+            Ok(descriptor) => descriptor,
+            Err(e) => {
+                log::debug!("can not parse the report descriptor: {}", e);
+                return false;
+            }
+        };
+
+        self.applications
+            .iter()
+            .all(|usage| descriptor.applications().contains(usage))
+            && self.usages.iter().all(|(report_type, report_id, usage)| {
+                descriptor.has_usage(*report_type, *report_id, *usage)
+            })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_logical_lines() {
+        let data = "
+            # a comment
+            device hid:b0003g0001v0000258Ap00000027 # trailing comment
+            expect 1 \\
+                06 07
+            rdesc_size 0x10
+        ";
+        let lines = logical_lines(data);
+        assert!(lines.len() == 3);
+        assert!(lines[0].0 == 3);
+        assert!(lines[1].0 == 4);
+        assert!(lines[1].1 == vec!["expect", "1", "06", "07"]);
+        assert!(parse_number(5, lines[2].1.get(1)).unwrap() == 16);
+        assert!(parse_number(1, Some(&String::from("-0x10"))).unwrap() == -16);
+        assert!(parse_offset(1, Some(&String::from("-2"))).is_err());
+
+        let mut device_match = DeviceMatch::default();
+        for (lineno, tokens) in lines {
+            assert!(device_match.parse_line(lineno, &tokens).unwrap());
+        }
+        assert!(device_match.modaliases[0].vid == 0x258a);
+        let scan = SignatureScan::default();
+        assert!(device_match.matches(&[0, 6, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0], 0, &scan));
+        assert!(!device_match.matches(&[0, 6, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0], 0, &scan));
+        assert!(!device_match.matches(&[0, 6, 7], 0, &scan));
+
+        let tokens = logical_lines("expect any 00 00 06").remove(0).1;
+        assert!(device_match.parse_line(1, &tokens).unwrap());
+        for rdesc in [
+            [0, 6, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0],
+            [0, 6, 7, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0],
+        ] {
+            let signatures = device_match.signatures.clone();
+            let found = device_match.matches(&rdesc, 0, &SignatureScan::new(signatures, &rdesc));
+            assert!(found == device_match.matches(&rdesc, 0, &scan));
+            assert!(found == (rdesc[5] == 6));
+        }
+        let tokens = logical_lines("expect any").remove(0).1;
+        assert!(device_match.parse_line(1, &tokens).is_err());
+
+        /* a mouse with a wheel in report 1 */
+        let rdesc = [
+            0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x01, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f,
+            0x75, 0x08, 0x95, 0x01, 0x81, 0x06, 0xc0,
+        ];
+        let mut device_match = DeviceMatch::default();
+        for line in ["application mouse", "has_usage input 1 wheel"] {
+            let tokens = logical_lines(line).remove(0).1;
+            assert!(device_match.parse_line(1, &tokens).unwrap());
+        }
+        assert!(device_match.matches(&rdesc, 1, &scan));
+        let tokens = logical_lines("has_usage input any 0x10031").remove(0).1;
+        assert!(device_match.parse_line(1, &tokens).unwrap());
+        assert!(!device_match.matches(&rdesc, 1, &scan));
+        assert!(!device_match.matches(&rdesc[..20], 2, &scan));
+
+        for line in [
+            "has_usage input 1 rubber",
+            "has_usage in 1 x",
+            "application",
+        ] {
+            let tokens = logical_lines(line).remove(0).1;
+            assert!(device_match.parse_line(1, &tokens).is_err());
+        }
+    }
+}
@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+use crate::datafile::{self, invalid, DeviceMatch};
+
+/// Extension of the data files describing a list of event transform rules.
+pub const EXTENSION: &str = "event-transform";
+
+/// The generic object that applies the rules, see generic-event-transform.bpf.c
+pub const OBJECT: &str = "generic-event-transform.bpf.o";
+
+/* keep in sync with src/bpf/event_transform.h */
+pub const MAX_RULES: usize = 16;
+pub const ANY_REPORT: i16 = -1;
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Op {
+    Negate = 1,
+    Scale = 2,
+    Clamp = 3,
+    Xor = 4,
+    Swap = 5,
+    DropIf = 6,
+}
+
+/// A rule applied on the field of `size` bytes at `offset` in the report,
+/// see event_transform.h for the meaning of `args` for each `op`.
+#[derive(Debug, PartialEq)]
+pub struct Rule {
+    pub op: Op,
+    pub report_id: i16,
+    pub size: u8,
+    pub is_signed: bool,
+    pub offset: usize,
+    pub args: [i32; 3],
+}
+
+/// The content of a `.event-transform` data file, see [`DeviceMatch`] for
+/// the lines selecting the devices:
+///
+/// ```text
+/// device hid:b0003g0001v000004D9p0000A09F
+/// rdesc_size 71
+///
+/// report any              # or a report ID, applies to the following rules
+/// negate s16 3            # field = -field
+/// scale s16 3 3 2         # field = field * 3 / 2
+/// clamp s16 3 -100 100    # field = clamp(field, -100, 100)
+/// xor u8 1 0x19 0x29 0x29 # field ^= 0x19 if (field & 0x29) == 0x29
+/// swap u16 2 4            # swap the u16 at 2 with the one at 4
+/// drop-if u8 1 0x20 0x00  # ignore the report if (field & 0x20) == 0x00
+/// ```
+///
+/// Fields are `u8`, `s8`, `u16`, `s16`, `u32` or `s32` in little endian,
+/// at an offset in bytes from the start of the report (report ID included).
+/// The mask and match of `xor` are optional.
+#[derive(Debug)]
+pub struct RuleList {
+    pub device_match: DeviceMatch,
+    pub rules: Vec<Rule>,
+}
+
+fn parse_type(lineno: usize, token: Option<&String>) -> std::io::Result<(u8, bool)> {
+    match token.map(|t| t.as_str()) {
+        Some("u8") => Ok((1, false)),
+        Some("s8") => Ok((1, true)),
+        Some("u16") => Ok((2, false)),
+        Some("s16") => Ok((2, true)),
+        Some("u32") => Ok((4, false)),
+        Some("s32") => Ok((4, true)),
+        _ => Err(invalid(lineno, "missing or invalid field type")),
+    }
+}
+
+fn parse_arg(lineno: usize, token: Option<&String>) -> std::io::Result<i32> {
+    let value = datafile::parse_number(lineno, token)?;
+
+    /* masks are commonly written as unsigned hexadecimal */
+    i32::try_from(value)
+        .or(u32::try_from(value).map(|v| v as i32))
+        .map_err(|_| invalid(lineno, "value out of range"))
+}
+
+impl RuleList {
+    pub fn from_str(data: &str) -> std::io::Result<Self> {
+        let mut list = RuleList {
+            device_match: DeviceMatch::default(),
+            rules: Vec::new(),
+        };
+        let mut report_id = ANY_REPORT;
+
+        for (lineno, tokens) in datafile::logical_lines(data) {
+            if list.device_match.parse_line(lineno, &tokens)? {
+                continue;
+            }
+
+            let op = match tokens[0].as_str() {
+                "report" => {
+                    report_id = match tokens.get(1).map(|t| t.as_str()) {
+                        Some("any") => ANY_REPORT,
+                        _ => match datafile::parse_number(lineno, tokens.get(1))? {
+                            id @ 0..=255 => id as i16,
+                            _ => return Err(invalid(lineno, "invalid report ID")),
+                        },
+                    };
+                    continue;
+                }
+                "negate" => Op::Negate,
+                "scale" => Op::Scale,
+                "clamp" => Op::Clamp,
+                "xor" => Op::Xor,
+                "swap" => Op::Swap,
+                "drop-if" => Op::DropIf,
+                keyword => {
+                    return Err(invalid(lineno, &format!("unknown keyword '{}'", keyword)));
+                }
+            };
+
+            let (size, is_signed) = parse_type(lineno, tokens.get(1))?;
+            let offset = datafile::parse_offset(lineno, tokens.get(2))?;
+            let nargs = match op {
+                Op::Negate => 0,
+                Op::Swap => 1,
+                Op::Scale | Op::Clamp | Op::DropIf => 2,
+                Op::Xor if tokens.len() == 4 => 1,
+                Op::Xor => 3,
+            };
+
+            if tokens.len() != 3 + nargs {
+                return Err(invalid(lineno, "wrong number of arguments"));
+            }
+
+            let mut args = [0; 3];
+            for idx in 0..nargs {
+                args[idx] = parse_arg(lineno, tokens.get(3 + idx))?;
+            }
+
+            /* drop-if takes a mask and a match, store them like xor does */
+            if op == Op::DropIf {
+                args = [0, args[0], args[1]];
+            }
+
+            match op {
+                Op::Scale if args[0] < 0 || args[1] <= 0 => {
+                    return Err(invalid(lineno, "scale factors must be positive"));
+                }
+                Op::Clamp if args[0] > args[1] => {
+                    return Err(invalid(lineno, "clamp minimum is above maximum"));
+                }
+                Op::Swap if args[0] < 0 || args[0] as usize + size as usize > 4096 => {
+                    return Err(invalid(lineno, "swap offset out of bounds"));
+                }
+                _ => {}
+            }
+
+            if offset + size as usize > 4096 {
+                return Err(invalid(lineno, "field out of bounds"));
+            }
+
+            list.rules.push(Rule {
+                op,
+                report_id,
+                size,
+                is_signed,
+                offset,
+                args,
+            });
+        }
+
+        if list.rules.is_empty() {
+            return Err(invalid(0, "no rule in list"));
+        }
+
+        if list.rules.len() > MAX_RULES {
+            return Err(invalid(0, "too many rules"));
+        }
+
+        Ok(list)
+    }
+
+    pub fn from_path(path: &std::path::Path) -> std::io::Result<Self> {
+        let data = std::fs::read_to_string(path)?;
+        Self::from_str(&data)
+            .map_err(|e| std::io::Error::new(e.kind(), format!("{}: {}", path.display(), e)))
+    }
+}
+
+pub fn is_rule_list(path: &std::path::Path) -> bool {
+    path.extension().map_or(false, |ext| ext == EXTENSION)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_rule_list() {
+        let data = "
+            device hid:b0003g0001v000004D9p0000A09F
+            rdesc_size 71
+            negate s16 3
+            report 7
+            xor u8 1 0x19 0x29 0x29
+            xor u8 1 0x80
+            drop-if u8 1 0xff 0x00
+            report any
+            scale u16 2 3 2
+            clamp s8 8 -100 100
+            swap u16 2 4
+        ";
+        let list = RuleList::from_str(data).unwrap();
+        assert!(list.device_match.rdesc_size == Some(71));
+        assert!(list.rules.len() == 7);
+        assert!(
+            list.rules[0]
+                == Rule {
+                    op: Op::Negate,
+                    report_id: ANY_REPORT,
+                    size: 2,
+                    is_signed: true,
+                    offset: 3,
+                    args: [0, 0, 0],
+                }
+        );
+        assert!(list.rules[1].report_id == 7);
+        assert!(list.rules[1].args == [0x19, 0x29, 0x29]);
+        assert!(list.rules[2].args == [0x80, 0, 0]);
+        assert!(list.rules[3].op == Op::DropIf);
+        assert!(list.rules[3].args == [0, 0xff, 0]);
+        assert!(list.rules[4].report_id == ANY_REPORT);
+        assert!(list.rules[5].args == [-100, 100, 0]);
+        assert!(list.rules[6].args == [4, 0, 0]);
+
+        assert!(RuleList::from_str("negate s16").is_err());
+        assert!(RuleList::from_str("negate f16 3").is_err());
+        assert!(RuleList::from_str("negate s16 3 4").is_err());
+        assert!(RuleList::from_str("scale s16 3 1 0").is_err());
+        assert!(RuleList::from_str("clamp s16 3 10 -10").is_err());
+        assert!(RuleList::from_str("report 256").is_err());
+        assert!(RuleList::from_str("rdesc_size 71").is_err());
+    }
+}
@@ -2,3 +2,5 @@
 
 #include "bpf/hid_bpf.h"
 #include "bpf/attach.h"
+#include "bpf/rdesc_patch.h"
+#include "bpf/event_transform.h"
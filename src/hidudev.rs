@@ -2,8 +2,80 @@
 
 use crate::bpf;
 use crate::modalias::Modalias;
+use crate::signature::SignatureScan;
 use log;
 
+/// What the loader needs to know about a device, read once from sysfs and
+/// udev and shared by every object loaded for it.
+#[derive(Debug)]
+pub struct DeviceSnapshot {
+    id: u32,
+    sysname: String,
+    modalias: Modalias,
+    rdesc: Vec<u8>,
+    rdesc_hash: u64,
+    bpffs_path: String,
+    signatures: SignatureScan,
+}
+
+impl DeviceSnapshot {
+    pub fn new(sysname: &str, modalias: Modalias, rdesc: Vec<u8>) -> std::io::Result<Self> {
+        /* 0003:045E:07A5.000B */
+        let id = sysname
+            .get(15..)
+            .and_then(|id| u32::from_str_radix(id, 16).ok())
+            .ok_or(std::io::Error::new(
+                std::io::ErrorKind::InvalidInput,
+                format!("'{}' is not a HID device name", sysname),
+            ))?;
+
+        Ok(DeviceSnapshot {
+            id,
+            sysname: String::from(sysname),
+            modalias,
+            rdesc_hash: bpf::content_hash(&rdesc),
+            rdesc,
+            bpffs_path: bpf::get_bpffs_path(sysname, ""),
+            signatures: SignatureScan::default(),
+        })
+    }
+
+    pub fn id(&self) -> u32 {
+        self.id
+    }
+
+    pub fn sysname(&self) -> &str {
+        &self.sysname
+    }
+
+    pub fn modalias(&self) -> &Modalias {
+        &self.modalias
+    }
+
+    pub fn rdesc(&self) -> &[u8] {
+        &self.rdesc
+    }
+
+    pub fn rdesc_hash(&self) -> u64 {
+        self.rdesc_hash
+    }
+
+    /// The bpffs directory of the device, objects are pinned below it
+    pub fn bpffs_path(&self) -> &str {
+        &self.bpffs_path
+    }
+
+    /// Searches the signatures of all the data files among `paths` in the
+    /// report descriptor in a single pass, instead of once per data file.
+    pub fn scan_signatures(&mut self, paths: &[std::path::PathBuf]) {
+        self.signatures = SignatureScan::new(bpf::scanned_signatures(paths), &self.rdesc);
+    }
+
+    pub fn signatures(&self) -> &SignatureScan {
+        &self.signatures
+    }
+}
+
 pub struct HidUdev {
     udev_device: udev::Device,
 }
@@ -24,7 +96,7 @@ impl HidUdev {
                 syspath.display()
             );
             if let Some(parent) = device.parent_with_subsystem("hid")? {
-                log::debug!("Using {}", parent.syspath().to_str().unwrap());
+                log::debug!("Using {}", parent.syspath().display());
                 device = parent
             } else {
                 return Err(std::io::Error::new(
@@ -39,47 +111,55 @@ impl HidUdev {
         })
     }
 
-    pub fn modalias(&self) -> Modalias {
-        Modalias::from_udev_device(&self.udev_device).unwrap()
+    pub fn modalias(&self) -> std::io::Result<Modalias> {
+        Modalias::from_udev_device(&self.udev_device)
     }
 
     pub fn sysname(&self) -> String {
-        String::from(self.udev_device.sysname().to_str().unwrap())
+        self.udev_device.sysname().to_string_lossy().into_owned()
     }
 
     pub fn syspath(&self) -> String {
-        String::from(self.udev_device.syspath().to_str().unwrap())
+        self.udev_device.syspath().to_string_lossy().into_owned()
     }
 
-    pub fn id(&self) -> u32 {
-        let hid_sys = self.sysname();
-        u32::from_str_radix(&hid_sys[15..], 16).unwrap()
+    pub fn snapshot(&self) -> std::io::Result<DeviceSnapshot> {
+        let rdesc = std::fs::read(self.syspath() + "/report_descriptor")?;
+
+        DeviceSnapshot::new(&self.sysname(), self.modalias()?, rdesc)
     }
 
-    pub fn load_bpf_from_directory(
+    /// The file names listed in the hwdb for this device
+    fn hwdb_objects(&self) -> Vec<std::ffi::OsString> {
+        self.udev_device
+            .properties()
+            .filter(|property| {
+                log::debug!("property: {:?} = {:?}", property.name(), property.value());
+                property.name().to_string_lossy().starts_with("HID_BPF_")
+            })
+            .map(|property| property.value().to_os_string())
+            .collect()
+    }
+
+    /// The objects to load from `bpf_dir`: `prog` if given, the ones
+    /// listed in the hwdb for this device otherwise
+    fn bpf_objects(
         &self,
-        bpf_dir: std::path::PathBuf,
+        bpf_dir: &std::path::PathBuf,
         prog: Option<String>,
-    ) -> std::io::Result<()> {
-        if !bpf_dir.exists() {
-            return Ok(());
-        }
-
+    ) -> Vec<std::path::PathBuf> {
         let mut paths = Vec::new();
 
         if prog.is_none() {
-            for property in self.udev_device.properties() {
-                log::debug!("property: {:?} = {:?}", property.name(), property.value());
-                if property.name().to_str().unwrap().starts_with("HID_BPF_") {
-                    let target_object = bpf_dir.join(property.value());
-                    if target_object.is_file() {
-                        log::debug!(
-                            "device added {}, filename: {}",
-                            self.sysname(),
-                            target_object.display(),
-                        );
-                        paths.push(target_object);
-                    }
+            for object in self.hwdb_objects() {
+                let target_object = bpf_dir.join(object);
+                if target_object.is_file() {
+                    log::debug!(
+                        "device added {}, filename: {}",
+                        self.sysname(),
+                        target_object.display(),
+                    );
+                    paths.push(target_object);
                 }
             }
         } else {
@@ -94,11 +174,67 @@ impl HidUdev {
             }
         }
 
-        if !paths.is_empty() {
-            let hid_bpf_loader = bpf::HidBPF::new().unwrap();
-            for path in paths {
-                if let Err(e) = hid_bpf_loader.load_programs(&path, self) {
-                    log::warn!("Failed to load {:?}: {:?}", path, e);
+        paths
+    }
+
+    /// `hid_bpf_loader` is set up on first use and can be kept for the
+    /// next devices, as the daemon does.
+    pub fn load_bpf_from_directory(
+        &self,
+        bpf_dir: std::path::PathBuf,
+        prog: Option<String>,
+        rodata: &[(String, String)],
+        hid_bpf_loader: &mut Option<bpf::HidBPF>,
+    ) -> std::io::Result<()> {
+        if !bpf_dir.exists() {
+            return Ok(());
+        }
+
+        let paths = self.bpf_objects(&bpf_dir, prog);
+        if paths.is_empty() {
+            return Ok(());
+        }
+
+        /* cached per kernel, saves loads that could only fail */
+        if bpf::Backend::detect().is_none() {
+            log::info!(
+                "this kernel doesn't support HID-BPF, skipping {}",
+                self.sysname()
+            );
+            return Ok(());
+        }
+
+        let mut device = self.snapshot()?;
+        device.scan_signatures(&paths);
+
+        /* built once, for both the attached check and the load */
+        let mut objects = Vec::new();
+        for path in paths {
+            match bpf::ObjectToLoad::from_path(&path, &device, rodata) {
+                Ok(object) if bpf::is_object_attached(&device, &object) => {
+                    log::debug!(
+                        "{} is already attached to {}, skipping",
+                        path.display(),
+                        self.sysname(),
+                    );
+                }
+                Ok(object) => objects.push(object),
+                Err(e) => log::warn!("Failed to load {:?}: {:?}", path, e),
+            }
+        }
+
+        if !objects.is_empty() {
+            if hid_bpf_loader.is_none() {
+                *hid_bpf_loader =
+                    Some(bpf::HidBPF::new().map_err(|e| {
+                        std::io::Error::new(std::io::ErrorKind::Other, e.to_string())
+                    })?);
+            }
+            let hid_bpf_loader = hid_bpf_loader.as_ref().unwrap();
+
+            for object in objects {
+                if let Err(e) = hid_bpf_loader.load_programs(&object, &device) {
+                    log::warn!("Failed to load {:?}: {:?}", object.source(), e);
                 };
             }
         }
@@ -106,15 +242,94 @@ impl HidUdev {
         Ok(())
     }
 
-    pub fn remove_bpf_objects(&self) -> std::io::Result<()> {
-        log::info!("device removed");
+    /// Brings the attached objects in line with `bpf_dir`: new versions
+    /// replace the attached ones without detaching the device in between,
+    /// and without `prog`, the objects no longer listed for the device in
+    /// the hwdb are removed. Nothing is removed when none of the objects
+    /// listed for the device could be found in `bpf_dir`.
+    pub fn reload_bpf_from_directory(
+        &self,
+        bpf_dir: std::path::PathBuf,
+        prog: Option<String>,
+        rodata: &[(String, String)],
+    ) -> std::io::Result<()> {
+        if !bpf_dir.exists() {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::NotFound,
+                format!("{} doesn't exist", bpf_dir.display()),
+            ));
+        }
 
-        let path = bpf::get_bpffs_path(&self.sysname(), "");
+        if bpf::Backend::detect().is_none() {
+            log::info!(
+                "this kernel doesn't support HID-BPF, skipping {}",
+                self.sysname()
+            );
+            return Ok(());
+        }
+
+        let prune = prog.is_none();
+        let paths = self.bpf_objects(&bpf_dir, prog);
+        /* a wrong bpfdir or an interrupted upgrade must not detach everything */
+        let prune = prune && (!paths.is_empty() || self.hwdb_objects().is_empty());
 
-        std::fs::remove_dir_all(path).ok();
+        let mut device = self.snapshot()?;
+        device.scan_signatures(&paths);
+        let mut kept = Vec::new();
+        let mut hid_bpf_loader = None;
+
+        for path in paths {
+            let object = match bpf::ObjectToLoad::from_path(&path, &device, rodata) {
+                Ok(object) => object,
+                /* keep the old version running */
+                Err(e) => {
+                    log::warn!("Failed to reload {:?}: {:?}", path, e);
+                    kept.push(path);
+                    continue;
+                }
+            };
+
+            if bpf::is_object_attached(&device, &object) {
+                log::debug!("{} is up to date", path.display());
+                kept.push(path);
+                continue;
+            }
+
+            if hid_bpf_loader.is_none() {
+                hid_bpf_loader =
+                    Some(bpf::HidBPF::new().map_err(|e| {
+                        std::io::Error::new(std::io::ErrorKind::Other, e.to_string())
+                    })?);
+            }
+
+            match hid_bpf_loader
+                .as_ref()
+                .unwrap()
+                .load_programs(&object, &device)
+            {
+                Ok(true) => kept.push(path),
+                /* the new version doesn't apply to this device anymore */
+                Ok(false) => {}
+                /* keep the old version running */
+                Err(e) => {
+                    log::warn!("Failed to reload {:?}: {:?}", path, e);
+                    kept.push(path);
+                }
+            }
+        }
+
+        if prune {
+            bpf::remove_bpf_objects_except(&device, &kept)?;
+        }
 
         Ok(())
     }
+
+    pub fn remove_bpf_objects(&self) -> std::io::Result<()> {
+        log::info!("device removed");
+
+        bpf::remove_bpf_objects(&self.sysname())
+    }
 }
 
 #[cfg(test)]
@@ -122,6 +337,26 @@ mod tests {
     use super::*;
     use crate::modalias::{Bus, Group};
 
+    #[test]
+    fn test_device_snapshot() {
+        let modalias = Modalias::from_static_str("b0003g0001v000004D9p0000A09F").unwrap();
+        let rdesc = vec![0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0xc0];
+        let device = DeviceSnapshot::new("0003:04D9:A09F.000B", modalias, rdesc).unwrap();
+
+        assert!(device.id() == 0xb);
+        assert!(device.sysname() == "0003:04D9:A09F.000B");
+        assert!(device.modalias().vid == 0x04d9);
+        assert!(device.rdesc().len() == 7);
+        assert!(device.rdesc_hash() == bpf::content_hash(device.rdesc()));
+        assert!(device.bpffs_path() == "/sys/fs/bpf/hid/0003_04D9_A09F_000B/");
+
+        let args = bpf::hid_bpf_probe_args::from(&device);
+        assert!(args.hid == 0xb && args.rdesc_size == 7 && args.rdesc[5] == 0x01);
+
+        let modalias = Modalias::from_static_str("b0003g0001v000004D9p0000A09F").unwrap();
+        assert!(DeviceSnapshot::new("hidraw0", modalias, Vec::new()).is_err());
+    }
+
     #[test]
     fn test_modalias() {
         let modalias = "b0003g0001v000004D9p0000A09F";
@@ -157,4 +392,22 @@ mod tests {
         let m = Modalias::from_str(modalias.to_lowercase().as_str());
         assert!(m.is_err());
     }
+
+    #[test]
+    fn test_modalias_matches() {
+        let device = Modalias::from_static_str("b0003g0001v000004D9p0000A09F").unwrap();
+
+        for (modalias, matches) in [
+            ("b0003g0001v000004D9p0000A09F", true),
+            ("b0000g0001v000004D9p0000A09F", true),
+            ("b0003g0000v000004D9p00000000", true),
+            ("b0000g0000v00000000p00000000", true),
+            ("b0005g0001v000004D9p0000A09F", false),
+            ("b0003g0004v000004D9p0000A09F", false),
+            ("b0003g0001v000004D9p0000A09E", false),
+        ] {
+            let m = Modalias::from_static_str(modalias).unwrap();
+            assert!(m.matches(&device) == matches, "{}", modalias);
+        }
+    }
 }
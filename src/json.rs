@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! Just enough JSON for the machine readable outputs of the commands.
+
+/// `value` as a quoted and escaped JSON string
+pub fn string(value: &str) -> String {
+    let mut json = String::with_capacity(value.len() + 2);
+
+    json.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => json.push_str("\\\""),
+            '\\' => json.push_str("\\\\"),
+            '\n' => json.push_str("\\n"),
+            '\r' => json.push_str("\\r"),
+            '\t' => json.push_str("\\t"),
+            c if (c as u32) < 0x20 => json.push_str(&format!("\\u{:04x}", c as u32)),
+            c => json.push(c),
+        }
+    }
+    json.push('"');
+
+    json
+}
+
+/// An object from `(key, already encoded value)` pairs
+pub fn object(members: &[(&str, String)]) -> String {
+    let members: Vec<String> = members
+        .iter()
+        .map(|(key, value)| format!("{}: {}", string(key), value))
+        .collect();
+
+    format!("{{{}}}", members.join(", "))
+}
+
+/// An array of already encoded values
+pub fn array(values: &[String]) -> String {
+    format!("[{}]", values.join(", "))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_json() {
+        assert!(string("Microsoft® \"Mouse\"\n") == "\"Microsoft® \\\"Mouse\\\"\\n\"");
+        assert!(string("\u{1}") == "\"\\u0001\"");
+        assert!(
+            object(&[("name", string("a")), ("size", 3.to_string())])
+                == "{\"name\": \"a\", \"size\": 3}"
+        );
+        assert!(array(&[]) == "[]");
+        assert!(array(&[string("a"), String::from("null")]) == "[\"a\", null]");
+    }
+}
@@ -6,8 +6,18 @@ use log;
 use regex::Regex;
 
 pub mod bpf;
+pub mod control;
+pub mod datafile;
+pub mod event_transform;
 pub mod hidudev;
+pub mod json;
+pub mod metrics;
 pub mod modalias;
+pub mod rdesc;
+pub mod rdesc_patch;
+pub mod rodata;
+pub mod signature;
+pub mod sysfs;
 
 static DEFAULT_BPF_DIR: &str = "/usr/local/lib/firmware/hid/bpf";
 
@@ -46,6 +56,35 @@ enum Commands {
         /// Folder to look at for bpf objects
         #[arg(short, long)]
         bpfdir: Option<std::path::PathBuf>,
+        /// Set a const volatile global of the program before loading it,
+        /// e.g. --set logical_maximum=16383
+        #[arg(
+            long = "set",
+            value_name = "NAME=VALUE",
+            requires = "prog",
+            value_parser = rodata::parse_assignment
+        )]
+        rodata: Vec<(String, String)>,
+    },
+    /// Replace the BPF programs of a device with their current version,
+    /// without an unfiltered gap in between
+    Reload {
+        /// sysfs path to a device, e.g. /sys/bus/hid/devices/0003:045E:07A5.000B
+        devpath: std::path::PathBuf,
+        /// The BPF program to reload, all the ones of the device otherwise
+        prog: Option<String>,
+        /// Folder to look at for bpf objects
+        #[arg(short, long)]
+        bpfdir: Option<std::path::PathBuf>,
+        /// Set a const volatile global of the program before loading it,
+        /// e.g. --set logical_maximum=16383
+        #[arg(
+            long = "set",
+            value_name = "NAME=VALUE",
+            requires = "prog",
+            value_parser = rodata::parse_assignment
+        )]
+        rodata: Vec<(String, String)>,
     },
     /// A device is removed from the sysfs
     Remove {
@@ -58,8 +97,62 @@ enum Commands {
         #[arg(short, long)]
         bpfdir: Option<std::path::PathBuf>,
     },
+    /// Show which BPF programs would be attached to which device, without
+    /// attaching anything
+    Match {
+        /// The BPF program to check, all the installed ones otherwise
+        prog: Option<String>,
+        /// Folder to look at for bpf objects
+        #[arg(short, long)]
+        bpfdir: Option<std::path::PathBuf>,
+        /// Also show the devices and programs without any match
+        #[arg(long, default_value_t = false)]
+        all: bool,
+        /// Set a const volatile global of the program before loading it,
+        /// e.g. --set logical_maximum=16383
+        #[arg(
+            long = "set",
+            value_name = "NAME=VALUE",
+            requires = "prog",
+            value_parser = rodata::parse_assignment
+        )]
+        rodata: Vec<(String, String)>,
+    },
+    /// Compare the instructions and JIT size of the builds of the BPF
+    /// programs for each BPF instruction set
+    CompareIsa {
+        /// The BPF program to check, all the installed ones otherwise
+        prog: Option<String>,
+        /// Folder to look at for bpf objects
+        #[arg(short, long)]
+        bpfdir: Option<std::path::PathBuf>,
+    },
+    /// Serve add and remove requests from the control socket, so that
+    /// udev events don't set up libbpf each time
+    Daemon {},
+    /// Show the BPF programs currently attached, as JSON
+    Status {},
+    /// Remove the BPF programs left pinned for devices that are gone
+    Gc {},
+    /// Print the add and remove events handled by the daemon, as JSON
+    Monitor {},
+    /// Print the load metrics of the daemon and the counters of the
+    /// attached programs, in the OpenMetrics format
+    Metrics {
+        /// Write them in the Prometheus text format to this file instead,
+        /// for the textfile collector of node_exporter
+        #[arg(long, value_name = "PATH", conflicts_with = "listen")]
+        textfile: Option<std::path::PathBuf>,
+        /// Serve them over HTTP on this address, e.g. 127.0.0.1:9925
+        #[arg(long, value_name = "ADDRESS")]
+        listen: Option<String>,
+    },
     /// List available devices
-    ListDevices {},
+    ListDevices {
+        /// Print the devices as a JSON array
+        #[arg(long, default_value_t = false)]
+        json: bool,
+    },
 }
 
 fn default_bpf_dir() -> std::path::PathBuf {
@@ -71,10 +164,52 @@ fn default_bpf_dir() -> std::path::PathBuf {
     }
 }
 
+/// The daemon doesn't share our working directory
+fn absolute_path(path: &std::path::PathBuf) -> std::io::Result<std::path::PathBuf> {
+    Ok(std::env::current_dir()?.join(path))
+}
+
+fn add_device(
+    syspath: &std::path::PathBuf,
+    prog: Option<String>,
+    bpf_dir: std::path::PathBuf,
+    rodata: &[(String, String)],
+    hid_bpf_loader: &mut Option<bpf::HidBPF>,
+) -> std::io::Result<()> {
+    let dev = hidudev::HidUdev::from_syspath(syspath)?;
+
+    dev.load_bpf_from_directory(bpf_dir, prog, rodata, hid_bpf_loader)
+}
+
 fn cmd_add(
     syspath: &std::path::PathBuf,
     prog: Option<String>,
     bpfdir: Option<std::path::PathBuf>,
+    rodata: Vec<(String, String)>,
+) -> std::io::Result<()> {
+    let target_bpf_dir = match bpfdir {
+        Some(bpf_dir) => bpf_dir,
+        None => default_bpf_dir(),
+    };
+
+    let request = control::Request::Add {
+        devpath: absolute_path(syspath)?,
+        prog: prog.clone(),
+        bpfdir: absolute_path(&target_bpf_dir)?,
+        rodata: rodata.clone(),
+    };
+    if let Some(reply) = control::forward(std::path::Path::new(control::SOCKET_PATH), &request) {
+        return reply.map(|_| ());
+    }
+
+    add_device(syspath, prog, target_bpf_dir, &rodata, &mut None)
+}
+
+fn cmd_reload(
+    syspath: &std::path::PathBuf,
+    prog: Option<String>,
+    bpfdir: Option<std::path::PathBuf>,
+    rodata: Vec<(String, String)>,
 ) -> std::io::Result<()> {
     let dev = hidudev::HidUdev::from_syspath(syspath)?;
     let target_bpf_dir = match bpfdir {
@@ -82,7 +217,7 @@ fn cmd_add(
         None => default_bpf_dir(),
     };
 
-    dev.load_bpf_from_directory(target_bpf_dir, prog)
+    dev.reload_bpf_from_directory(target_bpf_dir, prog, &rodata)
 }
 
 fn sysname_from_syspath(syspath: &std::path::PathBuf) -> std::io::Result<String> {
@@ -97,7 +232,7 @@ fn sysname_from_syspath(syspath: &std::path::PathBuf) -> std::io::Result<String>
         .ok_or(std::io::Error::from_raw_os_error(libc::EINVAL))
 }
 
-fn cmd_remove(syspath: &std::path::PathBuf) -> std::io::Result<()> {
+fn remove_device(syspath: &std::path::PathBuf) -> std::io::Result<()> {
     let sysname = match hidudev::HidUdev::from_syspath(syspath) {
         Ok(dev) => dev.sysname(),
         Err(e) => match e.raw_os_error() {
@@ -108,6 +243,205 @@ fn cmd_remove(syspath: &std::path::PathBuf) -> std::io::Result<()> {
     bpf::remove_bpf_objects(&sysname)
 }
 
+fn cmd_remove(syspath: &std::path::PathBuf) -> std::io::Result<()> {
+    let request = control::Request::Remove {
+        devpath: absolute_path(syspath)?,
+    };
+    if let Some(reply) = control::forward(std::path::Path::new(control::SOCKET_PATH), &request) {
+        return reply.map(|_| ());
+    }
+
+    remove_device(syspath)
+}
+
+fn attached_objects_json() -> String {
+    let objects: Vec<String> = bpf::attached_objects()
+        .iter()
+        .map(|object| {
+            json::object(&[
+                ("device", json::string(&object.device)),
+                ("object", json::string(&object.object)),
+                ("hash", json::string(&format!("{:016x}", object.hash))),
+                ("hid", object.hid.to_string()),
+                ("links", object.links.to_string()),
+            ])
+        })
+        .collect();
+
+    json::array(&objects)
+}
+
+fn cmd_gc() -> std::io::Result<()> {
+    let report = bpf::collect_garbage()?;
+
+    log::info!(
+        "removed {} stale devices and {} interrupted reloads: {} pins, about {} KiB",
+        report.devices,
+        report.staging,
+        report.pins,
+        (report.bytes + 1023) / 1024,
+    );
+
+    Ok(())
+}
+
+fn cmd_daemon() -> std::io::Result<()> {
+    /* whatever was missed while we were not running */
+    if let Err(e) = cmd_gc() {
+        log::warn!("could not remove stale pins: {}", e);
+    }
+
+    /* libbpf and the attach program are only set up once */
+    let mut hid_bpf_loader = None;
+
+    control::serve(
+        std::path::Path::new(control::SOCKET_PATH),
+        |request| match request {
+            control::Request::Add {
+                devpath,
+                prog,
+                bpfdir,
+                rodata,
+            } => control::Reply::from(
+                add_device(
+                    devpath,
+                    prog.clone(),
+                    bpfdir.clone(),
+                    rodata,
+                    &mut hid_bpf_loader,
+                )
+                .map(|_| String::new()),
+            ),
+            control::Request::Remove { devpath } => {
+                control::Reply::from(remove_device(devpath).map(|_| String::new()))
+            }
+            control::Request::Status => control::Reply::ok(&attached_objects_json()),
+            control::Request::Metrics { format } => control::Reply::ok(&collect_metrics(*format)),
+            /* handled by the control socket itself */
+            control::Request::Events => control::Reply::ok(""),
+        },
+    )
+}
+
+fn cmd_status() -> std::io::Result<()> {
+    let status = match control::forward(
+        std::path::Path::new(control::SOCKET_PATH),
+        &control::Request::Status,
+    ) {
+        Some(reply) => reply?,
+        None => attached_objects_json(),
+    };
+
+    println!("{}", status);
+    Ok(())
+}
+
+fn cmd_monitor() -> std::io::Result<()> {
+    control::monitor(std::path::Path::new(control::SOCKET_PATH), |event| {
+        println!("{}", event)
+    })
+}
+
+fn collect_metrics(format: metrics::Format) -> String {
+    metrics::render(
+        format,
+        bpf::bpf_stats_enabled(),
+        &bpf::program_samples(),
+        &bpf::counter_samples(),
+    )
+}
+
+/// Only the daemon has loads to count, without it there are only the
+/// counters from bpffs
+fn fetch_metrics(format: metrics::Format) -> std::io::Result<String> {
+    match control::forward(
+        std::path::Path::new(control::SOCKET_PATH),
+        &control::Request::Metrics { format },
+    ) {
+        Some(reply) => reply,
+        None => Ok(collect_metrics(format)),
+    }
+}
+
+/// Answers any HTTP request with the metrics, collected on the spot
+fn serve_metrics(mut stream: std::net::TcpStream) -> std::io::Result<()> {
+    use std::io::{Read, Write};
+
+    stream.set_read_timeout(Some(std::time::Duration::from_secs(1)))?;
+
+    let mut request = [0u8; 4096];
+    let size = stream.read(&mut request)?;
+    let request = String::from_utf8_lossy(&request[..size]).to_ascii_lowercase();
+
+    let format = if request.contains("application/openmetrics-text") {
+        metrics::Format::OpenMetrics
+    } else {
+        metrics::Format::Text
+    };
+
+    let (status, content_type, body) = match fetch_metrics(format) {
+        Ok(body) => ("200 OK", format.content_type(), body),
+        Err(e) => (
+            "500 Internal Server Error",
+            "text/plain; charset=utf-8",
+            format!("{}\n", e),
+        ),
+    };
+
+    write!(
+        stream,
+        "HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+        status,
+        content_type,
+        body.len(),
+        body,
+    )
+}
+
+fn cmd_metrics(
+    textfile: Option<std::path::PathBuf>,
+    listen: Option<String>,
+) -> std::io::Result<()> {
+    if let Some(address) = listen {
+        let listener = std::net::TcpListener::bind(&address)?;
+        log::info!("serving metrics on http://{}/metrics", address);
+
+        for stream in listener.incoming() {
+            if let Err(e) = stream.and_then(serve_metrics) {
+                log::debug!("metrics request failed: {}", e);
+            }
+        }
+        return Ok(());
+    }
+
+    match textfile {
+        /* node_exporter must never see a partial file */
+        Some(path) => {
+            let metrics = fetch_metrics(metrics::Format::Text)?;
+            let mut tmp = path.clone().into_os_string();
+            tmp.push(format!(".tmp{}", std::process::id()));
+
+            std::fs::write(&tmp, metrics)
+                .and_then(|_| std::fs::rename(&tmp, &path))
+                .map_err(|e| {
+                    std::fs::remove_file(&tmp).ok();
+                    e
+                })
+        }
+        None => {
+            print!("{}", fetch_metrics(metrics::Format::OpenMetrics)?);
+            Ok(())
+        }
+    }
+}
+
+/// `.conf` files and the like sit next to the programs in the bpf dir
+fn is_bpf_program(name: &str) -> bool {
+    name.ends_with(".bpf.o")
+        || name.ends_with(&format!(".{}", rdesc_patch::EXTENSION))
+        || name.ends_with(&format!(".{}", event_transform::EXTENSION))
+}
+
 fn cmd_list_bpf_programs(bpfdir: Option<std::path::PathBuf>) -> std::io::Result<()> {
     let dir = bpfdir.or(Some(default_bpf_dir())).unwrap();
     println!(
@@ -118,7 +452,7 @@ fn cmd_list_bpf_programs(bpfdir: Option<std::path::PathBuf>) -> std::io::Result<
         if let Ok(entry) = entry {
             let fname = entry.file_name();
             let name = fname.to_string_lossy();
-            if name.ends_with(".bpf.o") {
+            if is_bpf_program(&name) {
                 println!(" {name}");
             }
         }
@@ -127,74 +461,178 @@ fn cmd_list_bpf_programs(bpfdir: Option<std::path::PathBuf>) -> std::io::Result<
     Ok(())
 }
 
-fn cmd_list_devices() -> std::io::Result<()> {
-    let re = Regex::new(r"hid:b([A-Z0-9]{4})g([A-Z0-9]{4})v0000([A-Z0-9]{4})p0000([A-Z0-9]{4})")
-        .unwrap();
+fn cmd_list_devices(json: bool) -> std::io::Result<()> {
+    let devices = sysfs::enumerate()?;
+
+    if json {
+        let devices: Vec<String> = devices.iter().map(|device| device.to_json()).collect();
+        println!("{}", json::array(&devices));
+        return Ok(());
+    }
 
     // We use this path because it looks nicer than the true device path in /sys/devices/pci...
-    for entry in std::fs::read_dir("/sys/bus/hid/devices")? {
-        let syspath = entry.unwrap().path();
-        let device = udev::Device::from_syspath(&syspath)?;
-        let name = device.property_value("HID_NAME").unwrap().to_str().unwrap();
-        if let Some(Some(matches)) = device
-            .property_value("MODALIAS")
-            .map(|modalias| re.captures(modalias.to_str().unwrap()))
-        {
-            let bus = matches.get(1).unwrap().as_str();
-            let group = matches.get(2).unwrap().as_str();
-            let vid = matches.get(3).unwrap().as_str();
-            let pid = matches.get(4).unwrap().as_str();
-
-            let bus = match bus {
-                "0001" => "BUS_PCI",
-                "0002" => "BUS_ISAPNP",
-                "0003" => "BUS_USB",
-                "0004" => "BUS_HIL",
-                "0005" => "BUS_BLUETOOTH",
-                "0006" => "BUS_VIRTUAL",
-                "0010" => "BUS_ISA",
-                "0011" => "BUS_I8042",
-                "0012" => "BUS_XTKBD",
-                "0013" => "BUS_RS232",
-                "0014" => "BUS_GAMEPORT",
-                "0015" => "BUS_PARPORT",
-                "0016" => "BUS_AMIGA",
-                "0017" => "BUS_ADB",
-                "0018" => "BUS_I2C",
-                "0019" => "BUS_HOST",
-                "001A" => "BUS_GSC",
-                "001B" => "BUS_ATARI",
-                "001C" => "BUS_SPI",
-                "001D" => "BUS_RMI",
-                "001E" => "BUS_CEC",
-                "001F" => "BUS_INTEL_ISHTP",
-                "0020" => "BUS_AMD_SFH",
-                _ => bus,
-            };
-
-            let group = match group {
-                "0001" => "HID_GROUP_GENERIC",
-                "0002" => "HID_GROUP_MULTITOUCH",
-                "0003" => "HID_GROUP_SENSOR_HUB",
-                "0004" => "HID_GROUP_MULTITOUCH_WIN_8",
-                "0100" => "HID_GROUP_RMI",
-                "0101" => "HID_GROUP_WACOM",
-                "0102" => "HID_GROUP_LOGITECH_DJ_DEVICE",
-                "0103" => "HID_GROUP_STEAM",
-                "0104" => "HID_GROUP_LOGITECH_27MHZ_DEVICE",
-                "0105" => "HID_GROUP_VIVALDI",
-                _ => group,
-            };
-
-            println!("{}", syspath.to_str().unwrap());
-            println!("  - name: {name}");
-            println!("  - device entry: HID_DEVICE({bus}, {group}, 0x{vid}, 0x{pid})");
+    for device in devices {
+        if let Some(entry) = device.device_entry() {
+            println!("{}", device.syspath.display());
+            println!("  - name: {}", device.name);
+            println!("  - device entry: {entry}");
             println!("");
         }
     }
     Ok(())
 }
 
+fn format_match_cell(cell: &bpf::MatchCell) -> String {
+    let result = match &cell.result {
+        bpf::MatchResult::NoModalias => return String::from("-"),
+        bpf::MatchResult::NoDeviceMatch => String::from("no"),
+        bpf::MatchResult::Probe(retval) => format!("probe {}", retval),
+        bpf::MatchResult::Match => String::from("MATCH"),
+        bpf::MatchResult::Error(_) => String::from("error"),
+    };
+
+    format!("{} {:.2}ms", result, cell.duration.as_secs_f64() * 1000.0)
+}
+
+/// `prog` in `bpfdir`, or all the programs installed there
+fn installed_programs(
+    prog: Option<String>,
+    bpfdir: Option<std::path::PathBuf>,
+) -> std::io::Result<Vec<std::path::PathBuf>> {
+    let dir = bpfdir.unwrap_or_else(default_bpf_dir);
+
+    let mut paths: Vec<std::path::PathBuf> = match prog {
+        Some(prog) => vec![dir.join(prog)],
+        None => std::fs::read_dir(&dir)?
+            .flatten()
+            .filter(|entry| is_bpf_program(&entry.file_name().to_string_lossy()))
+            .map(|entry| entry.path())
+            .collect(),
+    };
+    paths.sort();
+
+    Ok(paths)
+}
+
+fn cmd_match(
+    prog: Option<String>,
+    bpfdir: Option<std::path::PathBuf>,
+    all: bool,
+    rodata: Vec<(String, String)>,
+) -> std::io::Result<()> {
+    let paths = installed_programs(prog, bpfdir)?;
+
+    let mut devices = Vec::new();
+    let mut names = Vec::new();
+    for device in sysfs::enumerate()? {
+        match modalias::Modalias::from_str(&device.modalias) {
+            Ok(modalias) => {
+                devices.push(hidudev::DeviceSnapshot::new(
+                    &device.sysname,
+                    modalias,
+                    device.rdesc,
+                )?);
+                names.push(device.name);
+            }
+            Err(e) => log::debug!("skipping {}: {}", device.sysname, e),
+        }
+    }
+
+    for device in devices.iter_mut() {
+        device.scan_signatures(&paths);
+    }
+
+    let rows = bpf::match_objects(&paths, &devices, &rodata);
+    let matched = |result: &bpf::MatchResult| *result != bpf::MatchResult::NoModalias;
+
+    /* one column per object, the devices are too many and too long to fit */
+    let rows: Vec<&bpf::MatchRow> = rows
+        .iter()
+        .filter(|row| all || row.cells.iter().any(|cell| matched(&cell.result)))
+        .collect();
+
+    for (idx, row) in rows.iter().enumerate() {
+        println!(
+            "[{}] {} (loaded in {:.2}ms)",
+            idx,
+            row.path.file_name().unwrap().to_string_lossy(),
+            row.load_duration.as_secs_f64() * 1000.0,
+        );
+        for (cell, device) in row.cells.iter().zip(devices.iter()) {
+            if let bpf::MatchResult::Error(e) = &cell.result {
+                println!("      {}: {}", device.sysname(), e);
+            }
+        }
+    }
+    println!("");
+
+    print!("{:<24}", "device");
+    for idx in 0..rows.len() {
+        print!(" {:>16}", format!("[{}]", idx));
+    }
+    println!("");
+
+    for (device_idx, device) in devices.iter().enumerate() {
+        let cells: Vec<&bpf::MatchCell> = rows.iter().map(|row| &row.cells[device_idx]).collect();
+        if !all && !cells.iter().any(|cell| matched(&cell.result)) {
+            continue;
+        }
+
+        print!("{:<24}", device.sysname());
+        for cell in cells {
+            print!(" {:>16}", format_match_cell(cell));
+        }
+        println!("  {}", names[device_idx]);
+    }
+
+    Ok(())
+}
+
+fn cmd_compare_isa(
+    prog: Option<String>,
+    bpfdir: Option<std::path::PathBuf>,
+) -> std::io::Result<()> {
+    /* data files use the variants of their generic object */
+    let paths: Vec<std::path::PathBuf> = installed_programs(prog, bpfdir)?
+        .into_iter()
+        .filter(|path| path.to_string_lossy().ends_with(".bpf.o"))
+        .collect();
+
+    for path in paths {
+        println!("{}", path.file_name().unwrap().to_string_lossy());
+
+        let variants = bpf::isa_variant_sizes(&path);
+        let default = variants
+            .first()
+            .and_then(|(_, size)| size.as_ref().ok())
+            .map(|size| (size.insns, size.jited));
+        let diff = |value: u64, reference: Option<u64>| match reference {
+            Some(reference) if reference > 0 => format!(
+                " ({:+.1}%)",
+                (value as f64 - reference as f64) * 100.0 / reference as f64
+            ),
+            _ => String::new(),
+        };
+
+        for (isa, size) in variants {
+            let isa = isa.map_or(String::from("default"), |isa| format!("v{}", isa));
+            match size {
+                Ok(size) => println!(
+                    "  {:<8} {:>6} insns{:<10} {:>7} bytes JITed{}",
+                    isa,
+                    size.insns,
+                    diff(size.insns, default.map(|(insns, _)| insns)),
+                    size.jited,
+                    diff(size.jited, default.map(|(_, jited)| jited)),
+                ),
+                Err(e) => println!("  {:<8} {}", isa, e),
+            }
+        }
+    }
+
+    Ok(())
+}
+
 fn main() -> std::io::Result<()> {
     let cli = Cli::parse();
 
@@ -222,10 +660,29 @@ fn main() -> std::io::Result<()> {
             devpath,
             prog,
             bpfdir,
-        } => cmd_add(&devpath, prog, bpfdir),
+            rodata,
+        } => cmd_add(&devpath, prog, bpfdir, rodata),
+        Commands::Reload {
+            devpath,
+            prog,
+            bpfdir,
+            rodata,
+        } => cmd_reload(&devpath, prog, bpfdir, rodata),
         Commands::Remove { devpath } => cmd_remove(&devpath),
         Commands::ListBpfPrograms { bpfdir } => cmd_list_bpf_programs(bpfdir),
-        Commands::ListDevices {} => cmd_list_devices(),
+        Commands::Match {
+            prog,
+            bpfdir,
+            all,
+            rodata,
+        } => cmd_match(prog, bpfdir, all, rodata),
+        Commands::CompareIsa { prog, bpfdir } => cmd_compare_isa(prog, bpfdir),
+        Commands::Daemon {} => cmd_daemon(),
+        Commands::Status {} => cmd_status(),
+        Commands::Gc {} => cmd_gc(),
+        Commands::Monitor {} => cmd_monitor(),
+        Commands::Metrics { textfile, listen } => cmd_metrics(textfile, listen),
+        Commands::ListDevices { json } => cmd_list_devices(json),
     }
 }
 
@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! Metrics for Prometheus, in the OpenMetrics text format.
+//!
+//! Loads are counted by the process doing them, which is only worth
+//! scraping for `udev-hid-bpf daemon`. The counters of the programs and of
+//! their maps are read from bpffs when the metrics are asked for, so
+//! nothing is collected while nobody scrapes.
+
+use std::collections::BTreeMap;
+use std::fmt::Write;
+use std::time::Duration;
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Format {
+    /// what Prometheus asks for when scraping
+    OpenMetrics,
+    /// the older Prometheus text format, read by the textfile collector of
+    /// node_exporter
+    Text,
+}
+
+impl Format {
+    pub fn name(&self) -> &'static str {
+        match self {
+            Format::OpenMetrics => "openmetrics",
+            Format::Text => "text",
+        }
+    }
+
+    pub fn from_name(name: &str) -> Option<Self> {
+        match name {
+            "openmetrics" => Some(Format::OpenMetrics),
+            "text" => Some(Format::Text),
+            _ => None,
+        }
+    }
+
+    pub fn content_type(&self) -> &'static str {
+        match self {
+            Format::OpenMetrics => "application/openmetrics-text; version=1.0.0; charset=utf-8",
+            Format::Text => "text/plain; version=0.0.4; charset=utf-8",
+        }
+    }
+}
+
+/* in seconds, from a cached tiny object to a big one on a slow machine */
+const LATENCY_BUCKETS: [f64; 10] = [0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0];
+
+#[derive(Debug, Clone, PartialEq)]
+struct Histogram {
+    /// per bucket of [`LATENCY_BUCKETS`], the last one is `+Inf`
+    counts: [u64; LATENCY_BUCKETS.len() + 1],
+    sum: f64,
+}
+
+impl Histogram {
+    const fn new() -> Self {
+        Histogram {
+            counts: [0; LATENCY_BUCKETS.len() + 1],
+            sum: 0.0,
+        }
+    }
+
+    fn observe(&mut self, duration: Duration) {
+        let seconds = duration.as_secs_f64();
+        let bucket = LATENCY_BUCKETS
+            .iter()
+            .position(|bound| seconds <= *bound)
+            .unwrap_or(LATENCY_BUCKETS.len());
+
+        self.counts[bucket] += 1;
+        self.sum += seconds;
+    }
+}
+
+/// What [`crate::bpf::HidBPF::load_programs()`] did with an object
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum LoadResult {
+    Attached,
+    /// `probe` refused the device
+    NotMatched,
+    Failed,
+    /// not loaded, the report descriptor didn't match the data file
+    NoDeviceMatch,
+    /// not loaded, `probe` already refused the same device
+    ProbeCached,
+}
+
+impl LoadResult {
+    fn label(&self) -> &'static str {
+        match self {
+            LoadResult::Attached => "attached",
+            LoadResult::NotMatched => "not_matched",
+            LoadResult::Failed => "failed",
+            LoadResult::NoDeviceMatch => "no_device_match",
+            LoadResult::ProbeCached => "probe_cached",
+        }
+    }
+}
+
+struct Registry {
+    /// (object, result) to number of loads
+    loads: BTreeMap<(String, LoadResult), u64>,
+    load_duration: Histogram,
+    verify_duration: Histogram,
+}
+
+static REGISTRY: std::sync::Mutex<Registry> = std::sync::Mutex::new(Registry {
+    loads: BTreeMap::new(),
+    load_duration: Histogram::new(),
+    verify_duration: Histogram::new(),
+});
+
+fn registry() -> std::sync::MutexGuard<'static, Registry> {
+    REGISTRY.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+/// `object` is the `.bpf.o` or data file name, `duration` covers the
+/// open, load, probe and attach
+pub fn record_load(object: &str, result: LoadResult, duration: Duration) {
+    let mut registry = registry();
+
+    *registry
+        .loads
+        .entry((String::from(object), result))
+        .or_default() += 1;
+    registry.load_duration.observe(duration);
+}
+
+/// An object that was not loaded at all, it doesn't count in the load
+/// durations
+pub fn record_skip(object: &str, result: LoadResult) {
+    *registry()
+        .loads
+        .entry((String::from(object), result))
+        .or_default() += 1;
+}
+
+/// `duration` of the load of an object in the kernel, mostly the verifier
+pub fn record_verify(duration: Duration) {
+    registry().verify_duration.observe(duration);
+}
+
+/// The run counters of a program attached to a device. The kernel only
+/// updates them with the `kernel.bpf_stats_enabled` sysctl set, they are
+/// not rendered without it.
+#[derive(Debug, Clone, PartialEq)]
+pub struct ProgramSample {
+    pub device: String,
+    pub object: String,
+    pub program: String,
+    pub run_count: u64,
+    pub run_time_ns: u64,
+}
+
+/// A `u64` field of the values of a `*_counters` map pinned for a device,
+/// summed over all its entries
+#[derive(Debug, Clone, PartialEq)]
+pub struct CounterSample {
+    pub device: String,
+    pub object: String,
+    pub map: String,
+    pub field: String,
+    pub value: u64,
+}
+
+struct Exposition {
+    format: Format,
+    text: String,
+}
+
+impl Exposition {
+    fn family(&mut self, name: &str, kind: &str, unit: Option<&str>, help: &str) {
+        /* OpenMetrics names the family of `foo_total` `foo`, the text format doesn't */
+        let name = match (self.format, kind) {
+            (Format::Text, "counter") => format!("{}_total", name),
+            _ => String::from(name),
+        };
+
+        writeln!(self.text, "# TYPE {} {}", name, kind).unwrap();
+        if let (Format::OpenMetrics, Some(unit)) = (self.format, unit) {
+            writeln!(self.text, "# UNIT {} {}", name, unit).unwrap();
+        }
+        writeln!(
+            self.text,
+            "# HELP {} {}",
+            name,
+            help.replace('\\', "\\\\").replace('\n', "\\n")
+        )
+        .unwrap();
+    }
+
+    fn sample(&mut self, name: &str, labels: &[(&str, &str)], value: impl std::fmt::Display) {
+        let labels: Vec<String> = labels
+            .iter()
+            .map(|(label, value)| {
+                format!(
+                    "{}=\"{}\"",
+                    label,
+                    value
+                        .replace('\\', "\\\\")
+                        .replace('"', "\\\"")
+                        .replace('\n', "\\n")
+                )
+            })
+            .collect();
+
+        if labels.is_empty() {
+            writeln!(self.text, "{} {}", name, value).unwrap();
+        } else {
+            writeln!(self.text, "{}{{{}}} {}", name, labels.join(","), value).unwrap();
+        }
+    }
+
+    fn histogram(&mut self, name: &str, histogram: &Histogram) {
+        let mut cumulative = 0;
+
+        for (idx, count) in histogram.counts.iter().enumerate() {
+            cumulative += count;
+            let bound = LATENCY_BUCKETS
+                .get(idx)
+                .map_or(String::from("+Inf"), |bound| format!("{:?}", bound));
+            self.sample(&format!("{}_bucket", name), &[("le", &bound)], cumulative);
+        }
+        self.sample(&format!("{}_count", name), &[], cumulative);
+        self.sample(
+            &format!("{}_sum", name),
+            &[],
+            format!("{:?}", histogram.sum),
+        );
+    }
+}
+
+/// The whole exposition: the loads counted by this process and the
+/// counters read from bpffs. `bpf_stats_enabled` is the value of the
+/// `kernel.bpf_stats_enabled` sysctl.
+pub fn render(
+    format: Format,
+    bpf_stats_enabled: bool,
+    programs: &[ProgramSample],
+    counters: &[CounterSample],
+) -> String {
+    let mut out = Exposition {
+        format,
+        text: String::new(),
+    };
+
+    {
+        let registry = registry();
+
+        out.family(
+            "hid_bpf_loads",
+            "counter",
+            None,
+            "Objects loaded for a device, by result",
+        );
+        for ((object, result), count) in registry.loads.iter() {
+            out.sample(
+                "hid_bpf_loads_total",
+                &[("object", object), ("result", result.label())],
+                count,
+            );
+        }
+
+        out.family(
+            "hid_bpf_load_duration_seconds",
+            "histogram",
+            Some("seconds"),
+            "Time to open, load, probe and attach an object",
+        );
+        out.histogram("hid_bpf_load_duration_seconds", &registry.load_duration);
+
+        out.family(
+            "hid_bpf_verify_duration_seconds",
+            "histogram",
+            Some("seconds"),
+            "Time to load an object in the kernel, including the verifier",
+        );
+        out.histogram("hid_bpf_verify_duration_seconds", &registry.verify_duration);
+    }
+
+    out.family(
+        "hid_bpf_stats_enabled",
+        "gauge",
+        None,
+        "Whether the kernel counts the program runs, the kernel.bpf_stats_enabled sysctl",
+    );
+    out.sample("hid_bpf_stats_enabled", &[], bpf_stats_enabled as u8);
+
+    /* the counters would stay at 0 and look like idle programs */
+    if bpf_stats_enabled {
+        out.family(
+            "hid_bpf_program_runs",
+            "counter",
+            None,
+            "Runs of an attached program, needs kernel.bpf_stats_enabled",
+        );
+        for program in programs {
+            out.sample(
+                "hid_bpf_program_runs_total",
+                &[
+                    ("device", &program.device),
+                    ("object", &program.object),
+                    ("program", &program.program),
+                ],
+                program.run_count,
+            );
+        }
+
+        out.family(
+            "hid_bpf_program_run_seconds",
+            "counter",
+            Some("seconds"),
+            "Time spent in an attached program, needs kernel.bpf_stats_enabled",
+        );
+        for program in programs {
+            out.sample(
+                "hid_bpf_program_run_seconds_total",
+                &[
+                    ("device", &program.device),
+                    ("object", &program.object),
+                    ("program", &program.program),
+                ],
+                format!("{:?}", program.run_time_ns as f64 / 1e9),
+            );
+        }
+    }
+
+    out.family(
+        "hid_bpf_map_counter",
+        "counter",
+        None,
+        "A field of the values of a *_counters map of an object, summed over its entries",
+    );
+    for counter in counters {
+        out.sample(
+            "hid_bpf_map_counter_total",
+            &[
+                ("device", &counter.device),
+                ("object", &counter.object),
+                ("map", &counter.map),
+                ("field", &counter.field),
+            ],
+            counter.value,
+        );
+    }
+
+    if format == Format::OpenMetrics {
+        out.text.push_str("# EOF\n");
+    }
+    out.text
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_histogram() {
+        let mut histogram = Histogram::new();
+        histogram.observe(Duration::from_micros(500));
+        histogram.observe(Duration::from_millis(1));
+        histogram.observe(Duration::from_millis(30));
+        histogram.observe(Duration::from_secs(3));
+
+        assert!(histogram.counts[0] == 2);
+        assert!(histogram.counts[5] == 1);
+        assert!(histogram.counts[LATENCY_BUCKETS.len()] == 1);
+        assert!((histogram.sum - 3.0315).abs() < 1e-9);
+
+        let mut out = Exposition {
+            format: Format::OpenMetrics,
+            text: String::new(),
+        };
+        out.histogram("latency", &histogram);
+        assert!(out.text.starts_with("latency_bucket{le=\"0.001\"} 2\n"));
+        assert!(out.text.contains("latency_bucket{le=\"0.05\"} 3\n"));
+        assert!(out.text.contains("latency_bucket{le=\"1.0\"} 3\n"));
+        assert!(out
+            .text
+            .contains("latency_bucket{le=\"+Inf\"} 4\nlatency_count 4\n"));
+    }
+
+    #[test]
+    fn test_render() {
+        record_load(
+            "10-mouse.bpf.o",
+            LoadResult::Attached,
+            Duration::from_millis(4),
+        );
+        record_load(
+            "10-mouse.bpf.o",
+            LoadResult::Attached,
+            Duration::from_millis(6),
+        );
+        record_load(
+            "10-mouse.bpf.o",
+            LoadResult::Failed,
+            Duration::from_millis(2),
+        );
+        record_skip("10-mouse.bpf.o", LoadResult::ProbeCached);
+        record_verify(Duration::from_millis(3));
+
+        let samples = [ProgramSample {
+            device: String::from("0003_045E_07A5_0001"),
+            object: String::from("10-mouse_bpf"),
+            program: String::from("fix_rdesc"),
+            run_count: 12,
+            run_time_ns: 1_500_000_000,
+        }];
+        let counters = [CounterSample {
+            device: String::from("0003_045E_07A5_0001"),
+            object: String::from("generic-report-dedup_bpf"),
+            map: String::from("dedup_counters"),
+            field: String::from("suppressed \"all\""),
+            value: 7,
+        }];
+        let text = render(Format::OpenMetrics, true, &samples, &counters);
+
+        assert!(text.starts_with("# TYPE hid_bpf_loads counter\n"));
+        assert!(text.ends_with("\n# EOF\n"));
+        assert!(text.contains(
+            "hid_bpf_loads_total{object=\"10-mouse.bpf.o\",result=\"attached\"} 2\n\
+             hid_bpf_loads_total{object=\"10-mouse.bpf.o\",result=\"failed\"} 1\n\
+             hid_bpf_loads_total{object=\"10-mouse.bpf.o\",result=\"probe_cached\"} 1\n"
+        ));
+        assert!(text.contains("hid_bpf_load_duration_seconds_count 3\n"));
+        assert!(text.contains("hid_bpf_stats_enabled 1\n"));
+        assert!(text.contains("# UNIT hid_bpf_verify_duration_seconds seconds\n"));
+        assert!(text.contains("hid_bpf_verify_duration_seconds_count 1\n"));
+        assert!(text.contains(
+            "hid_bpf_program_runs_total{device=\"0003_045E_07A5_0001\",object=\"10-mouse_bpf\",program=\"fix_rdesc\"} 12\n"
+        ));
+        assert!(text.contains("program=\"fix_rdesc\"} 1.5\n"));
+        assert!(text.contains("field=\"suppressed \\\"all\\\"\"} 7\n"));
+
+        let text = render(Format::Text, false, &samples, &counters);
+        assert!(text.starts_with("# TYPE hid_bpf_loads_total counter\n"));
+        assert!(text.contains("hid_bpf_stats_enabled 0\n"));
+        assert!(!text.contains("hid_bpf_program_run"));
+        assert!(text.contains("hid_bpf_map_counter_total{"));
+        assert!(text.contains("# TYPE hid_bpf_load_duration_seconds histogram\n"));
+        assert!(!text.contains("# UNIT") && !text.contains("# EOF"));
+    }
+}
@@ -197,7 +197,8 @@ impl std::fmt::LowerHex for Group {
 
 pub struct Metadata<'m> {
     btf: &'m libbpf_rs::btf::Btf<'m>,
-    types: BtfTypes::Union<'m>,
+    /// one per `HID_BPF_CONFIG`, the objects linked by build.rs have several
+    types: Vec<BtfTypes::Union<'m>>,
 }
 
 impl<'m> Metadata<'m> {
@@ -206,6 +207,7 @@ impl<'m> Metadata<'m> {
         'a: 'm,
     {
         let datasec = btf.type_by_name::<libbpf_rs::btf::types::DataSec>(".hid_bpf_config")?;
+        let mut types = Vec::new();
 
         for var_sec_info in datasec.iter() {
             log::debug!(target:"HID-BPF metadata", "{:?}", var_sec_info);
@@ -217,25 +219,70 @@ impl<'m> Metadata<'m> {
             log::debug!(target:"HID-BPF metadata", "  -> {:?} / {:?}", var, var_type);
 
             if let Ok(hb_union) = BtfTypes::Union::try_from(var_type) {
-                return Some(Metadata {
-                    btf,
-                    types: hb_union,
-                });
+                types.push(hb_union);
             }
         }
 
-        None
+        if types.is_empty() {
+            return None;
+        }
+
+        Some(Metadata { btf, types })
     }
 
     pub fn modaliases(&self) -> impl Iterator<Item = Modalias> + '_ {
         /* parse the HID_BPF config section */
         self.types
             .iter()
-            .enumerate()
-            .filter_map(|(_, e)| Modalias::from_btf_type_id(&self.btf, e))
+            .flat_map(|hb_union| hb_union.iter())
+            .filter_map(|e| Modalias::from_btf_type_id(&self.btf, e))
+    }
+
+    /// The `HID_SIGNATURE()` entries: the index in the `hid_bpf_signatures`
+    /// map where the loader writes the offset of the bytes, and the bytes.
+    pub fn signatures(&self) -> impl Iterator<Item = (u32, Vec<u8>)> + '_ {
+        self.types
+            .iter()
+            .flat_map(|hb_union| hb_union.iter())
+            .filter_map(|e| signature_from_btf_type_id(&self.btf, e))
     }
 }
 
+/// A `HID_SIGNATURE()` is a struct of pointers to arrays like
+/// `HID_DEVICE()`: the size of `signature` is the index of the entry, the
+/// size of `bN` is the byte `N` of the sequence.
+fn signature_from_btf_type_id(
+    btf: &libbpf_rs::btf::Btf,
+    union_member: BtfTypes::UnionMember,
+) -> Option<(u32, Vec<u8>)> {
+    let descr = btf.type_by_id::<BtfTypes::Struct>(union_member.ty)?;
+    let mut index = None;
+    let mut bytes = Vec::new();
+
+    for member in descr.iter() {
+        let member_name = member.name?.to_str()?;
+        let capacity = match btf
+            .type_by_id::<BtfTypes::Ptr>(member.ty)
+            .map(|pointer| BtfTypes::Array::try_from(pointer.referenced_type()))
+        {
+            Some(Ok(array)) => array.capacity(),
+            _ => continue,
+        };
+
+        if member_name == "signature" {
+            index = Some(u32::try_from(capacity).ok()?);
+        } else if let Some(position) = member_name
+            .strip_prefix('b')
+            .and_then(|n| n.parse::<usize>().ok())
+        {
+            bytes.push((position, u8::try_from(capacity).ok()?));
+        }
+    }
+
+    bytes.sort();
+    Some((index?, bytes.into_iter().map(|(_, byte)| byte).collect()))
+}
+
 #[derive(Debug, Hash, Eq, PartialEq)]
 pub struct Modalias {
     pub bus: Bus,
@@ -245,7 +292,7 @@ pub struct Modalias {
 }
 
 impl Modalias {
-    fn new() -> Modalias {
+    pub fn new() -> Modalias {
         Modalias {
             bus: Bus::Any,
             group: Group::Any,
@@ -260,6 +307,7 @@ impl Modalias {
     ) -> Option<Modalias> {
         let device_descr = btf.type_by_id::<BtfTypes::Struct>(union_member.ty)?;
         let mut modalias = Modalias::new();
+        let mut is_device = false;
 
         for member in device_descr.iter() {
             let member_name = String::from(member.name.unwrap().to_str().unwrap());
@@ -269,7 +317,10 @@ impl Modalias {
                 .map(|pointer| BtfTypes::Array::try_from(pointer.referenced_type()))
             {
                 match member_name.as_str() {
-                    "bus" => modalias.bus = Bus::try_from(array.capacity()).unwrap(),
+                    "bus" => {
+                        modalias.bus = Bus::try_from(array.capacity()).unwrap();
+                        is_device = true;
+                    }
                     "group" => modalias.group = Group::try_from(array.capacity()).unwrap(),
                     "vid" => modalias.vid = u32::try_from(array.capacity()).unwrap(),
                     "pid" => modalias.pid = u32::try_from(array.capacity()).unwrap(),
@@ -278,61 +329,78 @@ impl Modalias {
                 log::debug!(target:"HID-BPF metadata", "      -> {:?}: {:#06X}", member_name, array.capacity());
             }
         }
-        Some(modalias)
+
+        /* the HID_SIGNATURE() entries share the union */
+        is_device.then_some(modalias)
     }
 
     pub fn from_str(modalias: &str) -> std::io::Result<Self> {
-        /* strip out the "hid:" prefix from the modalias */
-        let modalias = modalias.trim_start_matches("hid:");
-
-        if modalias.len() != 28 {
-            return Err(std::io::Error::new(
-                std::io::ErrorKind::InvalidData,
-                format!("Invalid modalias '{}'", modalias),
-            ));
-        }
-
-        let econvert = |_| {
+        let einval = || {
             std::io::Error::new(
                 std::io::ErrorKind::InvalidData,
                 format!("Invalid modalias '{}'", modalias),
             )
         };
 
-        let bus =
-            Bus::try_from(usize::from_str_radix(&modalias[1..5], 16).map_err(econvert)?).unwrap();
-        let group = Group::try_from(usize::from_str_radix(&modalias[6..10], 16).map_err(econvert)?)
-            .unwrap();
-        let vid = u32::from_str_radix(&modalias[11..19], 16).map_err(econvert)?;
-        let pid = u32::from_str_radix(&modalias[20..28], 16).map_err(econvert)?;
+        let (bus, group, vid, pid) = parse_fields(modalias).ok_or_else(einval)?;
 
         Ok(Self {
-            bus,
-            group,
+            bus: Bus::try_from(bus).map_err(|_| einval())?,
+            group: Group::try_from(group).map_err(|_| einval())?,
             vid,
             pid,
         })
     }
 
+    /// Whether `device` is covered by this modalias, as the hwdb would
+    /// match it: `Any` bus or group and a zero vendor or product match
+    /// everything.
+    pub fn matches(&self, device: &Modalias) -> bool {
+        (self.bus == Bus::Any || self.bus == device.bus)
+            && (self.group == Group::Any || self.group == device.group)
+            && (self.vid == 0 || self.vid == device.vid)
+            && (self.pid == 0 || self.pid == device.pid)
+    }
+
     pub fn from_static_str(modalias: &'static str) -> std::io::Result<Self> {
         Self::from_str(&modalias)
     }
 
     pub fn from_udev_device(udev_device: &udev::Device) -> std::io::Result<Self> {
-        let modalias = udev_device.property_value("MODALIAS");
+        let modalias = udev_device
+            .property_value("MODALIAS")
+            .and_then(|modalias| modalias.to_str())
+            .ok_or(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                format!("{} has no valid MODALIAS", udev_device.syspath().display()),
+            ))?;
 
-        let modalias = match modalias {
-            Some(data) => data,
-            _ => std::ffi::OsStr::new("hid:empty"), //panic!("modalias is empty"),
-        };
+        Self::from_str(modalias)
+    }
+}
 
-        let modalias = match modalias.to_str() {
-            Some(data) => data,
-            _ => panic!("modalias problem"),
-        };
+/// Splits a `[hid:]bXXXXgXXXXvXXXXXXXXpXXXXXXXX` modalias in its bus,
+/// group, vendor and product, without allocating nor knowing the bus and
+/// group values.
+pub fn parse_fields(modalias: &str) -> Option<(usize, usize, u32, u32)> {
+    let m = modalias.strip_prefix("hid:").unwrap_or(modalias).as_bytes();
 
-        Self::from_str(modalias)
+    if m.len() != 28 || m[0] != b'b' || m[5] != b'g' || m[10] != b'v' || m[19] != b'p' {
+        return None;
     }
+
+    let hex = |range: std::ops::Range<usize>| {
+        m[range].iter().try_fold(0u32, |value, c| {
+            Some(value << 4 | (*c as char).to_digit(16)?)
+        })
+    };
+
+    Some((
+        hex(1..5)? as usize,
+        hex(6..10)? as usize,
+        hex(11..19)?,
+        hex(20..28)?,
+    ))
 }
 
 impl From<Modalias> for String {
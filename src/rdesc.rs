@@ -0,0 +1,686 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! A HID report descriptor parser, giving the layout of the fields of
+//! each report.
+
+use std::cell::RefCell;
+use std::collections::{HashMap, VecDeque};
+use std::rc::Rc;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub enum ReportType {
+    Input,
+    Output,
+    Feature,
+}
+
+impl ReportType {
+    pub fn name(&self) -> &'static str {
+        match self {
+            ReportType::Input => "input",
+            ReportType::Output => "output",
+            ReportType::Feature => "feature",
+        }
+    }
+}
+
+/// One field of a report, i.e. one of the `Report Count` elements of a
+/// main item.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Field {
+    pub report_type: ReportType,
+    /// 0 if the descriptor doesn't use report IDs
+    pub report_id: u8,
+    /// from the start of the report, report ID included
+    pub bit_offset: usize,
+    pub bit_size: usize,
+    /// usage page in the high 16 bits, 0 if there is no usage
+    pub usage: u32,
+    pub logical_minimum: i32,
+    pub logical_maximum: i32,
+    /// the data of the main item: Constant, Variable, Relative...
+    pub flags: u32,
+    /// index of the innermost collection in [`ReportDescriptor::collections`]
+    pub collection: Option<usize>,
+}
+
+impl Field {
+    pub fn is_constant(&self) -> bool {
+        self.flags & 0x1 != 0
+    }
+
+    pub fn is_variable(&self) -> bool {
+        self.flags & 0x2 != 0
+    }
+
+    pub fn is_relative(&self) -> bool {
+        self.flags & 0x4 != 0
+    }
+
+    pub fn is_signed(&self) -> bool {
+        self.logical_minimum < 0
+    }
+}
+
+pub const COLLECTION_APPLICATION: u8 = 0x01;
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Collection {
+    /// Physical, Application, Logical...
+    pub kind: u8,
+    pub usage: u32,
+    pub parent: Option<usize>,
+}
+
+#[derive(Debug, Default)]
+pub struct ReportDescriptor {
+    pub collections: Vec<Collection>,
+    pub fields: Vec<Field>,
+    /// whether the reports start with a report ID
+    pub numbered: bool,
+}
+
+#[derive(Debug, Clone, Default)]
+struct Globals {
+    usage_page: u32,
+    logical_minimum: i32,
+    logical_maximum: i32,
+    report_size: usize,
+    report_count: usize,
+    report_id: u8,
+}
+
+fn invalid(offset: usize, msg: &str) -> std::io::Error {
+    std::io::Error::new(
+        std::io::ErrorKind::InvalidData,
+        format!("report descriptor offset {}: {}", offset, msg),
+    )
+}
+
+/* a sane upper bound, the kernel limits reports to 16 KiB */
+const MAX_REPORT_BITS: usize = 16384 * 8;
+
+/// The layouts kept by [`ReportDescriptor::cached()`]
+const CACHE_SIZE: usize = 8;
+
+impl ReportDescriptor {
+    pub fn parse(rdesc: &[u8]) -> std::io::Result<Self> {
+        let mut descriptor = ReportDescriptor::default();
+        let mut globals = Globals::default();
+        let mut stack = Vec::new();
+        let mut collections: Vec<usize> = Vec::new();
+        let mut usages: Vec<u32> = Vec::new();
+        let mut usage_minimum = None;
+        let mut offsets: HashMap<(ReportType, u8), usize> = HashMap::new();
+        let mut idx = 0;
+
+        while idx < rdesc.len() {
+            let prefix = rdesc[idx];
+
+            /* long items have their size in the next byte, and no known use */
+            if prefix == 0xfe {
+                let size = *rdesc.get(idx + 1).ok_or(invalid(idx, "truncated item"))?;
+                idx += 3 + size as usize;
+                continue;
+            }
+
+            let size = match prefix & 0x3 {
+                3 => 4,
+                size => size as usize,
+            };
+            let bytes = rdesc
+                .get(idx + 1..idx + 1 + size)
+                .ok_or(invalid(idx, "truncated item"))?;
+            let value = bytes
+                .iter()
+                .rev()
+                .fold(0u32, |value, byte| (value << 8) | *byte as u32);
+            let signed = match size {
+                1 => value as u8 as i8 as i32,
+                2 => value as u16 as i16 as i32,
+                _ => value as i32,
+            };
+            /* usages of 4 bytes come with their own usage page */
+            let usage = if size == 4 {
+                value
+            } else {
+                (globals.usage_page << 16) | value
+            };
+
+            match prefix & 0xfc {
+                /* main items */
+                tag @ (0x80 | 0x90 | 0xb0) => {
+                    let report_type = match tag {
+                        0x80 => ReportType::Input,
+                        0x90 => ReportType::Output,
+                        _ => ReportType::Feature,
+                    };
+                    let report_id = globals.report_id;
+                    let offset = offsets
+                        .entry((report_type, report_id))
+                        .or_insert(if report_id != 0 { 8 } else { 0 });
+
+                    for i in 0..globals.report_count {
+                        let usage = if value & 0x2 != 0 {
+                            usages.get(i).or(usages.last()).copied().unwrap_or(0)
+                        } else {
+                            /* array: the field is an index in the usages */
+                            usages.first().copied().unwrap_or(0)
+                        };
+
+                        descriptor.fields.push(Field {
+                            report_type,
+                            report_id,
+                            bit_offset: *offset,
+                            bit_size: globals.report_size,
+                            usage,
+                            logical_minimum: globals.logical_minimum,
+                            logical_maximum: globals.logical_maximum,
+                            flags: value,
+                            collection: collections.last().copied(),
+                        });
+                        *offset += globals.report_size;
+                    }
+
+                    if *offset > MAX_REPORT_BITS {
+                        return Err(invalid(idx, "report too big"));
+                    }
+
+                    usages.clear();
+                }
+                0xa0 => {
+                    descriptor.collections.push(Collection {
+                        kind: value as u8,
+                        usage: usages.first().copied().unwrap_or(0),
+                        parent: collections.last().copied(),
+                    });
+                    collections.push(descriptor.collections.len() - 1);
+                    usages.clear();
+                }
+                0xc0 => {
+                    collections
+                        .pop()
+                        .ok_or(invalid(idx, "end collection without collection"))?;
+                    usages.clear();
+                }
+                /* global items */
+                0x04 => globals.usage_page = value,
+                0x14 => globals.logical_minimum = signed,
+                0x24 => globals.logical_maximum = signed,
+                0x74 => globals.report_size = value as usize,
+                0x84 => {
+                    if value == 0 || value > 255 {
+                        return Err(invalid(idx, "invalid report ID"));
+                    }
+                    globals.report_id = value as u8;
+                    descriptor.numbered = true;
+                }
+                0x94 => globals.report_count = value as usize,
+                0xa4 => stack.push(globals.clone()),
+                0xb4 => globals = stack.pop().ok_or(invalid(idx, "pop without push"))?,
+                /* local items */
+                0x08 => usages.push(usage),
+                0x18 => usage_minimum = Some(usage),
+                0x28 => {
+                    let minimum = usage_minimum
+                        .take()
+                        .ok_or(invalid(idx, "usage maximum without minimum"))?;
+                    if usage < minimum || usage - minimum > 1024 {
+                        return Err(invalid(idx, "invalid usage range"));
+                    }
+                    usages.extend(minimum..=usage);
+                }
+                _ => {}
+            }
+
+            if globals.report_size * globals.report_count > MAX_REPORT_BITS {
+                return Err(invalid(idx, "report too big"));
+            }
+
+            idx += 1 + size;
+        }
+
+        Ok(descriptor)
+    }
+
+    /// Parses `rdesc`, or returns the layout of a previous call with the
+    /// same `rdesc_hash`: all the objects matched against a device share a
+    /// single parse. Only the [`CACHE_SIZE`] most recently used layouts are
+    /// kept, the daemon sees every device of the system.
+    pub fn cached(rdesc_hash: u64, rdesc: &[u8]) -> std::io::Result<Rc<Self>> {
+        thread_local! {
+            static CACHE: RefCell<VecDeque<(u64, Rc<ReportDescriptor>)>> =
+                RefCell::new(VecDeque::with_capacity(CACHE_SIZE));
+        }
+
+        let hit = CACHE.with(|cache| {
+            let mut cache = cache.borrow_mut();
+            let idx = cache.iter().position(|(hash, _)| *hash == rdesc_hash)?;
+            let entry = cache.remove(idx)?;
+            let descriptor = Rc::clone(&entry.1);
+            cache.push_front(entry);
+            Some(descriptor)
+        });
+        if let Some(descriptor) = hit {
+            return Ok(descriptor);
+        }
+
+        let descriptor = Rc::new(Self::parse(rdesc)?);
+        CACHE.with(|cache| {
+            let mut cache = cache.borrow_mut();
+            cache.truncate(CACHE_SIZE - 1);
+            cache.push_front((rdesc_hash, Rc::clone(&descriptor)));
+        });
+
+        Ok(descriptor)
+    }
+
+    /// The usage of the application collection `field` belongs to
+    pub fn application(&self, field: &Field) -> Option<u32> {
+        let mut idx = field.collection;
+
+        while let Some(collection) = idx.map(|idx| &self.collections[idx]) {
+            if collection.kind == COLLECTION_APPLICATION {
+                return Some(collection.usage);
+            }
+            idx = collection.parent;
+        }
+
+        None
+    }
+
+    /// The usages of the application collections, in order
+    pub fn applications(&self) -> Vec<u32> {
+        self.collections
+            .iter()
+            .filter(|collection| collection.kind == COLLECTION_APPLICATION)
+            .map(|collection| collection.usage)
+            .collect()
+    }
+
+    /// Whether a non constant field of the given report, or of any report
+    /// of that type if `report_id` is `None`, has `usage`
+    pub fn has_usage(&self, report_type: ReportType, report_id: Option<u8>, usage: u32) -> bool {
+        self.fields.iter().any(|field| {
+            field.report_type == report_type
+                && report_id.map_or(true, |id| id == field.report_id)
+                && field.usage == usage
+                && !field.is_constant()
+        })
+    }
+
+    /// The reports of the descriptor, in order
+    pub fn reports(&self) -> Vec<(ReportType, u8)> {
+        let mut reports: Vec<(ReportType, u8)> = self
+            .fields
+            .iter()
+            .map(|field| (field.report_type, field.report_id))
+            .collect();
+
+        reports.sort();
+        reports.dedup();
+        reports
+    }
+
+    /// The size in bytes of a report, report ID included
+    pub fn report_size(&self, report_type: ReportType, report_id: u8) -> usize {
+        let bits = self
+            .fields
+            .iter()
+            .filter(|field| field.report_type == report_type && field.report_id == report_id)
+            .map(|field| field.bit_offset + field.bit_size)
+            .max()
+            .unwrap_or(0);
+
+        (bits + 7) / 8
+    }
+}
+
+const USAGE_NAMES: &[(u32, &str)] = &[
+    (0x0001_0001, "pointer"),
+    (0x0001_0002, "mouse"),
+    (0x0001_0004, "joystick"),
+    (0x0001_0005, "gamepad"),
+    (0x0001_0006, "keyboard"),
+    (0x0001_0030, "x"),
+    (0x0001_0031, "y"),
+    (0x0001_0032, "z"),
+    (0x0001_0033, "rx"),
+    (0x0001_0034, "ry"),
+    (0x0001_0035, "rz"),
+    (0x0001_0038, "wheel"),
+    (0x0001_0039, "hat_switch"),
+    (0x000c_0001, "consumer_control"),
+    (0x000c_0238, "ac_pan"),
+    (0x000d_0001, "digitizer"),
+    (0x000d_0002, "pen"),
+    (0x000d_0004, "touch_screen"),
+    (0x000d_0005, "touch_pad"),
+    (0x000d_0020, "stylus"),
+    (0x000d_0022, "finger"),
+    (0x000d_0030, "tip_pressure"),
+    (0x000d_0032, "in_range"),
+    (0x000d_0033, "touch"),
+    (0x000d_003c, "invert"),
+    (0x000d_003d, "x_tilt"),
+    (0x000d_003e, "y_tilt"),
+    (0x000d_0042, "tip_switch"),
+    (0x000d_0044, "barrel_switch"),
+    (0x000d_0045, "eraser"),
+    (0x000d_0047, "confidence"),
+    (0x000d_0048, "width"),
+    (0x000d_0049, "height"),
+    (0x000d_0051, "contact_id"),
+    (0x000d_0054, "contact_count"),
+    (0x000d_005a, "secondary_barrel_switch"),
+    (0x000d_005b, "transducer_serial_number"),
+];
+
+/// A C identifier for a usage, see [`c_header()`]
+pub fn usage_name(usage: u32) -> String {
+    match USAGE_NAMES.iter().find(|(u, _)| *u == usage) {
+        Some((_, name)) => String::from(*name),
+        None if usage >> 16 == 0x0009 => format!("button{}", usage & 0xffff),
+        None => format!("usage_{:04x}_{:04x}", usage >> 16, usage & 0xffff),
+    }
+}
+
+/// The reverse of [`usage_name()`], also accepting `0x` prefixed usages
+/// with the usage page in the high 16 bits, e.g. `eraser` or `0xd0045`
+pub fn parse_usage(name: &str) -> Option<u32> {
+    if let Some((usage, _)) = USAGE_NAMES.iter().find(|(_, n)| *n == name) {
+        return Some(*usage);
+    }
+
+    if let Some(hex) = name.strip_prefix("0x") {
+        return u32::from_str_radix(hex, 16).ok();
+    }
+
+    if let Some(button) = name.strip_prefix("button") {
+        return button.parse::<u16>().ok().map(|b| 0x0009_0000 | b as u32);
+    }
+
+    let (page, id) = name.strip_prefix("usage_")?.split_once('_')?;
+    Some(
+        (u16::from_str_radix(page, 16).ok()? as u32) << 16
+            | u16::from_str_radix(id, 16).ok()? as u32,
+    )
+}
+
+/// The expression reading the `nbytes` bytes at `offset` as a `__u32`
+fn c_load(offset: usize, nbytes: usize) -> String {
+    (0..nbytes)
+        .map(|k| match k {
+            0 => format!("data[{}]", offset),
+            _ => format!("((__u32)data[{}] << {})", offset + k, 8 * k),
+        })
+        .collect::<Vec<String>>()
+        .join(" | ")
+}
+
+fn c_accessors(prefix: &str, name: &str, field: &Field) -> Option<String> {
+    let offset = field.bit_offset / 8;
+    let shift = field.bit_offset % 8;
+    let nbits = field.bit_size;
+    let nbytes = (shift + nbits + 7) / 8;
+
+    /* keep the accessors on a single u32 */
+    if nbits == 0 || nbits > 32 || nbytes > 4 {
+        return None;
+    }
+
+    let mask: u64 = (1 << nbits) - 1;
+    let ctype = if field.is_signed() { "__s32" } else { "__u32" };
+    let mut getter = c_load(offset, nbytes);
+
+    if shift != 0 {
+        getter = format!("({}) >> {}", getter, shift);
+    }
+    if nbits != 8 * nbytes || shift != 0 {
+        getter = format!("({}) & {:#x}", getter, mask);
+    }
+    if field.is_signed() {
+        getter = match nbits {
+            8 => format!("(__s8)({})", getter),
+            16 => format!("(__s16)({})", getter),
+            32 => format!("(__s32)({})", getter),
+            _ => format!("(__s32)(({}) << {}) >> {}", getter, 32 - nbits, 32 - nbits),
+        };
+    }
+
+    let mut setter = String::new();
+    for k in 0..nbytes {
+        let byte_mask = ((mask << shift) >> (8 * k)) & 0xff;
+        let value = format!("(((__u64)value & {:#x}) << {} >> {})", mask, shift, 8 * k);
+
+        if byte_mask == 0xff {
+            setter.push_str(&format!("\tdata[{}] = {} & 0xff;\n", offset + k, value));
+        } else {
+            setter.push_str(&format!(
+                "\tdata[{}] = (data[{}] & {:#04x}) | ({} & {:#04x});\n",
+                offset + k,
+                offset + k,
+                !byte_mask & 0xff,
+                value,
+                byte_mask
+            ));
+        }
+    }
+
+    Some(format!(
+        "static __always_inline {ctype} {prefix}_{name}_get(const __u8 *data)\n\
+         {{\n\
+         \treturn {getter};\n\
+         }}\n\
+         \n\
+         static __always_inline void {prefix}_{name}_set(__u8 *data, {ctype} value)\n\
+         {{\n\
+         {setter}\
+         }}\n\n",
+    ))
+}
+
+/// Generates a C header for BPF programs with the report descriptor as
+/// `<prefix>_rdesc`, the size of each report as `<PREFIX>_<TYPE><ID>_SIZE`,
+/// and `<prefix>_<type><id>_<usage>_get()`/`_set()` accessors for each
+/// non constant field, taking the report data as returned by
+/// hid_bpf_get_data().
+pub fn c_header(prefix: &str, source: &str, rdesc: &[u8]) -> std::io::Result<String> {
+    let descriptor = ReportDescriptor::parse(rdesc)?;
+    let guard = format!("__{}_RDESC_H", prefix.to_uppercase());
+    let mut header = format!(
+        "/* SPDX-License-Identifier: GPL-2.0-only */\n\
+         /* generated by build.rs from {source}, do not edit */\n\
+         \n\
+         #ifndef {guard}\n\
+         #define {guard}\n\
+         \n\
+         static const __u8 {prefix}_rdesc[] = {{\n",
+    );
+
+    for chunk in rdesc.chunks(8) {
+        let bytes: Vec<String> = chunk.iter().map(|b| format!("{:#04x},", b)).collect();
+        header.push_str(&format!("\t{}\n", bytes.join(" ")));
+    }
+    header.push_str("};\n\n");
+
+    for (report_type, report_id) in descriptor.reports() {
+        let report = format!("{}{}", report_type.name(), report_id);
+        let mut names: HashMap<String, usize> = HashMap::new();
+
+        header.push_str(&format!(
+            "#define {}_{}_SIZE {}\n\n",
+            prefix.to_uppercase(),
+            report.to_uppercase(),
+            descriptor.report_size(report_type, report_id)
+        ));
+
+        for field in descriptor
+            .fields
+            .iter()
+            .filter(|field| field.report_type == report_type && field.report_id == report_id)
+        {
+            if field.is_constant() {
+                continue;
+            }
+
+            let mut name = if field.is_variable() {
+                usage_name(field.usage)
+            } else {
+                String::from("array")
+            };
+            let count = names.entry(name.clone()).or_insert(0);
+            *count += 1;
+            if *count > 1 {
+                name = format!("{}_{}", name, count);
+            }
+
+            let name = format!("{}_{}", report, name);
+            match c_accessors(prefix, &name, field) {
+                Some(accessors) => header.push_str(&accessors),
+                None => header.push_str(&format!("/* {}: too large for accessors */\n\n", name)),
+            }
+        }
+    }
+
+    header.push_str(&format!("#endif /* {} */\n", guard));
+
+    Ok(header)
+}
+
+/// Parses the report descriptor files given to the generator: hexadecimal
+/// bytes, separated by spaces or commas, `#` starting a comment.
+pub fn parse_rdesc_file(data: &str) -> std::io::Result<Vec<u8>> {
+    let mut bytes = Vec::new();
+
+    for (lineno, line) in data.lines().enumerate() {
+        let line = line.split('#').next().unwrap();
+        for token in line
+            .split(|c: char| c.is_whitespace() || c == ',')
+            .filter(|t| !t.is_empty())
+        {
+            bytes.push(
+                u8::from_str_radix(token.trim_start_matches("0x"), 16).map_err(|_| {
+                    std::io::Error::new(
+                        std::io::ErrorKind::InvalidData,
+                        format!("line {}: invalid byte '{}'", lineno + 1, token),
+                    )
+                })?,
+            );
+        }
+    }
+
+    Ok(bytes)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /* the fixed report descriptor of the XP-Pen Artist Pro 16 (Gen2) */
+    const PRO16_RDESC: [u8; 111] = [
+        0x05, 0x0d, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x07, 0x09, 0x20, 0xa1, 0x00, 0x09, 0x42, 0x09,
+        0x44, 0x09, 0x5a, 0x09, 0x3c, 0x09, 0x45, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x05,
+        0x81, 0x02, 0x09, 0x32, 0x15, 0x00, 0x25, 0x01, 0x95, 0x01, 0x81, 0x02, 0x95, 0x02, 0x81,
+        0x03, 0x75, 0x10, 0x95, 0x01, 0x35, 0x00, 0xa4, 0x05, 0x01, 0x09, 0x30, 0x65, 0x13, 0x55,
+        0x0d, 0x46, 0xff, 0x34, 0x26, 0xff, 0x7f, 0x81, 0x02, 0x09, 0x31, 0x46, 0x20, 0x21, 0x26,
+        0xff, 0x7f, 0x81, 0x02, 0xb4, 0x09, 0x30, 0x45, 0x00, 0x26, 0xff, 0x3f, 0x81, 0x42, 0x09,
+        0x3d, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x01, 0x81, 0x02, 0x09, 0x3e, 0x15, 0x81,
+        0x25, 0x7f, 0x81, 0x02, 0xc0, 0xc0,
+    ];
+
+    #[test]
+    fn test_parse() {
+        let descriptor = ReportDescriptor::parse(&PRO16_RDESC).unwrap();
+        assert!(descriptor.numbered);
+        assert!(descriptor.reports() == vec![(ReportType::Input, 7)]);
+        assert!(descriptor.report_size(ReportType::Input, 7) == 10);
+
+        let field = |usage| {
+            descriptor
+                .fields
+                .iter()
+                .find(|field| field.usage == usage)
+                .unwrap()
+        };
+        assert!(field(0x000d_0042).bit_offset == 8);
+        assert!(field(0x000d_0045).bit_offset == 12);
+        assert!(field(0x000d_0032).bit_offset == 13);
+        assert!(field(0x0001_0030).bit_offset == 16);
+        assert!(field(0x0001_0030).bit_size == 16);
+        assert!(field(0x0001_0031).bit_offset == 32);
+        assert!(field(0x000d_0030).bit_offset == 48);
+        assert!(field(0x000d_003d).bit_offset == 64);
+        assert!(field(0x000d_003d).is_signed());
+        assert!(field(0x000d_003e).bit_offset == 72);
+
+        assert!(descriptor.applications() == vec![0x000d_0002]);
+        assert!(descriptor.collections[1].usage == 0x000d_0020);
+        assert!(descriptor.collections[1].parent == Some(0));
+        assert!(descriptor.application(field(0x000d_0045)) == Some(0x000d_0002));
+        assert!(descriptor.has_usage(ReportType::Input, Some(7), 0x000d_0045));
+        assert!(descriptor.has_usage(ReportType::Input, None, 0x000d_0045));
+        assert!(!descriptor.has_usage(ReportType::Input, Some(8), 0x000d_0045));
+        assert!(!descriptor.has_usage(ReportType::Feature, None, 0x000d_0045));
+
+        let cached = ReportDescriptor::cached(1, &PRO16_RDESC).unwrap();
+        assert!(Rc::ptr_eq(
+            &cached,
+            &ReportDescriptor::cached(1, &PRO16_RDESC).unwrap()
+        ));
+        assert!(cached.fields == descriptor.fields);
+
+        /* the least recently used layout goes first */
+        let second = ReportDescriptor::cached(2, &PRO16_RDESC).unwrap();
+        for hash in 3..=CACHE_SIZE as u64 {
+            ReportDescriptor::cached(hash, &PRO16_RDESC).unwrap();
+        }
+        assert!(Rc::ptr_eq(
+            &cached,
+            &ReportDescriptor::cached(1, &PRO16_RDESC).unwrap()
+        ));
+        ReportDescriptor::cached(CACHE_SIZE as u64 + 1, &PRO16_RDESC).unwrap();
+        assert!(Rc::ptr_eq(
+            &cached,
+            &ReportDescriptor::cached(1, &PRO16_RDESC).unwrap()
+        ));
+        assert!(!Rc::ptr_eq(
+            &second,
+            &ReportDescriptor::cached(2, &PRO16_RDESC).unwrap()
+        ));
+
+        assert!(parse_usage("eraser") == Some(0x000d_0045));
+        assert!(parse_usage("0xd0045") == Some(0x000d_0045));
+        assert!(parse_usage("button3") == Some(0x0009_0003));
+        assert!(parse_usage(&usage_name(0xff00_0001)) == Some(0xff00_0001));
+        assert!(parse_usage("rubber").is_none());
+
+        assert!(ReportDescriptor::parse(&[0x05]).is_err());
+        assert!(ReportDescriptor::parse(&[0xc0]).is_err());
+        assert!(ReportDescriptor::parse(&[0xb4]).is_err());
+        assert!(ReportDescriptor::parse(&[0x85, 0x00]).is_err());
+    }
+
+    #[test]
+    fn test_c_header() {
+        let header = c_header("pro16", "pro16.rdesc", &PRO16_RDESC).unwrap();
+        assert!(header.contains("#define PRO16_INPUT7_SIZE 10\n"));
+        assert!(header.contains(
+            "static __always_inline __u32 pro16_input7_x_get(const __u8 *data)\n\
+             {\n\
+             \treturn data[2] | ((__u32)data[3] << 8);\n\
+             }\n"
+        ));
+        assert!(header.contains("\treturn (__s8)(data[8]);\n"));
+        assert!(header.contains("\treturn ((data[1]) >> 4) & 0x1;\n"));
+        assert!(header.contains(
+            "\tdata[1] = (data[1] & 0xef) | ((((__u64)value & 0x1) << 4 >> 0) & 0x10);\n"
+        ));
+        /* padding has no accessors */
+        assert!(!header.contains("usage_"));
+
+        let rdesc = parse_rdesc_file("0x05, 0x0d # Usage Page\n09 02\n").unwrap();
+        assert!(rdesc == vec![0x05, 0x0d, 0x09, 0x02]);
+        assert!(parse_rdesc_file("0x5g").is_err());
+    }
+}
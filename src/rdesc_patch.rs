@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+use crate::datafile::{self, invalid, DeviceMatch};
+use crate::signature::SignatureScan;
+
+/// Extension of the data files describing a report descriptor patch table.
+pub const EXTENSION: &str = "rdesc-patch";
+
+/// The generic object that applies the patch tables, see generic-rdesc-patch.bpf.c
+pub const OBJECT: &str = "generic-rdesc-patch.bpf.o";
+
+/* keep in sync with src/bpf/rdesc_patch.h */
+pub const MAX_ENTRIES: usize = 16;
+pub const MAX_SIZE: usize = 64;
+
+/// Replace `expected` by `replacement` at `offset` in the report descriptor,
+/// or wherever `expected` is if there is no offset.
+#[derive(Debug, PartialEq)]
+pub struct Patch {
+    pub offset: Option<usize>,
+    pub expected: Vec<u8>,
+    pub replacement: Vec<u8>,
+}
+
+/// The content of a `.rdesc-patch` data file, see [`DeviceMatch`] for
+/// the lines selecting the devices:
+///
+/// ```text
+/// device hid:b0003g0001v0000258Ap00000027
+/// rdesc_size 213
+/// expect 3 06
+/// patch 84 81 03 -> 81 02
+/// patch any 95 01 81 03 -> 95 01 81 02
+/// ```
+///
+/// each `patch` is an offset followed by the expected bytes and the
+/// replacement bytes. With `any` instead of an offset, the patch applies
+/// to the first occurrence of the expected bytes, see [`PatchTable::resolve()`].
+#[derive(Debug)]
+pub struct PatchTable {
+    pub device_match: DeviceMatch,
+    pub patches: Vec<Patch>,
+}
+
+impl PatchTable {
+    pub fn from_str(data: &str) -> std::io::Result<Self> {
+        let mut table = PatchTable {
+            device_match: DeviceMatch::default(),
+            patches: Vec::new(),
+        };
+
+        for (lineno, tokens) in datafile::logical_lines(data) {
+            if table.device_match.parse_line(lineno, &tokens)? {
+                continue;
+            }
+
+            match tokens[0].as_str() {
+                "patch" => {
+                    let offset = match tokens.get(1).map(|t| t.as_str()) {
+                        Some("any") => None,
+                        _ => Some(datafile::parse_offset(lineno, tokens.get(1))?),
+                    };
+                    let arrow = tokens
+                        .iter()
+                        .position(|t| t == "->")
+                        .ok_or(invalid(lineno, "missing '->'"))?;
+                    let expected = datafile::parse_bytes(lineno, &tokens[2..arrow])?;
+                    let replacement = datafile::parse_bytes(lineno, &tokens[arrow + 1..])?;
+                    if expected.len() != replacement.len() {
+                        return Err(invalid(lineno, "expected and replacement sizes differ"));
+                    }
+                    if expected.is_empty() || expected.len() > MAX_SIZE {
+                        return Err(invalid(lineno, "invalid patch size"));
+                    }
+                    if offset.unwrap_or(0) + MAX_SIZE > 4096 {
+                        return Err(invalid(lineno, "patch out of bounds"));
+                    }
+                    table.patches.push(Patch {
+                        offset,
+                        expected,
+                        replacement,
+                    });
+                }
+                keyword => {
+                    return Err(invalid(lineno, &format!("unknown keyword '{}'", keyword)));
+                }
+            }
+        }
+
+        if table.patches.is_empty() {
+            return Err(invalid(0, "no patch in table"));
+        }
+
+        if table.patches.len() > MAX_ENTRIES {
+            return Err(invalid(0, "too many patches"));
+        }
+
+        Ok(table)
+    }
+
+    pub fn from_path(path: &std::path::Path) -> std::io::Result<Self> {
+        let data = std::fs::read_to_string(path)?;
+        Self::from_str(&data)
+            .map_err(|e| std::io::Error::new(e.kind(), format!("{}: {}", path.display(), e)))
+    }
+
+    /// Gives their offset in `rdesc` to the `patch any` entries, looked up
+    /// in `scan`, see [`PatchTable::signatures()`]. The ones that are not
+    /// found keep no offset, and the table doesn't match the device.
+    pub fn resolve(&mut self, rdesc: &[u8], scan: &SignatureScan) {
+        for patch in self.patches.iter_mut().filter(|p| p.offset.is_none()) {
+            patch.offset = scan
+                .find(&patch.expected, rdesc)
+                .filter(|offset| offset + MAX_SIZE <= 4096);
+        }
+    }
+
+    /// The byte sequences searched in the report descriptor: the `expect
+    /// any` ones and the expected bytes of the `patch any` entries
+    pub fn signatures(&self) -> impl Iterator<Item = &Vec<u8>> {
+        self.device_match.signatures.iter().chain(
+            self.patches
+                .iter()
+                .filter(|patch| patch.offset.is_none())
+                .map(|patch| &patch.expected),
+        )
+    }
+
+    /// The [`DeviceMatch`] of the table, with every patched sequence
+    /// expected on top of it.
+    pub fn into_device_match(self) -> DeviceMatch {
+        let mut device_match = self.device_match;
+
+        for patch in self.patches {
+            match patch.offset {
+                Some(offset) => device_match.expects.push((offset, patch.expected)),
+                None => device_match.signatures.push(patch.expected),
+            }
+        }
+
+        device_match
+    }
+}
+
+pub fn is_patch_table(path: &std::path::Path) -> bool {
+    path.extension().map_or(false, |ext| ext == EXTENSION)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_patch_table() {
+        let data = "
+            # a comment
+            device hid:b0003g0001v0000258Ap00000027 # trailing comment
+            rdesc_size 8
+            expect 1 06
+            patch 4 81 \\
+                    03 -> 81 02
+        ";
+        let table = PatchTable::from_str(data).unwrap();
+        assert!(table.device_match.modaliases.len() == 1);
+        assert!(table.device_match.modaliases[0].vid == 0x258a);
+        assert!(table.device_match.rdesc_size == Some(8));
+        assert!(table.patches.len() == 1);
+        assert!(
+            table.patches[0]
+                == Patch {
+                    offset: Some(4),
+                    expected: vec![0x81, 0x03],
+                    replacement: vec![0x81, 0x02],
+                }
+        );
+
+        let device_match = table.into_device_match();
+        assert!(device_match.matches(
+            &[0x00, 0x06, 0x00, 0x00, 0x81, 0x03, 0x00, 0x00],
+            0,
+            &SignatureScan::default()
+        ));
+        /* already fixed */
+        assert!(!device_match.matches(
+            &[0x00, 0x06, 0x00, 0x00, 0x81, 0x02, 0x00, 0x00],
+            0,
+            &SignatureScan::default()
+        ));
+        /* wrong size */
+        assert!(!device_match.matches(
+            &[0x00, 0x06, 0x00, 0x00, 0x81, 0x03, 0x00],
+            0,
+            &SignatureScan::default()
+        ));
+        /* expect not matching */
+        assert!(!device_match.matches(
+            &[0x00, 0x07, 0x00, 0x00, 0x81, 0x03, 0x00, 0x00],
+            0,
+            &SignatureScan::default()
+        ));
+
+        let data = "
+            patch any 81 03 -> 81 02
+            patch 1 06 -> 07
+            patch any 95 01 -> 95 02
+        ";
+        let mut table = PatchTable::from_str(data).unwrap();
+        let rdesc = [0x00, 0x06, 0x00, 0x00, 0x81, 0x03, 0x81, 0x03];
+        let scan = SignatureScan::new(table.signatures().cloned().collect(), &rdesc);
+        assert!(table.signatures().count() == 2);
+        table.resolve(&rdesc, &scan);
+        assert!(table.patches[0].offset == Some(4));
+        assert!(table.patches[1].offset == Some(1));
+        assert!(table.patches[2].offset.is_none());
+        let device_match = table.into_device_match();
+        assert!(device_match.expects.len() == 2);
+        assert!(device_match.signatures == vec![vec![0x95, 0x01]]);
+        assert!(!device_match.matches(&rdesc, 0, &scan));
+
+        assert!(PatchTable::from_str("patch 4 81 03 -> 81").is_err());
+        assert!(PatchTable::from_str("patch 4 81 03 81 02").is_err());
+        assert!(PatchTable::from_str("patch 4090 81 -> 82").is_err());
+        assert!(PatchTable::from_str("foo 4").is_err());
+        assert!(PatchTable::from_str("rdesc_size 4").is_err());
+    }
+}
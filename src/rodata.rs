@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! Load-time values for the `const volatile` globals of an object.
+//!
+//! Those globals end up in `.rodata`, which is frozen before the programs
+//! are verified: the verifier and the JIT see them as constants, so
+//! setting them before `load()` specializes the object for a device
+//! without any runtime cost.
+//!
+//! Values come, from lowest to highest priority, from the defaults in the
+//! object, from `<object file>.conf` installed next to the object, from
+//! `/etc/udev-hid-bpf/<object file>.conf` and from the `--set NAME=VALUE`
+//! command line arguments.
+
+use crate::datafile::{self, invalid};
+use crate::modalias::Modalias;
+
+pub const CONFIG_DIR: &str = "/etc/udev-hid-bpf";
+
+/// Parses a `NAME=VALUE` command line argument
+pub fn parse_assignment(arg: &str) -> Result<(String, String), String> {
+    match arg.split_once('=') {
+        Some((name, value)) if !name.is_empty() && !value.is_empty() => {
+            Ok((String::from(name), String::from(value)))
+        }
+        _ => Err(format!("'{}' is not in the NAME=VALUE form", arg)),
+    }
+}
+
+/// The config files of an object, the shipped one first
+pub fn config_paths(object: &std::path::Path) -> [std::path::PathBuf; 2] {
+    let fname = format!("{}.conf", object.file_name().unwrap().to_string_lossy());
+    [
+        object.with_file_name(&fname),
+        std::path::PathBuf::from(CONFIG_DIR).join(fname),
+    ]
+}
+
+/// Returns the assignments of the config file that apply to `modalias`:
+///
+/// ```text
+/// # applies to every device
+/// set logical_maximum 32767
+///
+/// # only applies to the following device(s)
+/// device hid:b0003g0001v000028BDp0000095A
+/// set logical_maximum 16383
+/// ```
+///
+/// `set` lines before the first `device` line apply to every device, the
+/// ones after a group of `device` lines only apply to those devices. A
+/// `device` line matches like the hwdb does, see [`Modalias::matches()`].
+pub fn parse_config(data: &str, modalias: &Modalias) -> std::io::Result<Vec<(String, String)>> {
+    let mut assignments = Vec::new();
+    let mut in_device_list = false;
+    let mut applies = true;
+
+    for (lineno, tokens) in datafile::logical_lines(data) {
+        match tokens[0].as_str() {
+            "device" => {
+                let device = tokens.get(1).ok_or(invalid(lineno, "missing modalias"))?;
+                let device = Modalias::from_str(device)?;
+
+                /* consecutive device lines form a single group */
+                if !in_device_list {
+                    applies = false;
+                }
+                in_device_list = true;
+                applies |= device.matches(modalias);
+            }
+            "set" => {
+                in_device_list = false;
+                if tokens.len() != 3 {
+                    return Err(invalid(lineno, "expected 'set NAME VALUE'"));
+                }
+                if applies {
+                    assignments.push((tokens[1].clone(), tokens[2].clone()));
+                }
+            }
+            keyword => {
+                return Err(invalid(lineno, &format!("unknown keyword '{}'", keyword)));
+            }
+        }
+    }
+
+    Ok(assignments)
+}
+
+pub fn load_config(
+    object: &std::path::Path,
+    modalias: &Modalias,
+) -> std::io::Result<Vec<(String, String)>> {
+    let mut assignments = Vec::new();
+
+    for path in config_paths(object) {
+        match std::fs::read_to_string(&path) {
+            Ok(data) => assignments.extend(parse_config(&data, modalias).map_err(|e| {
+                std::io::Error::new(e.kind(), format!("{}: {}", path.display(), e))
+            })?),
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => {}
+            Err(e) => return Err(e),
+        }
+    }
+
+    Ok(assignments)
+}
+
+fn invalid_value(value: &str, msg: &str) -> std::io::Error {
+    std::io::Error::new(
+        std::io::ErrorKind::InvalidData,
+        format!("'{}' {}", value, msg),
+    )
+}
+
+/// Offset in logical units of the position reported by a pen whose coil
+/// sits `tip_height` above the tip, for each tilt angle in degrees.
+///
+/// `full_scale` and `tip_height` are in the same physical unit,
+/// `full_scale` mapping to `logical_maximum`.
+pub fn tilt_offsets(
+    full_scale: f64,
+    tip_height: f64,
+    logical_maximum: f64,
+    count: usize,
+) -> Vec<i64> {
+    let height = tip_height * logical_maximum / full_scale;
+
+    (0..count)
+        .map(|angle| (height * (angle as f64).to_radians().sin()).round() as i64)
+        .collect()
+}
+
+/// Computes the content of an array from a generator:
+/// `tilt_offsets(FULL_SCALE,TIP_HEIGHT,LOGICAL_MAXIMUM)`, the arguments
+/// being numbers once [`resolve_references()`] replaced the names
+fn generate(value: &str, count: usize) -> std::io::Result<Vec<i64>> {
+    let (generator, args) = value
+        .strip_suffix(')')
+        .and_then(|v| v.split_once('('))
+        .ok_or(invalid_value(value, "is not a generator"))?;
+    let args = args
+        .split(',')
+        .map(|arg| {
+            let arg = arg.trim();
+            arg.parse::<f64>()
+                .ok()
+                .or_else(|| parse_value(arg).ok().map(|number| number as f64))
+        })
+        .collect::<Option<Vec<f64>>>()
+        .ok_or(invalid_value(value, "has invalid arguments"))?;
+
+    match (generator, args.as_slice()) {
+        ("tilt_offsets", [full_scale, tip_height, logical_maximum]) if *full_scale > 0.0 => Ok(
+            tilt_offsets(*full_scale, *tip_height, *logical_maximum, count),
+        ),
+        _ => Err(invalid_value(value, "is not a known generator")),
+    }
+}
+
+/// Replaces the names of globals given as generator arguments by their
+/// value, the last assignment winning as for the globals themselves: with
+/// `tilt_offsets(11.874,0.0557,logical_maximum)`, the table follows an
+/// override of `logical_maximum`.
+pub fn resolve_references(
+    assignments: &[(String, String)],
+) -> std::io::Result<Vec<(String, String)>> {
+    assignments
+        .iter()
+        .map(|(name, value)| {
+            let (generator, args) = match value.strip_suffix(')').and_then(|v| v.split_once('(')) {
+                Some(generator) => generator,
+                None => return Ok((name.clone(), value.clone())),
+            };
+
+            let args = args
+                .split(',')
+                .map(|arg| {
+                    let arg = arg.trim();
+                    if !arg.starts_with(|c: char| c.is_ascii_alphabetic() || c == '_') {
+                        return Ok(String::from(arg));
+                    }
+
+                    match assignments.iter().rev().find(|(name, _)| name == arg) {
+                        Some((_, referenced)) if !referenced.contains('(') => {
+                            Ok(referenced.clone())
+                        }
+                        _ => Err(invalid_value(
+                            value,
+                            &format!("uses '{}', which isn't set to a number", arg),
+                        )),
+                    }
+                })
+                .collect::<std::io::Result<Vec<String>>>()?;
+
+            Ok((name.clone(), format!("{}({})", generator, args.join(","))))
+        })
+        .collect()
+}
+
+fn encode_number(value: &str, number: i64, size: usize) -> std::io::Result<Vec<u8>> {
+    let fits = match size {
+        1 => number >= i8::MIN as i64 && number <= u8::MAX as i64,
+        2 => number >= i16::MIN as i64 && number <= u16::MAX as i64,
+        4 => number >= i32::MIN as i64 && number <= u32::MAX as i64,
+        8 => true,
+        _ => false,
+    };
+
+    if !fits {
+        return Err(invalid_value(
+            value,
+            &format!("doesn't fit in {} bytes", size),
+        ));
+    }
+
+    let bytes = number.to_ne_bytes();
+    Ok(if cfg!(target_endian = "little") {
+        bytes[..size].to_vec()
+    } else {
+        bytes[8 - size..].to_vec()
+    })
+}
+
+fn parse_value(value: &str) -> std::io::Result<i64> {
+    match value {
+        "true" => Ok(1),
+        "false" => Ok(0),
+        _ => datafile::parse_number(0, Some(&String::from(value))),
+    }
+}
+
+/// Encodes `value` for a global of `size` bytes, in native endianness.
+///
+/// Arrays of `count` elements are set from a comma separated list, the
+/// missing elements being 0, or from a generator, see [`generate()`].
+pub fn encode(value: &str, size: usize, count: usize) -> std::io::Result<Vec<u8>> {
+    if count == 1 {
+        return encode_number(value, parse_value(value)?, size);
+    }
+
+    let mut numbers = if value.contains('(') {
+        generate(value, count)?
+    } else {
+        value
+            .split(',')
+            .map(|v| parse_value(v.trim()))
+            .collect::<std::io::Result<Vec<i64>>>()?
+    };
+
+    if numbers.len() > count {
+        return Err(invalid_value(
+            value,
+            &format!("has more than {} elements", count),
+        ));
+    }
+    numbers.resize(count, 0);
+
+    let mut bytes = Vec::new();
+    for number in numbers {
+        bytes.extend(encode_number(value, number, size / count)?);
+    }
+
+    Ok(bytes)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_rodata_config() {
+        assert!(parse_assignment("foo=12").unwrap() == (String::from("foo"), String::from("12")));
+        assert!(parse_assignment("foo").is_err());
+        assert!(parse_assignment("=12").is_err());
+
+        let data = "
+            set a 1
+            device hid:b0003g0001v000028BDp0000095A
+            device hid:b0003g0001v000028BDp0000095B
+            set a 2
+            device hid:b0003g0001v000028BDp0000095C
+            set b 3
+        ";
+        let pro14 = Modalias::from_str("b0003g0001v000028BDp0000095A").unwrap();
+        let pro16 = Modalias::from_str("b0003g0001v000028BDp0000095B").unwrap();
+        let other = Modalias::from_str("b0003g0001v000028BDp0000095C").unwrap();
+
+        let s = |a: &str, b: &str| (String::from(a), String::from(b));
+        assert!(parse_config(data, &pro14).unwrap() == vec![s("a", "1"), s("a", "2")]);
+        assert!(parse_config(data, &pro16).unwrap() == vec![s("a", "1"), s("a", "2")]);
+        assert!(parse_config(data, &other).unwrap() == vec![s("a", "1"), s("b", "3")]);
+        assert!(parse_config("set a", &other).is_err());
+
+        /* any group and any product, as in HID_DEVICE(BUS_USB, HID_GROUP_ANY, ...) */
+        let data = "
+            device hid:b0003g0000v000028BDp00000000
+            set a 1
+            device hid:b0005g0000v000028BDp0000095A
+            set b 2
+        ";
+        let multitouch = Modalias::from_str("b0003g0004v000028BDp0000095A").unwrap();
+        assert!(parse_config(data, &multitouch).unwrap() == vec![s("a", "1")]);
+        assert!(parse_config(data, &pro14).unwrap() == vec![s("a", "1")]);
+        let bluetooth = Modalias::from_str("b0005g0001v000028BDp0000095A").unwrap();
+        assert!(parse_config(data, &bluetooth).unwrap() == vec![s("b", "2")]);
+
+        assert!(encode("true", 1, 1).unwrap() == vec![1]);
+        assert!(encode("-1", 2, 1).unwrap() == vec![0xff, 0xff]);
+        assert!(encode("0x7fff", 2, 1).unwrap() == 0x7fffu16.to_ne_bytes().to_vec());
+        assert!(encode("65536", 2, 1).is_err());
+        assert!(encode("1", 3, 1).is_err());
+        assert!(encode("1", 4, 2).unwrap() == [1u16.to_ne_bytes(), [0, 0]].concat());
+        assert!(encode("1,0x10", 4, 2).unwrap() == [1u16, 16].map(u16::to_ne_bytes).concat());
+        assert!(encode("1,2,3", 4, 2).is_err());
+    }
+
+    #[test]
+    fn test_tilt_offsets() {
+        /* the tables previously hardcoded in xppen-ArtistPro16Gen2.bpf.c */
+        let horizontal = tilt_offsets(11.874, 0.055677699, 32767.0, 128);
+        assert!(horizontal[..8] == [0, 3, 5, 8, 11, 13, 16, 19]);
+        assert!(horizontal[90] == 154);
+        assert!(horizontal[127] == 123);
+
+        let vertical = tilt_offsets(7.421, 0.055677699, 32767.0, 128);
+        assert!(vertical[..8] == [0, 4, 9, 13, 17, 21, 26, 30]);
+        assert!(vertical[127] == 196);
+
+        let bytes = encode("tilt_offsets(11.874, 0.055677699, 32767)", 256, 128).unwrap();
+        assert!(bytes.len() == 256);
+        assert!(bytes[2..4] == 3u16.to_ne_bytes());
+        assert!(encode("tilt_offsets(11.874,0.05)", 256, 128).is_err());
+        assert!(encode("tilt_offsets(11.874,0.05,logical_maximum)", 256, 128).is_err());
+        assert!(encode("sine(1,2,3)", 256, 128).is_err());
+
+        let s = |a: &str, b: &str| (String::from(a), String::from(b));
+        let config = [
+            s("logical_maximum", "32767"),
+            s("table", "tilt_offsets(11.874, 0.05, logical_maximum)"),
+            s("logical_maximum", "0x3fff"),
+        ];
+        assert!(
+            resolve_references(&config).unwrap()
+                == [
+                    s("logical_maximum", "32767"),
+                    s("table", "tilt_offsets(11.874,0.05,0x3fff)"),
+                    s("logical_maximum", "0x3fff"),
+                ]
+        );
+        assert!(resolve_references(&config[1..2]).is_err());
+        assert!(resolve_references(&[s("a", "f(1,b)"), s("b", "f(1)")]).is_err());
+    }
+}
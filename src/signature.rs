@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! Search of several byte signatures in a report descriptor at once.
+//!
+//! Signatures let a data file find the bytes it cares about wherever they
+//! are in the descriptor, instead of at a fixed offset that moves with
+//! each firmware update. All the signatures of a data file are searched
+//! in a single pass with an Aho-Corasick automaton.
+
+use std::collections::{HashMap, VecDeque};
+
+#[derive(Debug, Default)]
+struct Node {
+    next: Vec<(u8, usize)>,
+    fail: usize,
+    /// the signatures ending at this node, including through `fail`
+    matches: Vec<usize>,
+}
+
+impl Node {
+    fn child(&self, byte: u8) -> Option<usize> {
+        self.next
+            .iter()
+            .find(|(b, _)| *b == byte)
+            .map(|(_, node)| *node)
+    }
+}
+
+#[derive(Debug)]
+pub struct SignatureSet {
+    nodes: Vec<Node>,
+    lengths: Vec<usize>,
+}
+
+impl SignatureSet {
+    pub fn new<S: AsRef<[u8]>>(signatures: &[S]) -> Self {
+        let mut nodes = vec![Node::default()];
+
+        for (idx, signature) in signatures.iter().enumerate() {
+            let mut node = 0;
+            for byte in signature.as_ref() {
+                node = match nodes[node].child(*byte) {
+                    Some(child) => child,
+                    None => {
+                        nodes.push(Node::default());
+                        let child = nodes.len() - 1;
+                        nodes[node].next.push((*byte, child));
+                        child
+                    }
+                };
+            }
+            nodes[node].matches.push(idx);
+        }
+
+        /* the children of the root fail to the root, then breadth first */
+        let mut queue: VecDeque<usize> = nodes[0].next.iter().map(|(_, n)| *n).collect();
+        while let Some(node) = queue.pop_front() {
+            for (byte, child) in nodes[node].next.clone() {
+                let mut fail = nodes[node].fail;
+                let target = loop {
+                    if let Some(target) = nodes[fail].child(byte) {
+                        break target;
+                    }
+                    if fail == 0 {
+                        break 0;
+                    }
+                    fail = nodes[fail].fail;
+                };
+
+                nodes[child].fail = target;
+                let inherited = nodes[target].matches.clone();
+                nodes[child].matches.extend(inherited);
+                queue.push_back(child);
+            }
+        }
+
+        SignatureSet {
+            nodes,
+            lengths: signatures.iter().map(|s| s.as_ref().len()).collect(),
+        }
+    }
+
+    /// The offset of the first occurrence of each signature in `data`
+    pub fn find(&self, data: &[u8]) -> Vec<Option<usize>> {
+        let mut found: Vec<Option<usize>> = self
+            .lengths
+            .iter()
+            .map(|len| if *len == 0 { Some(0) } else { None })
+            .collect();
+        let mut missing = found.iter().filter(|f| f.is_none()).count();
+        let mut node = 0;
+
+        for (pos, byte) in data.iter().enumerate() {
+            if missing == 0 {
+                break;
+            }
+
+            node = loop {
+                if let Some(child) = self.nodes[node].child(*byte) {
+                    break child;
+                }
+                if node == 0 {
+                    break 0;
+                }
+                node = self.nodes[node].fail;
+            };
+
+            for idx in self.nodes[node].matches.iter() {
+                if found[*idx].is_none() {
+                    found[*idx] = Some(pos + 1 - self.lengths[*idx]);
+                    missing -= 1;
+                }
+            }
+        }
+
+        found
+    }
+}
+
+/// The first offsets of a batch of signatures in one report descriptor.
+///
+/// The loader gathers the signatures of all the data files it considers
+/// for a device and scans its report descriptor once, every data file then
+/// looks its own signatures up here.
+#[derive(Debug, Default)]
+pub struct SignatureScan {
+    offsets: HashMap<Vec<u8>, Option<usize>>,
+}
+
+impl SignatureScan {
+    pub fn new(mut signatures: Vec<Vec<u8>>, data: &[u8]) -> Self {
+        signatures.sort();
+        signatures.dedup();
+        let found = SignatureSet::new(&signatures).find(data);
+
+        SignatureScan {
+            offsets: signatures.into_iter().zip(found).collect(),
+        }
+    }
+
+    /// The offset of the first occurrence of `signature` in `data`, the
+    /// scanned data. A signature that was not part of the scan is
+    /// searched on its own.
+    pub fn find(&self, signature: &[u8], data: &[u8]) -> Option<usize> {
+        match self.offsets.get(signature) {
+            Some(offset) => *offset,
+            None => SignatureSet::new(&[signature]).find(data)[0],
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_signature_set() {
+        let set = SignatureSet::new(&[
+            vec![0x81, 0x03],
+            vec![0x95, 0x01, 0x81, 0x03],
+            vec![0x01, 0x81],
+            vec![0xc0, 0xc0],
+            vec![],
+        ]);
+        let data = [0x95, 0x01, 0x95, 0x01, 0x81, 0x03, 0x81, 0x03];
+        assert!(set.find(&data) == vec![Some(4), Some(2), Some(3), None, Some(0)]);
+
+        /* the same result as a naive search */
+        let rdesc: Vec<u8> = (0..2048u32).map(|i| (i * 7 % 13) as u8).collect();
+        let signatures: Vec<Vec<u8>> = (0..64)
+            .map(|i| rdesc[i * 31..i * 31 + 1 + i % 5].to_vec())
+            .chain([vec![0xff], vec![5, 12, 6, 0, 0]])
+            .collect();
+        let found = SignatureSet::new(&signatures).find(&rdesc);
+        for (signature, offset) in signatures.iter().zip(found) {
+            assert!(offset == rdesc.windows(signature.len()).position(|w| w == signature));
+        }
+
+        let scan = SignatureScan::new(signatures[..8].to_vec(), &rdesc);
+        for signature in signatures.iter() {
+            let offset = rdesc.windows(signature.len()).position(|w| w == signature);
+            assert!(scan.find(signature, &rdesc) == offset);
+        }
+        assert!(SignatureScan::default().find(&[0xff], &data) == None);
+        assert!(SignatureScan::default().find(&[0x81, 0x03], &data) == Some(4));
+    }
+}
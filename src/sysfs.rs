@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! Enumeration of the HID devices straight from sysfs, without libudev:
+//! each device only costs a read of its `uevent` and `report_descriptor`,
+//! and the devices are read from a few threads at once.
+
+use crate::json;
+use crate::modalias;
+use std::path::{Path, PathBuf};
+
+pub const HID_DEVICES_DIR: &str = "/sys/bus/hid/devices";
+
+/* below that many devices per thread, spawning costs more than it saves */
+const DEVICES_PER_THREAD: usize = 32;
+
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct HidDevice {
+    pub syspath: PathBuf,
+    pub sysname: String,
+    pub name: String,
+    pub driver: Option<String>,
+    pub modalias: String,
+    /// bus, group, vendor and product, see [`modalias::parse_fields()`]
+    pub ids: Option<(usize, usize, u32, u32)>,
+    pub rdesc: Vec<u8>,
+}
+
+pub fn bus_name(bus: usize) -> Option<&'static str> {
+    Some(match bus {
+        0x01 => "BUS_PCI",
+        0x02 => "BUS_ISAPNP",
+        0x03 => "BUS_USB",
+        0x04 => "BUS_HIL",
+        0x05 => "BUS_BLUETOOTH",
+        0x06 => "BUS_VIRTUAL",
+        0x10 => "BUS_ISA",
+        0x11 => "BUS_I8042",
+        0x12 => "BUS_XTKBD",
+        0x13 => "BUS_RS232",
+        0x14 => "BUS_GAMEPORT",
+        0x15 => "BUS_PARPORT",
+        0x16 => "BUS_AMIGA",
+        0x17 => "BUS_ADB",
+        0x18 => "BUS_I2C",
+        0x19 => "BUS_HOST",
+        0x1A => "BUS_GSC",
+        0x1B => "BUS_ATARI",
+        0x1C => "BUS_SPI",
+        0x1D => "BUS_RMI",
+        0x1E => "BUS_CEC",
+        0x1F => "BUS_INTEL_ISHTP",
+        0x20 => "BUS_AMD_SFH",
+        _ => return None,
+    })
+}
+
+pub fn group_name(group: usize) -> Option<&'static str> {
+    Some(match group {
+        0x0001 => "HID_GROUP_GENERIC",
+        0x0002 => "HID_GROUP_MULTITOUCH",
+        0x0003 => "HID_GROUP_SENSOR_HUB",
+        0x0004 => "HID_GROUP_MULTITOUCH_WIN_8",
+        0x0100 => "HID_GROUP_RMI",
+        0x0101 => "HID_GROUP_WACOM",
+        0x0102 => "HID_GROUP_LOGITECH_DJ_DEVICE",
+        0x0103 => "HID_GROUP_STEAM",
+        0x0104 => "HID_GROUP_LOGITECH_27MHZ_DEVICE",
+        0x0105 => "HID_GROUP_VIVALDI",
+        _ => return None,
+    })
+}
+
+impl HidDevice {
+    /// Fills in the device from the content of its `uevent` file
+    pub fn from_uevent(syspath: &Path, uevent: &str) -> Self {
+        let mut device = HidDevice {
+            syspath: syspath.to_path_buf(),
+            sysname: syspath
+                .file_name()
+                .map(|name| name.to_string_lossy().into_owned())
+                .unwrap_or_default(),
+            ..Default::default()
+        };
+
+        for line in uevent.lines() {
+            match line.split_once('=') {
+                Some(("HID_NAME", name)) => device.name = String::from(name),
+                Some(("DRIVER", driver)) => device.driver = Some(String::from(driver)),
+                Some(("MODALIAS", modalias)) => {
+                    device.modalias = String::from(modalias);
+                    device.ids = modalias::parse_fields(modalias);
+                }
+                _ => {}
+            }
+        }
+
+        device
+    }
+
+    pub fn read(syspath: &Path) -> std::io::Result<Self> {
+        let uevent = std::fs::read_to_string(syspath.join("uevent"))?;
+        let mut device = Self::from_uevent(syspath, &uevent);
+
+        /* not readable while the device is going away */
+        device.rdesc = std::fs::read(syspath.join("report_descriptor")).unwrap_or_default();
+
+        Ok(device)
+    }
+
+    /// `HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x045E, 0x07A5)`, as used
+    /// in the `HID_BPF_CONFIG` of the programs
+    pub fn device_entry(&self) -> Option<String> {
+        let (bus, group, vid, pid) = self.ids?;
+
+        Some(format!(
+            "HID_DEVICE({}, {}, 0x{:04X}, 0x{:04X})",
+            bus_name(bus).map_or(format!("0x{:04X}", bus), String::from),
+            group_name(group).map_or(format!("0x{:04X}", group), String::from),
+            vid,
+            pid,
+        ))
+    }
+
+    pub fn to_json(&self) -> String {
+        let number = |n: Option<u32>| n.map_or(String::from("null"), |n| n.to_string());
+
+        json::object(&[
+            ("syspath", json::string(&self.syspath.to_string_lossy())),
+            ("name", json::string(&self.name)),
+            (
+                "driver",
+                self.driver
+                    .as_deref()
+                    .map_or(String::from("null"), json::string),
+            ),
+            ("modalias", json::string(&self.modalias)),
+            ("bus", number(self.ids.map(|ids| ids.0 as u32))),
+            ("group", number(self.ids.map(|ids| ids.1 as u32))),
+            ("vid", number(self.ids.map(|ids| ids.2))),
+            ("pid", number(self.ids.map(|ids| ids.3))),
+            (
+                "device_entry",
+                self.device_entry()
+                    .as_deref()
+                    .map_or(String::from("null"), json::string),
+            ),
+            ("rdesc_size", self.rdesc.len().to_string()),
+        ])
+    }
+}
+
+/// Reads all the devices of `dir`, sorted by name. Devices that go away
+/// while being read are skipped.
+pub fn enumerate_dir(dir: &Path) -> std::io::Result<Vec<HidDevice>> {
+    let mut syspaths: Vec<PathBuf> = std::fs::read_dir(dir)?
+        .flatten()
+        .map(|entry| entry.path())
+        .collect();
+    syspaths.sort();
+
+    let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+    let chunk_size = ((syspaths.len() + threads - 1) / threads).max(DEVICES_PER_THREAD);
+
+    Ok(std::thread::scope(|scope| {
+        let readers: Vec<_> = syspaths
+            .chunks(chunk_size)
+            .map(|chunk| {
+                scope.spawn(move || {
+                    chunk
+                        .iter()
+                        .filter_map(|syspath| HidDevice::read(syspath).ok())
+                        .collect::<Vec<HidDevice>>()
+                })
+            })
+            .collect();
+
+        readers
+            .into_iter()
+            .flat_map(|reader| reader.join().unwrap_or_default())
+            .collect()
+    }))
+}
+
+pub fn enumerate() -> std::io::Result<Vec<HidDevice>> {
+    enumerate_dir(Path::new(HID_DEVICES_DIR))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const UEVENT: &str = "DRIVER=hid-generic\n\
+                          HID_ID=0003:0000045E:000007A5\n\
+                          HID_NAME=Microsoft Microsoft® 2.4GHz Transceiver v9.0\n\
+                          HID_PHYS=usb-0000:00:14.0-1/input1\n\
+                          HID_UNIQ=\n\
+                          MODALIAS=hid:b0003g0001v0000045Ep000007A5\n";
+
+    #[test]
+    fn test_from_uevent() {
+        let syspath = Path::new("/sys/bus/hid/devices/0003:045E:07A5.0002");
+        let device = HidDevice::from_uevent(syspath, UEVENT);
+        assert!(device.sysname == "0003:045E:07A5.0002");
+        assert!(device.name == "Microsoft Microsoft® 2.4GHz Transceiver v9.0");
+        assert!(device.driver.as_deref() == Some("hid-generic"));
+        assert!(device.ids == Some((3, 1, 0x045e, 0x07a5)));
+        assert!(
+            device.device_entry().unwrap()
+                == "HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x045E, 0x07A5)"
+        );
+        assert!(device
+            .to_json()
+            .contains("\"vid\": 1118, \"pid\": 1957, \"device_entry\": \"HID_DEVICE("));
+
+        /* an unknown group or a broken modalias doesn't prevent listing */
+        let device = HidDevice::from_uevent(syspath, "MODALIAS=hid:b0003g0F00v0000045Ep000007A5");
+        assert!(device.device_entry().unwrap().contains(", 0x0F00, "));
+        let device = HidDevice::from_uevent(syspath, "MODALIAS=hid:b0003");
+        assert!(device.device_entry().is_none());
+        assert!(device.to_json().contains("\"vid\": null"));
+    }
+
+    #[test]
+    fn test_enumerate_dir() {
+        let dir = std::env::temp_dir().join(format!("udev-hid-bpf-sysfs-{}", std::process::id()));
+        for idx in 0..100 {
+            let syspath = dir.join(format!("0003:045E:07A5.{:04X}", idx));
+            std::fs::create_dir_all(&syspath).unwrap();
+            std::fs::write(syspath.join("uevent"), UEVENT).unwrap();
+            std::fs::write(syspath.join("report_descriptor"), vec![0x05; idx]).unwrap();
+        }
+        /* not a device anymore */
+        std::fs::create_dir_all(dir.join("0003:045E:07A5.FFFF")).unwrap();
+
+        let devices = enumerate_dir(&dir).unwrap();
+        std::fs::remove_dir_all(&dir).unwrap();
+
+        assert!(devices.len() == 100);
+        for (idx, device) in devices.iter().enumerate() {
+            assert!(device.sysname == format!("0003:045E:07A5.{:04X}", idx));
+            assert!(device.rdesc.len() == idx);
+        }
+    }
+}
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+//! The device snapshot is read once per device and shared by every object
+//! loaded for it, so reading it must not allocate.
+//!
+//! This is its own test binary: the counting allocator below replaces the
+//! allocator of the whole binary, the unit tests of the crate don't run
+//! with it. The modules are included the same way build.rs does.
+
+#[allow(dead_code)]
+#[path = "../src/bpf.rs"]
+mod bpf;
+
+#[allow(dead_code)]
+#[path = "../src/datafile.rs"]
+mod datafile;
+
+#[allow(dead_code)]
+#[path = "../src/event_transform.rs"]
+mod event_transform;
+
+#[allow(dead_code)]
+#[path = "../src/hidudev.rs"]
+mod hidudev;
+
+#[allow(dead_code)]
+#[path = "../src/metrics.rs"]
+mod metrics;
+
+#[allow(dead_code)]
+#[path = "../src/modalias.rs"]
+mod modalias;
+
+#[allow(dead_code)]
+#[path = "../src/rdesc.rs"]
+mod rdesc;
+
+#[allow(dead_code)]
+#[path = "../src/rdesc_patch.rs"]
+mod rdesc_patch;
+
+#[allow(dead_code)]
+#[path = "../src/rodata.rs"]
+mod rodata;
+
+#[allow(dead_code)]
+#[path = "../src/signature.rs"]
+mod signature;
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+
+/* counts the allocations of the current thread, tests run in parallel */
+struct CountingAllocator;
+
+thread_local! {
+    static ALLOCATIONS: Cell<usize> = const { Cell::new(0) };
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.try_with(|a| a.set(a.get() + 1)).ok();
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+fn allocations() -> usize {
+    ALLOCATIONS.with(|a| a.get())
+}
+
+#[test]
+fn test_snapshot_doesnt_allocate() {
+    let modalias = modalias::Modalias::from_static_str("b0003g0001v000004D9p0000A09F").unwrap();
+    let rdesc = vec![0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0xc0];
+    let device = hidudev::DeviceSnapshot::new("0003:04D9:A09F.000B", modalias, rdesc).unwrap();
+
+    let before = allocations();
+    for _ in 0..100 {
+        assert!(device.id() == 0xb);
+        assert!(device.sysname() == "0003:04D9:A09F.000B");
+        assert!(device.modalias().vid == 0x04d9);
+        assert!(device.rdesc().len() == 7);
+        assert!(device.rdesc_hash() == bpf::content_hash(device.rdesc()));
+        assert!(device.bpffs_path() == "/sys/fs/bpf/hid/0003_04D9_A09F_000B/");
+
+        let args = bpf::hid_bpf_probe_args::from(&device);
+        assert!(args.hid == 0xb && args.rdesc_size == 7 && args.rdesc[5] == 0x01);
+    }
+    assert!(allocations() == before);
+}
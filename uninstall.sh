@@ -40,7 +40,8 @@ PREFIX=${1:-/usr/local}
 if [[ -z "$DRY_RUN" ]];
 then
   rm -f "$PREFIX"/bin/udev-hid-bpf
-  BPF=$(ls "$SCRIPT_DIR"/lib/firmware/hid/bpf/*.bpf.o)
+  BPF=$(find "$SCRIPT_DIR"/lib/firmware/hid/bpf -maxdepth 3 \
+        \( -name "*.bpf.o" -o -name "*.rdesc-patch" -o -name "*.event-transform" -o -name "*.bpf.o.conf" \))
   INSTALLED_BPF=${BPF//$SCRIPT_DIR/}
   rm -f $INSTALLED_BPF
   rm -f /etc/udev/rules.d/99-hid-bpf.rules